@@ -0,0 +1,60 @@
+#!/bin/bash
+# Throughput and latency benchmark for the flight scheduler.
+#
+#   ./bench.sh            run every workload and compare with bench_baseline.txt
+#   ./bench.sh baseline   run every workload and save the results as the baseline
+#
+# Each workload is generated by loadgen with a fixed seed, replayed through
+# scheduler -B, and reported per command type (see bench_report in
+# scheduler.c).  A command type whose ops/sec drops more than TOLERANCE
+# percent below the baseline is reported as a regression and the script
+# exits non-zero.
+
+MODE=$1
+TOLERANCE=${TOLERANCE:-20}
+BASELINE=bench_baseline.txt
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+# name and loadgen arguments of each workload
+WORKLOADS=(
+  "uniform   -s 1 -d 1000 -f 5 -n 1000000 -z 0"
+  "zipf      -s 2 -d 10000 -f 5 -n 1000000 -z 1.1"
+  "hubs      -s 3 -d 100 -f 200 -n 1000000 -z 1.2 -m s70,u25,l4,a0.5,r0.5"
+  "bulk      -s 4 -d 100000 -f 2 -n 200000 -z 0.8"
+)
+
+results="$WORK/results.txt"
+for w in "${WORKLOADS[@]}"; do
+  set -- $w
+  name=$1
+  shift
+  ./loadgen "$@" > "$WORK/$name.in" || exit 1
+  ./scheduler -q -B "$WORK/$name.report" -i "$WORK/$name.in" > /dev/null || exit 1
+  grep -v '^#' "$WORK/$name.report" | sed "s/^/$name /" >> "$results"
+done
+
+if [ "$MODE" = "baseline" ]; then
+  {
+    echo "# workload command count ops_per_sec p50_ns p90_ns p99_ns max_ns"
+    cat "$results"
+  } > "$BASELINE"
+  echo "Saved baseline to $BASELINE"
+  exit 0
+fi
+
+printf "%-8s %-4s %10s %12s %12s %8s %8s %8s\n" workload cmd count \
+  ops/sec baseline p50_ns p90_ns p99_ns
+[ -f "$BASELINE" ] || echo "No $BASELINE yet; run ./bench.sh baseline to create it."
+[ -f "$BASELINE" ] || BASELINE=/dev/null
+awk -v tol="$TOLERANCE" '
+  FILENAME == ARGV[1] { if ($1 !~ /^#/) base[$1 " " $2] = $4; next }
+  {
+    key = $1 " " $2
+    b = (key in base) ? base[key] : 0
+    flag = ""
+    if (b > 0 && $4 < b * (100 - tol) / 100) { flag = "  REGRESSION"; bad = 1 }
+    printf "%-8s %-4s %10d %12d %12d %8d %8d %8d%s\n", $1, $2, $3, $4, b, $5, $6, $7, flag
+  }
+  END { exit bad }
+' "$BASELINE" "$results"
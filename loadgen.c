@@ -0,0 +1,299 @@
+/**
+ * Synthetic workload generator for the flight scheduler.
+ *  Writes a stream of commands in the same format as sampleInput.txt:
+ *  first an A for every destination and an a for each of its flights, then
+ *  a seeded, repeatable mix of A/a/s/u/r/R/l/L commands where the city of
+ *  each command is drawn from a Zipf distribution so a few hubs get most
+ *  of the traffic.  A command drawn for a city that was removed by an
+ *  earlier R becomes an A, so removed cities come back instead of turning
+ *  the rest of the run into "No schedule" errors.
+ **/
+
+#define _GNU_SOURCE // getopt
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include <unistd.h>
+
+// Limit constants (must match scheduler.c)
+#define MAX_CITY_NAME_LEN 20
+#define TIME_MIN 0
+#define MINUTES_PER_DAY (60 * 24)
+#define CALENDAR_DAYS_MAX 366
+
+// Defaults
+#define DEFAULT_SEED 1
+#define DEFAULT_DESTINATIONS 1000
+#define DEFAULT_FLIGHTS 5
+#define DEFAULT_OPS 1000000
+#define DEFAULT_ZIPF 1.0
+#define DEFAULT_DAYS 1
+#define DEFAULT_MIX "s60,u20,l10,a4,r3,A1,R1,L0.01"
+
+/******************************************************************************
+ * Structure and Type definitions                                             *
+ ******************************************************************************/
+// One command in the operation mix and its share of the operations
+struct mix_entry
+{
+  char command;
+  double weight;
+};
+
+/******************************************************************************
+ * Global / External variables                                                *
+ ******************************************************************************/
+uint64_t rng_state;
+struct mix_entry mix[16];
+int mix_count = 0;
+double mix_total = 0;
+
+/******************************************************************************
+ * Function Prototypes                                                        *
+ ******************************************************************************/
+uint64_t rng_next(void);
+double rng_unit(void);
+void city_name(long id, char *name);
+double *zipf_table(long n, double s);
+long zipf_draw(const double *cdf, long n);
+bool mix_parse(const char *spec);
+char mix_draw(void);
+
+int main(int argc, char *argv[])
+{
+  uint64_t seed = DEFAULT_SEED;
+  long destinations = DEFAULT_DESTINATIONS;
+  long flights = DEFAULT_FLIGHTS;
+  long ops = DEFAULT_OPS;
+  double zipf = DEFAULT_ZIPF;
+  long days = DEFAULT_DAYS;
+  const char *mix_spec = DEFAULT_MIX;
+  int opt;
+
+  // Options:
+  //   -s seed   seed for the random number generator
+  //   -d n      number of destinations
+  //   -f n      flights added to each destination before the mix starts
+  //   -n n      number of operations in the mix
+  //   -z s      Zipf exponent for choosing cities (0 is uniform)
+  //   -m mix    command weights eg "s60,u20,l10,a4,r3,A1,R1,L0.01"
+  //   -D n      spread the times over n days (run the scheduler with -D n)
+  while ((opt = getopt(argc, argv, "s:d:f:n:z:m:D:")) != -1)
+  {
+    switch (opt)
+    {
+    case 's':
+      seed = strtoull(optarg, NULL, 10);
+      break;
+    case 'd':
+      destinations = atol(optarg);
+      break;
+    case 'f':
+      flights = atol(optarg);
+      break;
+    case 'n':
+      ops = atol(optarg);
+      break;
+    case 'z':
+      zipf = atof(optarg);
+      break;
+    case 'm':
+      mix_spec = optarg;
+      break;
+    case 'D':
+      days = atol(optarg);
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-s seed] [-d destinations] [-f flights] "
+                      "[-n ops] [-z zipf] [-m mix] [-D days]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (destinations <= 0 || flights < 0 || ops < 0 || zipf < 0 ||
+      days <= 0 || days > CALENDAR_DAYS_MAX || !mix_parse(mix_spec))
+  {
+    fprintf(stderr, "ERROR: Bad workload parameters.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  rng_state = seed * 0x9E3779B97F4A7C15ULL + 1;
+  long minutes = days * MINUTES_PER_DAY;
+  double *cdf = zipf_table(destinations, zipf);
+  bool *removed = calloc(destinations, sizeof(bool));
+  char name[MAX_CITY_NAME_LEN + 1];
+
+  if (removed == NULL)
+  {
+    fprintf(stderr, "ERROR: Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Setup: every destination with its flights
+  for (long d = 0; d < destinations; d++)
+  {
+    city_name(d, name);
+    printf("A %s\n", name);
+    for (long f = 0; f < flights; f++)
+      printf("a %s\n%ld %ld\n", name,
+             TIME_MIN + (long)(rng_next() % minutes),
+             1 + (long)(rng_next() % 300));
+  }
+
+  // The mix
+  for (long i = 0; i < ops; i++)
+  {
+    char command = mix_draw();
+    long time = TIME_MIN + (long)(rng_next() % minutes);
+    long d = zipf_draw(cdf, destinations);
+
+    if (command != 'L' && removed[d])
+      command = 'A';
+    if (command == 'A' || command == 'R')
+      removed[d] = command == 'R';
+    city_name(d, name);
+    switch (command)
+    {
+    case 'A':
+    case 'R':
+    case 'l':
+      printf("%c %s\n", command, name);
+      break;
+    case 'a':
+      printf("a %s\n%ld %ld\n", name, time, 1 + (long)(rng_next() % 300));
+      break;
+    case 'r':
+    case 's':
+    case 'u':
+      printf("%c %s\n%ld\n", command, name, time);
+      break;
+    case 'L':
+      printf("L\n");
+      break;
+    }
+  }
+  printf("q\n");
+
+  free(removed);
+  free(cdf);
+  return EXIT_SUCCESS;
+}
+
+/****************************************************************
+ * xorshift64* -- small, fast and the same on every platform    *
+ ****************************************************************/
+uint64_t rng_next(void)
+{
+  rng_state ^= rng_state >> 12;
+  rng_state ^= rng_state << 25;
+  rng_state ^= rng_state >> 27;
+  return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+// Uniform in [0, 1)
+double rng_unit(void)
+{
+  return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/****************************************************************
+ * Builds a pronounceable, unique name for destination id       *
+ ****************************************************************/
+void city_name(long id, char *name)
+{
+  static const char *syllables[] = {
+      "Ba", "Ke", "Lo", "Mi", "Nu", "Ra", "Si", "To", "Va", "Zo",
+      "Chi", "Dor", "Fen", "Gar", "Hal", "Jun", "Kir", "Lan", "Mor", "Pel"};
+  const long n = sizeof(syllables) / sizeof(syllables[0]);
+  int len = 0;
+
+  // the first syllable is capitalised already; the rest are lower cased
+  do
+  {
+    const char *s = syllables[id % n];
+    for (int i = 0; s[i] && len < MAX_CITY_NAME_LEN; i++, len++)
+      name[len] = (len == 0) ? s[i] : (char)(s[i] | 0x20);
+    id /= n;
+  } while (id > 0);
+  name[len] = '\0';
+}
+
+/****************************************************************
+ * Zipf: P(k) proportional to 1 / (k + 1)^s for k = 0 .. n - 1   *
+ ****************************************************************/
+double *zipf_table(long n, double s)
+{
+  double *cdf = malloc(n * sizeof(double));
+  double sum = 0;
+
+  if (cdf == NULL)
+  {
+    fprintf(stderr, "ERROR: Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (long k = 0; k < n; k++)
+  {
+    sum += 1.0 / pow(k + 1, s);
+    cdf[k] = sum;
+  }
+  for (long k = 0; k < n; k++)
+    cdf[k] /= sum;
+  return cdf;
+}
+
+long zipf_draw(const double *cdf, long n)
+{
+  double u = rng_unit();
+  long lo = 0, hi = n - 1;
+
+  while (lo < hi)
+  {
+    long mid = lo + (hi - lo) / 2;
+    if (cdf[mid] < u)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+/****************************************************************
+ * Command mix: comma separated <command><weight> pairs         *
+ ****************************************************************/
+bool mix_parse(const char *spec)
+{
+  while (*spec)
+  {
+    char *end;
+
+    if (mix_count == (int)(sizeof(mix) / sizeof(mix[0])) ||
+        strchr("AaRrsulL", *spec) == NULL)
+      return false;
+    mix[mix_count].command = *spec++;
+    mix[mix_count].weight = strtod(spec, &end);
+    if (end == spec || mix[mix_count].weight < 0)
+      return false;
+    mix_total += mix[mix_count++].weight;
+    spec = end;
+    if (*spec == ',')
+      spec++;
+  }
+  return mix_total > 0;
+}
+
+char mix_draw(void)
+{
+  double u = rng_unit() * mix_total;
+
+  for (int i = 0; i < mix_count - 1; i++)
+  {
+    if (u < mix[i].weight)
+      return mix[i].command;
+    u -= mix[i].weight;
+  }
+  return mix[mix_count - 1].command;
+}
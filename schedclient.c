@@ -0,0 +1,401 @@
+/**
+ * Client and load driver for the flight scheduler's server mode.
+ *  With one connection (the default) it sends commands from a file or
+ *  standard input to "scheduler -u path" or "scheduler -p port" and copies
+ *  the replies to standard output, so the output matches "scheduler -q"
+ *  run on the same commands.  Commands are sent as fast as the socket
+ *  takes them without waiting for replies, so the server sees them
+ *  pipelined and has to answer them in order.
+ *  With -c n it instead opens n connections at once, sends the whole
+ *  command file on every one of them, reads the replies until the server
+ *  closes each connection and reports the command rate over all of them.
+ **/
+
+#define _GNU_SOURCE // getopt
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+// Defaults
+#define DEFAULT_CONNECTIONS 1
+#define BUFFER_SIZE (64 * 1024) // bytes moved at a time
+
+/******************************************************************************
+ * Structure and Type definitions                                             *
+ ******************************************************************************/
+// One connection of the load driver
+struct connection
+{
+  int fd;
+  size_t sent;    // bytes of the command file sent so far
+  bool shut;      // everything sent and our side shut down
+  bool done;      // the server has closed its side
+  uint64_t bytes; // reply bytes received
+  uint64_t ended; // when the server closed, in ns
+};
+
+/******************************************************************************
+ * Function Prototypes                                                        *
+ ******************************************************************************/
+uint64_t now_ns(void);
+int server_connect(const char *path, int port);
+char *file_load(const char *path, size_t *len);
+long commands_count(const char *buf, size_t len);
+void copy_session(int fd, int in);
+void drive_load(const char *path, int port, int count, const char *buf,
+                size_t len);
+
+int main(int argc, char *argv[])
+{
+  const char *path = NULL;
+  int port = 0;
+  int connections = DEFAULT_CONNECTIONS;
+  bool driver = false;
+  int opt;
+
+  // Options:
+  //   -u path  connect to the scheduler's Unix socket path
+  //   -p port  connect to port on the loopback address
+  //   -c n     load driver: send the command file on n connections at once
+  while ((opt = getopt(argc, argv, "u:p:c:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'u':
+      path = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 'c':
+      connections = atoi(optarg);
+      driver = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s (-u path | -p port) [-c connections] "
+                      "[file]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if ((path == NULL) == (port <= 0 || port > 65535) || connections <= 0)
+  {
+    fprintf(stderr, "ERROR: Give exactly one of -u path and -p port.\n");
+    exit(EXIT_FAILURE);
+  }
+  const char *file = optind < argc ? argv[optind] : NULL;
+
+  signal(SIGPIPE, SIG_IGN);
+  if (!driver)
+  {
+    int in = file == NULL ? 0 : open(file, O_RDONLY);
+    if (in < 0)
+    {
+      fprintf(stderr, "ERROR: Cannot open %s.\n", file);
+      exit(EXIT_FAILURE);
+    }
+    copy_session(server_connect(path, port), in);
+  }
+  else
+  {
+    size_t len;
+    char *buf = file_load(file, &len);
+    drive_load(path, port, connections, buf, len);
+    free(buf);
+  }
+  return EXIT_SUCCESS;
+}
+
+uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/****************************************************************
+ * Opens a non blocking connection to the scheduler             *
+ ****************************************************************/
+int server_connect(const char *path, int port)
+{
+  int fd;
+  bool ok;
+
+  if (path != NULL)
+  {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    ok = fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  }
+  else
+  {
+    struct sockaddr_in addr;
+    int one = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    ok = fd >= 0 &&
+         connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+         setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) == 0;
+  }
+  if (!ok || fcntl(fd, F_SETFL, O_NONBLOCK) != 0)
+  {
+    fprintf(stderr, "ERROR: Cannot connect to the scheduler.\n");
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+/****************************************************************
+ * Reads a whole command file, or standard input, into memory   *
+ ****************************************************************/
+char *file_load(const char *path, size_t *len)
+{
+  int fd = path == NULL ? 0 : open(path, O_RDONLY);
+  size_t size = BUFFER_SIZE;
+  char *buf = malloc(size);
+  ssize_t got;
+
+  if (fd < 0 || buf == NULL)
+  {
+    fprintf(stderr, "ERROR: Cannot read the command file.\n");
+    exit(EXIT_FAILURE);
+  }
+  *len = 0;
+  while ((got = read(fd, buf + *len, size - *len)) > 0)
+  {
+    *len += got;
+    if (*len == size)
+    {
+      buf = realloc(buf, size *= 2);
+      if (buf == NULL)
+      {
+        fprintf(stderr, "ERROR: Out of memory.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  if (fd != 0)
+    close(fd);
+  return buf;
+}
+
+// Every command starts a line with its letter; the times, capacities and
+// tickets on the second line of a/r/s/u/b/f/Q/c start with a digit or a
+// sign.  The two lines of each tuple of a B belong to the B.
+long commands_count(const char *buf, size_t len)
+{
+  long count = 0;
+  long skip = 0; // lines of a B still to come
+  bool start = true;
+
+  for (size_t i = 0; i < len; i++)
+  {
+    char ch = buf[i];
+    if (start && skip == 0 &&
+        ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z')))
+    {
+      count++;
+      if (ch == 'B')
+      {
+        size_t j = i + 1;
+        while (j < len && (buf[j] == ' ' || buf[j] == '\t'))
+          j++;
+        for (; j < len && buf[j] >= '0' && buf[j] <= '9'; j++)
+          skip = skip * 10 + (buf[j] - '0');
+        skip = 2 * skip + 1;
+      }
+    }
+    if (ch == '\n' && skip > 0)
+      skip--;
+    if (ch != ' ' && ch != '\t')
+      start = ch == '\n';
+  }
+  return count;
+}
+
+/****************************************************************
+ * One connection: in to the server, replies to standard output *
+ ****************************************************************/
+void copy_session(int fd, int in)
+{
+  char *pending = malloc(BUFFER_SIZE);
+  char *reply = malloc(BUFFER_SIZE);
+  size_t len = 0, sent = 0;
+  bool in_eof = false, shut = false;
+
+  if (pending == NULL || reply == NULL)
+  {
+    fprintf(stderr, "ERROR: Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  while (true)
+  {
+    struct pollfd pfd[2] = {{fd, POLLIN, 0}, {in, 0, 0}};
+    if (sent < len)
+      pfd[0].events |= POLLOUT;
+    else if (!in_eof)
+      pfd[1].events = POLLIN;
+    if (poll(pfd, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (pfd[1].events != 0 && pfd[1].revents != 0)
+    {
+      ssize_t got = read(in, pending, BUFFER_SIZE);
+      if (got > 0)
+      {
+        len = got;
+        sent = 0;
+      }
+      else
+      {
+        in_eof = true;
+      }
+    }
+    if (sent < len && (pfd[0].revents & POLLOUT))
+    {
+      ssize_t put = write(fd, pending + sent, len - sent);
+      if (put > 0)
+        sent += put;
+      else if (errno != EAGAIN && errno != EINTR)
+        break;
+    }
+    if (in_eof && sent == len && !shut)
+    {
+      shutdown(fd, SHUT_WR); // the server runs a command cut short by EOF
+      shut = true;
+    }
+    if (pfd[0].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      ssize_t got = read(fd, reply, BUFFER_SIZE);
+      if (got == 0 || (got < 0 && errno != EAGAIN && errno != EINTR))
+        break; // the server has closed the connection
+      if (got > 0 && write(1, reply, got) != got)
+        break;
+    }
+  }
+  close(fd);
+  free(pending);
+  free(reply);
+}
+
+/****************************************************************
+ * Load driver: the same commands on count connections at once  *
+ ****************************************************************/
+void drive_load(const char *path, int port, int count, const char *buf,
+                size_t len)
+{
+  struct connection *conns = calloc(count, sizeof(struct connection));
+  struct pollfd *pfd = calloc(count, sizeof(struct pollfd));
+  char *reply = malloc(BUFFER_SIZE);
+  int left = count; // connections the server has not closed yet
+
+  if (conns == NULL || pfd == NULL || reply == NULL)
+  {
+    fprintf(stderr, "ERROR: Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  uint64_t started = now_ns();
+  for (int i = 0; i < count; i++)
+    conns[i].fd = server_connect(path, port);
+
+  while (left > 0)
+  {
+    for (int i = 0; i < count; i++)
+    {
+      struct connection *c = &conns[i];
+      pfd[i].fd = c->done ? -1 : c->fd;
+      pfd[i].events = POLLIN | (c->sent < len ? POLLOUT : 0);
+      pfd[i].revents = 0;
+    }
+    if (poll(pfd, count, -1) < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+      struct connection *c = &conns[i];
+      if (c->done)
+        continue;
+      if (pfd[i].revents & POLLOUT)
+      {
+        size_t n = len - c->sent < BUFFER_SIZE ? len - c->sent : BUFFER_SIZE;
+        ssize_t put = write(c->fd, buf + c->sent, n);
+        if (put > 0)
+          c->sent += put;
+      }
+      if (c->sent == len && !c->shut)
+      {
+        shutdown(c->fd, SHUT_WR);
+        c->shut = true;
+      }
+      if (pfd[i].revents & (POLLIN | POLLHUP | POLLERR))
+      {
+        ssize_t got = read(c->fd, reply, BUFFER_SIZE);
+        if (got > 0)
+        {
+          c->bytes += got;
+        }
+        else if (got == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+          c->done = true;
+          c->ended = now_ns();
+          close(c->fd);
+          left--;
+        }
+      }
+    }
+  }
+
+  double seconds = (now_ns() - started) / 1e9;
+  double fastest = 0, slowest = 0;
+  uint64_t bytes = 0;
+  for (int i = 0; i < count; i++)
+  {
+    double s = (conns[i].ended - started) / 1e9;
+    if (i == 0 || s < fastest)
+      fastest = s;
+    if (s > slowest)
+      slowest = s;
+    bytes += conns[i].bytes;
+  }
+  long commands = commands_count(buf, len) * (long)count;
+
+  printf("connections    %d\n", count);
+  printf("commands       %ld\n", commands);
+  printf("seconds        %.3f\n", seconds);
+  printf("commands/sec   %.0f\n", seconds > 0 ? commands / seconds : 0);
+  printf("reply bytes    %llu\n", (unsigned long long)bytes);
+  printf("connection sec %.3f fastest, %.3f slowest\n", fastest, slowest);
+
+  free(reply);
+  free(pfd);
+  free(conns);
+}
@@ -3,54 +3,333 @@
  *  Let's use our knowledge to write a simple flight management system!
  **/
 
+#define _GNU_SOURCE // MAP_ANONYMOUS, MAP_HUGETLB, getopt
+
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
 #include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 // Limit constants
 #define MAX_CITY_NAME_LEN 20
-#define MAX_FLIGHTS_PER_CITY 5
+#define CITY_PAGE_SIZE 1024            // city names per page of the name table
+#define CITY_PAGES 65536               // so at most 64M distinct city names
+#define CITY_TREE_FANOUT 32            // names per leaf, children per inner node
+#define MAX_FLIGHTS_INLINE 5           // flights stored inside the schedule
+#define MAX_FLIGHTS_PER_CITY (1 << 20) // hard limit on flights for one city
 #define MAX_DEFAULT_SCHEDULES 50
 
+// Schedule pool constants
+#define SCHEDULE_SLAB_MIN 64                 // fewest schedules in a new slab
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)   // size used for MAP_HUGETLB slabs
+
+// Input constants
+#define INPUT_BUFFER_SIZE (64 * 1024) // bytes read() from a pipe or tty at once
+
+// Batch constants
+#define BATCH_TUPLES_MAX (1 << 20) // tuples in one B command at most
+#define BATCH_TUPLES_MIN 64        // tuples the batch buffer first has room for
+#define BATCH_LINE_MAX 64          // bytes kept of a tuple's time and seats line
+
+// Waitlist constants
+#define WAITLIST_SLAB 4096  // waiters allocated at a time
+#define WAITLIST_SLABS 4096 // so at most 16M waiters at once
+#define WAITLIST_NOTICES_MIN 16 // notices a thread first has room for
+
+// Change feed constants
+#define FEED_RING_RECORDS 1024 // deltas a subscriber holds, a power of two
+#define FEED_TAKE 64           // deltas copied out of a ring at a time
+
+// Output constants
+#define OUTPUT_CHUNK_SIZE (64 * 1024) // bytes in one output chunk
+#define OUTPUT_CHUNKS 16              // chunks gathered by one writev()
+
+// Server constants
+#define SERVER_BACKLOG 128               // connections waiting to be accepted
+#define SERVER_EVENTS 64                 // epoll events handled per wakeup
+#define SERVER_READ_SIZE (64 * 1024)     // bytes read from a client at once
+#define SERVER_OUTPUT_MAX (1024 * 1024)  // unsent replies before we stop reading
+#define SERVER_COMMAND_MAX (1024 * 1024) // bytes of a command not yet whole
+
+// Timetable import constants
+#define IMPORT_THREADS_MAX 8          // threads parsing a timetable at most
+#define IMPORT_SPLIT_MIN (1UL << 20)  // bytes of timetable per parsing thread
+#define IMPORT_ROWS_MIN 1024          // rows a part first has room for
+
+// Shard constants
+#define SHARDS_MAX 64            // scheduler processes behind one router (-N)
+#define SHARD_BATCH (16 * 1024)  // request bytes gathered for a shard per send
+#define SHARD_POLL_COMMANDS 64   // commands routed between looks for replies
+#define ROUTES_MIN 1024          // replies the router first has room to await
+
+// Replica constants
+#define REPLICA_MAGIC "FLTREPL"      // first 8 bytes of a replica segment
+#define REPLICA_VERSION 2
+#define REPLICA_CITIES (1 << 20)     // city ids a segment has slots for
+#define REPLICA_HEAP_BYTES (1UL << 30) // flight records, mapped sparse
+#define REPLICA_RETRIES 64           // reads of a busy city before yielding
+
+// Pipeline constants
+#define PIPELINE_RING_RECORDS 4096 // records between two stages, a power of two
+#define PIPELINE_SPINS 4096        // polls of an empty or full ring before sleeping
+#define PIPELINE_YIELDS 64         // the same with one CPU, yielding between polls
+
+// Locking constants
+#define LOCK_STRIPES 256 // mutexes shared out among the schedules
+
+// Snapshot constants
+#define SNAPSHOT_MAGIC "FLTSNAP"     // first 8 bytes of a snapshot file
+#define SNAPSHOT_VERSION 3           // bumped whenever the layout changes
+#define SNAPSHOT_BYTE_ORDER 0x01020304 // written natively to catch endianness
+
+// Journal constants
+#define JOURNAL_MAGIC "FLTWAL1"      // first 8 bytes of a journal file
+#define JOURNAL_VERSION 3
+#define JOURNAL_RECORD_MAX (2 + MAX_CITY_NAME_LEN + 4 + 4 + 4) // longest record
+#define JOURNAL_GROUP_OPS 64         // default records per group commit
+#define JOURNAL_GROUP_USEC 1000      // default longest wait for a commit
+
+// Flight arena constants
+#define FLIGHT_ARENA_MIN_BLOCK 8            // flights in the smallest block
+#define FLIGHT_ARENA_CLASSES 24             // block sizes 8, 16, ... 8 << 23
+#define FLIGHT_ARENA_CHUNK (1UL << 20)      // bytes mapped at a time for blocks
+#define FLIGHT_FIELDS 5                     // times, available, capacity,
+                                            // entries, waitlists
+#define FLIGHT_SCAN_MAX 64                  // longest run the seek kernel scans
+
+// Time index constants
+#define TIME_BUCKET_MIN_SLOTS 8 // flights a minute's bucket first has room for
+
+// Statistics constants
+#ifndef SCHEDULER_STATS
+#define SCHEDULER_STATS 1 // build with -DSCHEDULER_STATS=0 to leave them out
+#endif
+#define STATS_BUCKETS 64  // histogram bucket b counts values below 2^b
+
 // Time definitions
+#define MINUTES_PER_DAY (60 * 24)
 #define TIME_MIN 0
-#define TIME_MAX ((60 * 24) - 1)
 #define TIME_NULL -1
+#define CALENDAR_DAYS_MAX 366 // longest calendar -D may ask for
+#define CALENDAR_DAY_LIMIT (INT32_MAX / MINUTES_PER_DAY) // so times fit 32 bits
 
 /******************************************************************************
  * Structure and Type definitions                                             *
  ******************************************************************************/
-typedef int time_t; // integers used for time values
+typedef int flight_time_t; // integers used for time values
 typedef char city_t[MAX_CITY_NAME_LEN + 1];
 ; // null terminate fixed length city
-
-// Structure to hold all the information for a single flight
-//   A city's schedule has an array of these
-struct flight
-{
-  int time;      // departure time of the flight
-  int available; // number of seats currently available on the flight
-  int capacity;  // maximum seat capacity of the flight
-};
+typedef uint32_t city_id_t; // a city name's index in the city table
+#define CITY_NONE UINT32_MAX
 
 // Structure for an individual flight schedule
-// The main data structure of the program is an Array of these structures
+// The main data structure of the program is a pool of these structures
 // Each structure will be placed on one of two linked lists:
 //                free or active
 // Initially the active list will be empty and all the schedules
 // will be on the free list.  Adding a schedule is finding the first
 // free schedule on the free list, removing it from the free list,
 // setting its destination city and putting it on the active list
+//
+// Flight i of a schedule is times[i], available[i] and capacity[i], for
+// i in 0 .. flight_count - 1, kept in order of departure time (flights
+// with equal times in the order they were added).  entries[i] is where the
+// flight is filed in the time index and waitlists[i] is the first waiter
+// for a seat on it (see struct waiter).  The five arrays are stored one
+// after another in a single block of flight_slots * 5 ints, so a seat
+// search streams through just the times and seat counts.  Most
+// cities only have a handful of flights so the block is flights_inline;
+// once a city outgrows that, it is a larger block from the flight arena.
+// available[i] is updated with atomic compare and swap (see
+// flight_schedule_take_seat).  Bit i of open_seats is set when flight i has
+// a seat available, which lets a seat search skip over sold out flights 64
+// at a time.
 struct flight_schedule
 {
-  city_t destination;                          // destination city name
-  struct flight flights[MAX_FLIGHTS_PER_CITY]; // array of flights to the city
-  struct flight_schedule *next;                // link list next pointer
-  struct flight_schedule *prev;                // link list prev pointer
+  city_id_t destination;      // destination city
+  int flight_count;           // flights in use
+  int flight_slots;           // room in each of the arrays
+  int *times;                 // departure times, ascending
+  int *available;             // seats currently available
+  int *capacity;              // maximum seat capacity
+  int *entries;               // place of each flight in its time bucket
+  int *waitlists;             // first waiter for each flight, 0 for none
+  uint64_t *open_seats;       // &open_seats_inline or heap
+  uint64_t open_seats_inline; // bitmap for small cities
+  int flights_inline[FLIGHT_FIELDS * MAX_FLIGHTS_INLINE]; // small cities
+  uint64_t stamp;               // larger nearer the front of the active list
+  struct flight_schedule *next; // link list next pointer
+  struct flight_schedule *prev; // link list prev pointer
+};
+
+// Result of a request made through the booking API
+enum booking_status
+{
+  BOOKING_OK,          // done
+  BOOKING_NOTHING,     // valid request with nothing to do (the null time)
+  BOOKING_NO_SCHEDULE, // no schedule for the city
+  BOOKING_EXISTS,      // the city already has a schedule
+  BOOKING_NO_FREE,     // no memory for another schedule
+  BOOKING_MAX_FLIGHTS, // no room for another flight on the city
+  BOOKING_BAD_TIME,    // no flight at that time
+  BOOKING_NO_SEATS,    // no flight at or after that time has a seat
+  BOOKING_ALL_EMPTY,   // every seat on the flight is already free
+  BOOKING_TOO_FEW,     // fewer seats on the flight are taken than asked for
+  BOOKING_WAITLISTED,  // no seat, so waiting in line for one
+  BOOKING_NO_TICKET,   // no such ticket on the city's waitlists
+  BOOKING_STATUSES     // number of statuses
+};
+
+// What was wrong with a command's arguments.  The stdin and server loops
+// print the message as soon as they read them; pipelined mode (-P) hands
+// it on to be printed in its turn.
+enum parse_error
+{
+  PARSE_OK,           // every argument read and valid
+  PARSE_NO_SCHEDULE,  // a r s u b f: no schedule, nothing read after the city
+  PARSE_TIME_BAD,     // "Invalid time value"
+  PARSE_CAPACITY_BAD, // "Invalid capacity value"
+  PARSE_PAGE_BAD,     // "Invalid page value"
+  PARSE_ROW_BAD,      // -I: "Invalid timetable row"
+  PARSE_SHARD_BAD,    // -N: "Invalid shard value"
+  PARSE_SEATS_BAD,    // "Invalid seats value"
+  PARSE_BATCH_BAD,    // "Invalid batch value"
+  PARSE_TICKET_BAD,   // "Invalid ticket value"
+  PARSE_DAYS_BAD,     // "Invalid days value"
+  PARSE_QUIET         // out of range, dropped without a message
+};
+
+// Layout of a snapshot file.  A header is followed by one fixed size record
+// per active schedule, in active list order, and then by the flights of
+// every schedule, schedule after schedule, each in time order.
+struct snapshot_header
+{
+  char magic[8];         // SNAPSHOT_MAGIC
+  uint32_t version;      // SNAPSHOT_VERSION
+  uint32_t byte_order;   // SNAPSHOT_BYTE_ORDER
+  uint64_t schedules;    // number of schedule records
+  uint64_t flights;      // number of flight records
+  uint64_t journal_seq;  // journal records already reflected in the state
+  int32_t first_day;     // the calendar's first day
+  uint32_t reserved;     // zero
+};
+
+struct snapshot_schedule
+{
+  char destination[24];  // city name, zero padded
+  uint32_t flight_count; // flights of this schedule in the flight records
+  uint32_t reserved;     // zero
+};
+
+struct snapshot_flight
+{
+  int32_t time;
+  int32_t available;
+  int32_t capacity;
+};
+
+// A journal file is a header followed by one record per command that
+// changed the schedules: the command letter (A R a r s u, or b f for more
+// than one seat at once), the length of the city name, the city name, then
+// a 32 bit time for a r s u b f and a 32 bit capacity or seat count for
+// a b f.  m restores one flight of a schedule moved in from another shard
+// (-N) exactly as it was: its time, capacity and then the seats still
+// available.  D, which rolls the calendar forward, has no city name and
+// just the 32 bit number of days.  Record k of the file has sequence number
+// base_seq + k.  Versions 1 and 2 had 16 bit times and no D records, and
+// version 1 no b or f records either.
+struct journal_header
+{
+  char magic[8];         // JOURNAL_MAGIC
+  uint32_t version;      // JOURNAL_VERSION
+  uint32_t byte_order;   // SNAPSHOT_BYTE_ORDER
+  uint64_t base_seq;     // sequence number of the record before the first
+};
+
+// One journal record as read back
+struct journal_entry
+{
+  char op;
+  city_t name; // empty for D
+  int time;
+  int count;   // capacity or seats of a b f m, days of D
+  int available; // seats still available on the flight of an m
+};
+
+// Latencies of every command of one type, kept for the -B timing report
+struct bench_samples
+{
+  uint32_t *ns;       // latency of each command in nanoseconds
+  size_t count;       // samples in ns
+  size_t size;        // room in ns
+  uint64_t total_ns;  // sum of the samples
+};
+
+// Log bucketed histogram: bucket b counts the values v with
+// 2^(b-1) <= v < 2^b (bucket 0 counts zeros)
+struct stats_histogram
+{
+  uint64_t buckets[STATS_BUCKETS];
+  uint64_t count;
+  uint64_t sum;
 };
 
+// Counters and histograms for the stats command and SIGUSR1.  Updated with
+// relaxed atomic adds since the booking API may run on many threads.
+struct scheduler_stats
+{
+  struct stats_histogram command_ns[128]; // latency by command character
+  struct stats_histogram find_probes;     // city table slots looked at per find
+  uint64_t status[BOOKING_STATUSES];      // booking results by status
+  uint64_t seat_later_flight;             // s booked a flight after the time
+  uint64_t seat_retries;                  // s lost a seat to another thread
+  uint64_t waitlist_seated;               // waiters handed a seat given back
+  uint64_t feed_deltas;                   // deltas put in subscribers' rings
+  uint64_t feed_dropped;                  // deltas overwritten unprinted
+  uint64_t flights_retired;               // flights D rolled off the calendar
+};
+
+#if SCHEDULER_STATS
+#define STATS_COUNT(counter) \
+  __atomic_fetch_add(&stats.counter, 1, __ATOMIC_RELAXED)
+#define STATS_ADD(counter, n) \
+  __atomic_fetch_add(&stats.counter, (n), __ATOMIC_RELAXED)
+#define STATS_RECORD(histogram, value) stats_record(&stats.histogram, (value))
+#define STATS_COMMAND(command, ns) stats_command((command), (ns))
+#define STATS_POLL() stats_poll()
+#else
+#define STATS_COUNT(counter) ((void)0)
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_RECORD(histogram, value) ((void)0)
+#define STATS_COMMAND(command, ns) ((void)0)
+#define STATS_POLL() ((void)0)
+#endif
+
 /******************************************************************************
  * Global / External variables                                                *
  ******************************************************************************/
@@ -59,622 +338,8938 @@ struct flight_schedule
 struct flight_schedule *flight_schedules_free = NULL;
 struct flight_schedule *flight_schedules_active = NULL;
 
-/******************************************************************************
- * Function Prototypes                                                        *
- ******************************************************************************/
-// Misc utility io functions
-int city_read(city_t city);
-bool time_get(time_t *time_ptr);
-bool flight_capacity_get(int *capacity_ptr);
-void print_command_help(void);
+// City names are interned: each distinct name gets a small integer id the
+// first time A, F or a load sees it, and everything past the parser works
+// on ids, so finding a city's schedule is an array access and names are
+// only touched again for printing.  Other commands only look a name up, so
+// names nobody adds cannot fill the table.  Entries live in fixed size
+// pages that never move, so a name or schedule can be read through an id
+// without the table's lock; only finding or adding a name takes it.  The
+// name lookup uses open addressing with linear probing and each slot
+// caches the hash of its name.  Names are never removed, so the ids of
+// cities whose schedules are removed stay valid.
+struct city_entry
+{
+  city_t name;                      // the city's name
+  struct flight_schedule *schedule; // its active schedule, or NULL
+  bool scheduled;                   // -P: whether the parser expects one
+  city_id_t replica;                // -r: its id in the replica plus one
+  int shard;                        // -N: the shard it was put on plus one
+  struct feed_link *feed;           // F: who is told of its changes
+};
 
-// Core functions of the program
-void flight_schedule_initialize(struct flight_schedule array[], int n);
-struct flight_schedule *flight_schedule_find(city_t city);
-struct flight_schedule *flight_schedule_allocate(void);
-void flight_schedule_free(struct flight_schedule *fs);
-void flight_schedule_add(city_t city);
-void flight_schedule_listAll(void);
-void flight_schedule_list(city_t city);
-void flight_schedule_add_flight(city_t city);
-void flight_schedule_remove_flight(city_t city);
-void flight_schedule_schedule_seat(city_t city);
-void flight_schedule_unschedule_seat(city_t city);
-void flight_schedule_remove(city_t city);
+struct city_slot
+{
+  unsigned int hash; // hash of the name
+  city_id_t id;      // CITY_NONE when the slot is empty
+};
+
+struct city_table
+{
+  struct city_entry *pages[CITY_PAGES]; // CITY_PAGE_SIZE entries each
+  uint32_t count;                       // ids handed out
+  struct city_slot *slots;              // power of two sized table
+  size_t mask;                          // number of slots - 1
+  pthread_mutex_t lock;                 // finding or adding a name
+};
 
-void flight_schedule_sort_flights_by_time(struct flight_schedule *fs);
-int flight_compare_time(const void *a, const void *b);
+struct city_table city_table = {{NULL}, 0, NULL, 0, PTHREAD_MUTEX_INITIALIZER};
 
-int main(int argc, char *argv[])
+// The entry of CITY_NONE, which a lookup gives for a name not in the
+// table.  It holds the name the thread last looked up and never has a
+// schedule, so a command about that name fails as for any city without
+// one and prints the name.
+__thread struct city_entry city_missing;
+
+// The names of the cities with an active schedule are also kept in
+// alphabetical order in a B+ tree.  Leaves hold the names themselves and
+// are chained in order, so a listing scans leaves one after another and
+// never touches the city table.  An inner node keeps, for each child, the
+// lowest name that may be found below it and the number of cities below
+// it, so a listing can start at any position after one descent.  The
+// first 8 bytes of each name are also kept as a big endian integer so a
+// search compares integers and only reads a name on a tie.  Leaves and
+// inner nodes share one layout.
+struct city_tree_node
 {
-  long n = MAX_DEFAULT_SCHEDULES;
-  char command;
-  city_t city;
+  int count;                                         // names or children
+  struct city_tree_node *prev;                       // leaf to the left
+  struct city_tree_node *next;                       // leaf to the right
+  uint64_t keys[CITY_TREE_FANOUT];                   // leading bytes of names
+  uint32_t sizes[CITY_TREE_FANOUT];                  // cities below a child
+  struct city_tree_node *children[CITY_TREE_FANOUT]; // inner nodes only
+  city_t names[CITY_TREE_FANOUT];                    // names or separators
+};
 
-  if (argc > 1)
-  {
-    // If the program was passed an argument then try and convert the first
-    // argument in the a number that will override the default max number
-    // of schedule we will support
-    char *end;
-    n = strtol(argv[1], &end, 10); // CPAMA p 787
-    if (n == 0)
-    {
-      printf("ERROR: Bad number of default max scedules specified.\n");
-      exit(EXIT_FAILURE);
-    }
-  }
+struct city_tree
+{
+  struct city_tree_node *root;  // NULL until the first city is added
+  int height;                   // inner levels above the leaves
+  uint32_t count;               // cities in the tree
+  struct city_tree_node *spare; // nodes set aside for splits
+  int spares;                   // nodes on the spare list
+};
 
-  // C99 lets us allocate an array of a fixed length as a local
-  // variable.  Since we are doing this in main and a call to main will be
-  // active for the entire time of the program's execution this
-  // array will be alive for the entire time -- its memory and values
-  // will be stable for the entire program execution.
-  struct flight_schedule flight_schedules[n];
+struct city_tree city_tree = {NULL, 0, 0, NULL, 0};
 
-  // Initialize our global lists of free and active schedules using
-  // the elements of the flight_schedules array
-  flight_schedule_initialize(flight_schedules, n);
+// All schedules live in slabs obtained from mmap.  Slabs are never returned
+// to the system; a schedule that is removed goes back on the free list.  A
+// fresh slab is not linked into the free list up front -- schedules are
+// handed out from its unused tail (the bump region) one at a time, so
+// reserving a large pool only costs address space until it is used.
+struct flight_schedule_slab
+{
+  struct flight_schedule_slab *next; // list of all slabs
+  size_t bytes;                      // length of the mapping
+  size_t count;                      // schedules in this slab
+  struct flight_schedule schedules[];
+};
 
-  // DEFENSIVE PROGRAMMING:  Write code that avoids bad things from happening.
-  //  When possible, if we know that some particular thing should have happened
-  //  we think of that as an assertion and write code to test them.
-  // Use the assert function (CPAMA p749) to be sure the initilization has set
-  // the free list to a non-null value and the the active list is a null value.
-  assert(flight_schedules_free != NULL && flight_schedules_active == NULL);
+struct flight_schedule_pool
+{
+  struct flight_schedule_slab *slabs; // every slab mapped so far
+  struct flight_schedule *bump;       // next never used schedule
+  size_t bump_left;                   // never used schedules left in bump
+  size_t total;                       // schedules across all slabs
+  bool huge_pages;                    // try MAP_HUGETLB for new slabs
+  uint64_t stamps;                    // schedules put on the active list
+};
 
-  // Print the instruction in the beginning
-  print_command_help();
+struct flight_schedule_pool flight_schedules_pool = {NULL, NULL, 0, 0, false,
+                                                     0};
 
-  // Command processing loop
-  while (scanf(" %c", &command) == 1)
-  {
-    switch (command)
-    {
-    case 'A':
-      //  Add an active flight schedule for a new city eg "A Toronto\n"
-      city_read(city);
-      flight_schedule_add(city);
+// Flight arrays that outgrow flights_inline are carved from large mappings
+// in power of two size classes.  Released blocks go on a free list for
+// their class so a busy hub that shrinks and grows again reuses memory.
+struct flight_arena
+{
+  int *free_blocks[FLIGHT_ARENA_CLASSES];           // singly linked by first word
+  char *chunk;                                      // unused part of last chunk
+  size_t chunk_left;                                // bytes left in chunk
+};
 
-      break;
-    case 'L':
-      // List all active flight schedules eg. "L\n"
-      flight_schedule_listAll();
-      break;
-    case 'l':
-      // List the flights for a particular city eg. "l\n"
-      city_read(city);
-      flight_schedule_list(city);
-      break;
-    case 'a':
-      // Adds a flight for a particular city "a Toronto\n
-      //                                      360 100\n"
-      city_read(city);
-      flight_schedule_add_flight(city);
-      break;
-    case 'r':
-      // Remove a flight for a particular city "r Toronto\n
-      //                                        360\n"
-      city_read(city);
-      flight_schedule_remove_flight(city);
-      break;
-    case 's':
-      // schedule a seat on a flight for a particular city "s Toronto\n
-      //                                                    300\n"
-      city_read(city);
-      flight_schedule_schedule_seat(city);
-      break;
-    case 'u':
-      // unschedule a seat on a flight for a particular city "u Toronto\n
-      //                                                      360\n"
-      city_read(city);
-      flight_schedule_unschedule_seat(city);
-      break;
-    case 'R':
-      // remove the schedule for a particular city "R Toronto\n"
-      city_read(city);
-      flight_schedule_remove(city);
-      break;
-    case 'h':
-      print_command_help();
-      break;
-    case 'q':
-      goto done;
-    default:
-      printf("Bad command. Use h to see help.\n");
-    }
-  }
-done:
-  return EXIT_SUCCESS;
-}
+struct flight_arena flight_arena = {{NULL}, NULL, 0};
 
-/**********************************************************************
- * city_read: Takes in and processes a given city following a command *
- *********************************************************************/
-int city_read(city_t city)
+// Every flight of every schedule is also filed under its departure minute
+// in one global time index, so a query over a window of times only visits
+// the flights departing in it.  The bucket for a minute lists the
+// destinations of its flights in no particular order; a flight's entry is
+// found again through its schedule's entries array, and an entry is found
+// in its schedule by a binary search on its time.  A flight taken out
+// leaves a hole, marked CITY_NONE, that the next flight filed in the
+// bucket reuses, so no other flight's entry moves.  Bit e of a bucket's
+// open bitmap is set when flight e has a seat, under the same rules as
+// open_seats, so a query skips sold out flights 64 at a time.
+//
+// The buckets form a timing wheel over the days of the calendar: minute t
+// is bucket t % minutes, so when D retires the first days their buckets,
+// and the memory they hold, become those of the new last days.  Each
+// bucket, hour and day counts its flights with a seat, which lets a search
+// for the next open flight step over an empty hour or day at once.
+struct time_bucket
 {
-  int ch, i = 0;
+  int count;         // entries in use, holes included
+  int slots;         // room in cities, holes and open
+  int open_count;    // bits set in open
+  int hole_count;    // entries in holes
+  city_id_t *cities; // destination of each flight, CITY_NONE for a hole
+  int *holes;        // entries free for reuse
+  uint64_t *open;    // bit e set when flight e has a seat
+};
 
-  // skip leading non letter characters
-  while (true)
-  {
-    ch = getchar();
-    if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z'))
-    {
-      city[i++] = ch;
-      break;
-    }
-  }
-  while ((ch = getchar()) != '\n')
-  {
-    if (i < MAX_CITY_NAME_LEN)
-    {
-      city[i++] = ch;
-    }
-  }
-  city[i] = '\0';
-  return i;
-}
+struct time_index
+{
+  pthread_rwlock_t lock;
+  int first;                   // first minute of the calendar
+  int minutes;                 // minutes in the calendar, whole days
+  struct time_bucket *buckets; // one per minute of the calendar
+  int *hour_open;              // flights with a seat in each hour's buckets
+  int *day_open;               // and in each day's
+};
+struct time_index time_index = {.lock = PTHREAD_RWLOCK_INITIALIZER};
 
-/****************************************************************
- * Message functions so that your messages match what we expect *
- ****************************************************************/
-void msg_city_bad(char *city)
+// The days the parser accepts times in.  A time is a minute counted from
+// midnight of day 0, from first_day to the end of first_day + days - 1.
+// D moves first_day on as soon as it is read, so with -P and -N this view
+// runs ahead of the time index, which D changes in its turn.
+struct calendar
 {
-  printf("No schedule for %s\n", city);
-}
+  int days;
+  int first_day;
+};
+struct calendar calendar = {1, 0};
+pthread_mutex_t flight_arena_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void msg_city_exists(char *city)
+// A Q that finds no seat puts a waiter in line for the first flight at or
+// after its time.  A flight's waiters form a ring through next and prev,
+// oldest first, and its waitlists entry is the slot of the oldest, so a
+// waiter joins at the back and leaves from anywhere in O(1).  A seat
+// given back to the flight goes straight to the oldest waiter.  Waiters
+// come from slabs of WAITLIST_SLAB that are allocated as needed and kept;
+// freed ones are chained through next.  Slot 0 is never handed out, so 0
+// means none.  A waiter's ticket is its slot with the low 7 bits of the
+// slot's generation above them, so a cancelled or seated ticket is not
+// mistaken for the waiter now in its slot.  In server mode each client's
+// waiters are also chained, so they can be dropped when it goes.
+// waitlist.lock guards the slabs, every ring and the waitlists entries.
+struct waiter
 {
-  printf("There is a schedule of %s already.\n", city);
-}
+  int next;                     // ring of the flight's waiters, or free list
+  int prev;
+  int client_next;              // server: the client's other waiters
+  int client_prev;
+  city_id_t city;               // CITY_NONE while the slot is free
+  int time;                     // the flight waited for
+  uint32_t gen;                 // bumped every time the slot is freed
+  struct server_client *client; // server: who to tell, or NULL
+};
 
-void msg_schedule_no_free(void)
+struct waitlist
 {
-  printf("Sorry no more free schedules.\n");
-}
+  struct waiter *slabs[WAITLIST_SLABS];
+  int free;             // first freed slot, 0 for none
+  int used;             // slots handed out from the slabs so far
+  pthread_mutex_t lock;
+};
 
-void msg_city_flights(char *city)
+struct waitlist waitlist = {{NULL}, 0, 1, PTHREAD_MUTEX_INITIALIZER};
+
+// What became of waiters a command seated or dropped, kept by the thread
+// that ran it until its reply has been printed, since the booking API
+// prints nothing
+struct waitlist_notice
 {
-  printf("The flights for %s are:", city);
-}
+  int ticket;
+  city_id_t city;
+  int time;
+  bool seated;                  // false: the flight was removed
+  struct server_client *client; // server: whose ticket it is
+};
 
-void msg_flight_info(int time, int avail, int capacity)
+struct waitlist_notices
 {
-  printf(" (%d, %d, %d)", time, avail, capacity);
-}
+  struct waitlist_notice *items;
+  int count;
+  int size;
+};
 
-void msg_city_max_flights_reached(char *city)
+__thread struct waitlist_notices waitlist_notices = {NULL, 0, 0};
+
+// F city subscribes whoever sent it to the changes of city's schedule:
+// a server client, or else the session reading the commands (with -P
+// the executor and with -N a shard answers for it).  Every change made
+// through the booking API -- A, R, a flight added or removed, seats
+// booked or given back -- is put as a delta in the ring of each of the
+// city's subscribers, numbered per subscription, and printed after the
+// reply of the command that made it.  A server client's deltas are
+// queued for it after each command, whoever sent it.  A ring holds
+// FEED_RING_RECORDS deltas and a subscriber that falls further behind
+// loses the oldest, which shows as a gap in the city's numbers.  Each
+// subscription is a link on two lists, its city's and its subscriber's.
+// feed.lock guards the rings and the lists.
+struct feed_delta
 {
-  printf("Sorry we cannot add more flights on this city.\n");
-}
+  uint32_t seq;   // the subscription's count of deltas, from 1
+  city_id_t city;
+  char op;        // A R a r s u
+  int time;       // a r s u: the flight as the change left it
+  int available;
+  int capacity;
+};
 
-void msg_flight_bad_time(void)
+struct feed_link
 {
-  printf("Sorry there's no flight scheduled on this time.\n");
-}
+  city_id_t city;
+  uint32_t seq;                       // deltas numbered so far
+  struct feed_subscriber *subscriber;
+  struct feed_link *city_next;        // the city's other subscriptions
+  struct feed_link *next;             // the subscriber's other ones
+};
 
-void msg_flight_no_seats(void)
+struct feed_subscriber
 {
-  printf("Sorry there's no more seats available!\n");
-}
+  struct feed_delta ring[FEED_RING_RECORDS];
+  uint64_t head;                 // deltas put in the ring so far
+  uint64_t tail;                 // deltas taken out or overwritten
+  struct feed_link *links;       // its subscriptions
+  struct server_client *client;  // server: whose it is, NULL for the session
+  bool ready;                    // server: on the ready list
+  struct feed_subscriber *ready_next;
+  struct feed_subscriber *next;  // every subscriber
+  struct feed_subscriber *prev;
+};
 
-void msg_flight_all_seats_empty(void)
+struct feed
 {
-  printf("All the seats on this flights are empty!\n");
-}
+  struct feed_subscriber *subscribers;
+  struct feed_subscriber *session; // stdin, -P and -N shards: the reader's
+  struct feed_subscriber *ready;   // server: subscribers with deltas
+  pthread_mutex_t lock;
+};
 
-void msg_time_bad()
+struct feed feed = {NULL, NULL, NULL, PTHREAD_MUTEX_INITIALIZER};
+
+// Commands are read straight from the file descriptor instead of through
+// stdio.  A regular file is mapped whole; anything else is read in blocks
+// of INPUT_BUFFER_SIZE.  Either way the parser works on buf[pos .. len).
+struct input_stream
 {
-  printf("Invalid time value\n");
-}
+  int fd;           // descriptor commands come from
+  char *buf;        // mapped file or read buffer
+  size_t len;       // bytes valid in buf
+  size_t pos;       // next unread byte
+  bool mapped;      // buf is the whole file, no more reads needed
+  bool eof;         // read() has reported end of file
+  jmp_buf *starved; // server: where to go when a command is cut short
+  void (*waiting)(void); // -N: catch up before blocking for more input
+};
 
-void msg_capacity_bad()
+struct input_stream input = {0, NULL, 0, 0, false, false, NULL, NULL};
+
+// Everything the program prints is formatted into a set of fixed size
+// chunks which are written together with one writev() when they are all
+// full, when the program is about to block waiting for more input, and at
+// exit.  Chunks are allocated the first time they are needed.  Every
+// thread has a stream of its own; only in pipelined mode (-P) does more
+// than one of them print.
+struct output_stream
 {
-  printf("Invalid capacity value\n");
-}
+  int fd;                           // descriptor output goes to
+  char *chunks[OUTPUT_CHUNKS];      // chunk buffers
+  size_t used[OUTPUT_CHUNKS];       // bytes filled in each chunk
+  int current;                      // chunk being filled
+  struct server_client *client;     // server: replies are queued for it
+};
 
-void print_command_help()
+__thread struct output_stream output = {1, {NULL}, {0}, 0, NULL};
+
+// In server mode (-u or -p) every client has its own buffers: the bytes it
+// has sent that have not been run yet, and the replies that have not been
+// sent back to it yet.  Replies are queued in the order the commands were
+// run, so a client may pipeline as many commands as it likes.
+struct server_client
 {
-  printf("Here are the possible commands:\n"
-         "A <city name>     - Add an active empty flight schedule for\n"
-         "                    <city name>\n"
-         "L                 - List cities which have an active schedule\n"
-         "l <city name>     - List the flights for <city name>\n"
-         "a <city name>\n"
-         "<time> <capacity> - Add a flight for <city name> @ <time> time\n"
-         "                    with <capacity> seats\n"
-         "r <city name>\n"
-         "<time>            - Remove a flight form <city name> whose time is\n"
-         "                    <time>\n"
-         "s <city name>\n"
-         "<time>            - Attempt to schedule seat on flight to \n"
-         "                    <city name> at <time> or next closest time on\n"
-         "                    which their is an available seat\n"
-         "u <city name>\n"
-         "<time>            - unschedule a seat from flight to <city name>\n"
-         "                    at <time>\n"
-         "R <city name>     - Remove schedule for <city name>\n"
-         "h                 - print this help message\n"
-         "q                 - quit\n");
-}
+  int fd;
+  uint32_t events;  // what epoll is watching for
+  char *in;         // bytes received and not yet run
+  size_t in_len;
+  size_t in_size;
+  char *out;        // replies not yet sent
+  size_t out_len;
+  size_t out_sent;  // bytes of out already sent
+  size_t out_size;
+  bool eof;         // the client has shut down its side
+  bool quit;        // q: close once the replies are sent
+  int waiters;      // slot of the client's latest waiter, 0 for none
+  struct feed_subscriber *feed; // F: its subscriptions, or NULL
+};
 
-/****************************************************************
- * Resets a flight schedule                                     *
- ****************************************************************/
-void flight_schedule_reset(struct flight_schedule *fs)
+struct server
+{
+  int epoll_fd;
+  int listen_fd;
+  const char *path; // Unix socket to remove at exit
+  jmp_buf starved;  // input_fill comes back here on a short command
+};
+
+// A timetable (-I) is a text file of city,time,capacity rows.  It is cut
+// into parts at line boundaries which are parsed, and their city names
+// interned, in parallel.  The rows are then put in order of city, time and
+// line by two stable counting sorts, by time and then by city id, so
+// every city's flights come together and already in order.
+struct import_row
+{
+  city_id_t city;
+  uint32_t line; // line number in the part, then in the file
+  int time;
+  int capacity;
+};
+
+// One city's rows in the sorted timetable
+struct import_group
+{
+  uint32_t line; // where the city first appears
+  size_t start;
+  size_t count;
+};
+
+// A row that was rejected with a message.  The messages are printed in
+// file order once every row has been tried.
+struct import_error
+{
+  uint32_t line;
+  int error;     // parse_error, PARSE_OK when adding it was refused
+  int status;    // then the booking status
+  city_id_t city;
+};
+
+struct import_part
+{
+  const char *begin;            // whole lines of the file
+  const char *end;
+  struct import_row *rows;      // valid rows
+  size_t count;
+  size_t size;
+  struct import_error *errors;  // rejected rows with a message
+  size_t error_count;
+  size_t error_size;
+  uint32_t lines;               // lines in the part
+  long skipped;                 // rows dropped without a message
+  bool failed;                  // out of memory
+};
+
+// A replica (-m name) is a POSIX shared memory segment that mirrors the
+// schedules for reader processes (-r name), which answer the listing
+// commands from it without a message to the writer or a lock it takes.
+// After the header come one slot per city id, then the flight records.
+// Everything is an offset, since each process maps the segment at an
+// address of its own.  A slot's seq is odd while the writer changes the
+// city's flights; a reader copies them and tries again if seq moved in
+// the meantime, so it only ever sees a city's flights as a whole.  The
+// directory count does the same for the set of cities with a schedule.
+// A seat booked or given back is a single atomic add on the record, so
+// bookings never bump seq.  The writer never waits for a reader.
+struct replica_header
+{
+  char magic[8];         // REPLICA_MAGIC
+  uint32_t version;      // REPLICA_VERSION
+  uint32_t byte_order;   // SNAPSHOT_BYTE_ORDER
+  uint64_t bytes;        // length of the segment
+  uint64_t heap;         // offset of the flight records
+  uint32_t city_slots;   // REPLICA_CITIES
+  uint32_t cities;       // slots named so far
+  uint32_t directory;    // odd while a schedule is added or removed
+  uint32_t stale;        // the writer ran out of room and stopped
+  uint32_t retired;      // a newer writer has replaced the segment
+  uint32_t days;         // the writer's calendar, so readers parse as it does
+  int32_t first_day;
+};
+
+struct replica_city
+{
+  uint32_t seq;          // odd while the flights change
+  uint32_t scheduled;    // 1 while the city has a schedule
+  uint32_t flight_count; // records in use at flights
+  uint32_t flight_class; // the block holds FLIGHT_ARENA_MIN_BLOCK << class
+  uint64_t flights;      // offset of the records, 0 for none
+  char name[24];         // set once, before cities counts the slot
+};
+
+struct replica_flight
+{
+  int32_t time;
+  int32_t available;
+  int32_t capacity;
+};
+
+// This process's side of the replica.  Blocks of flight records come from
+// the heap in the flight arena's size classes; freed ones are chained
+// through their first 8 bytes.  A reader keeps the cities with a
+// schedule sorted by name for L, p and P until the directory changes.
+struct replica
+{
+  const char *name;              // shared memory object
+  char *base;                    // the mapped segment, NULL when off
+  struct replica_header *header;
+  struct replica_city *cities;
+  bool reader;                   // -r rather than -m
+  uint64_t heap_used;            // writer: bytes of heap handed out
+  uint64_t free_blocks[FLIGHT_ARENA_CLASSES]; // writer: offsets, 0 ends
+  pthread_mutex_t lock;          // writer: the heap
+  dev_t dev;                     // writer: the object made, so exit
+  ino_t ino;                     // unlinks only that one
+  uint32_t known;                // reader: slots interned locally
+  uint32_t directory;            // reader: directory the list is from
+  uint32_t *sorted;              // reader: slots with a schedule by name
+  uint32_t sorted_count;
+  struct replica_flight *copy;   // reader: one city's flights
+  uint32_t copy_size;
+};
+
+// In pipelined mode (-P) commands pass from stage to stage through rings
+// of fixed size records with one producer and one consumer.  head is only
+// stored by the producer and tail only by the consumer, and each side
+// keeps its last look at the other's index on its own cache line, so a
+// record costs one store and no lock.  A side that finds the ring full or
+// empty spins for a while and then sleeps until the other side moves; on
+// a machine with one CPU it yields instead of spinning.
+struct ring
+{
+  size_t head __attribute__((aligned(64))); // records published so far
+  size_t tail_seen;                         // producer's copy of tail
+  size_t tail __attribute__((aligned(64))); // records released so far
+  size_t head_seen;                         // consumer's copy of head
+  char *slots __attribute__((aligned(64)));
+  size_t mask;           // records in the ring - 1
+  size_t size;           // bytes per record
+  int spins;             // polls of a full or empty ring before sleeping
+  bool yield;            // one CPU: let the other side run between polls
+  int sleeping;          // sides waiting on wake
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+};
+
+// One (city, time, seats) tuple of a B command.  Positive seats are booked
+// together as b books them and negative ones given back as f does.
+struct batch_tuple
+{
+  city_id_t city;
+  city_t name; // as read, for a city not in the table
+  int time;   // the flight asked for, then the one booked
+  int seats;
+  char error; // parse_error reading the tuple
+  char shard; // -N: where the router sent it
+  int status; // booking_status once run
+};
+
+// A tuple's place in the order a batch is run in
+struct batch_order
+{
+  city_id_t city;
+  int index;
+};
+
+// The tuples of the B command being run in the stdin and server loops,
+// kept from one B to the next.  A server command cut short is read again
+// from the start, so they are not tied to one command.
+struct batch
+{
+  struct batch_tuple *tuples;
+  int size;
+};
+
+// A command as the parser hands it to the executor
+struct command_record
+{
+  char command;   // command letter
+  char error;     // parse_error found reading the arguments
+  bool eof;       // the input ended; not a command
+  city_id_t city; // A R l a r s u b f Q c F X
+  int args[2];    // a: time, capacity; b f: time, seats; r s u n Q: time;
+                  // c: ticket; w W P: two numbers; B: tuples
+  city_t prefix;  // p
+  struct batch_tuple *batch; // B, handed on to the result
+};
+
+// What the executor did, as the formatter needs it to print the reply
+enum result_kind
+{
+  RESULT_STATUS,  // msg_booking_status(status, city)
+  RESULT_PARSE,   // the message for parse_error status
+  RESULT_FLIGHTS, // l: count flights as time, available, capacity triples
+  RESULT_NEXT,    // n: the flight found, in args
+  RESULT_COUNT,   // W: count flights from args[0] to args[1]
+  RESULT_BATCH,   // B: count tuples, run, then len bytes of notices
+  RESULT_TICKET,  // Q: waiting as ticket args[0] for the flight at args[1]
+  RESULT_ROLL,    // D: count flights retired, times now args[0] to args[1],
+                  // then len bytes of notices
+  RESULT_TEXT,    // len bytes the executor printed itself
+  RESULT_HELP,    // h
+  RESULT_BAD,     // a command letter that is not one
+  RESULT_FAIL,    // the executor has stopped; end the program
+  RESULT_END      // the executor has stopped after q or the end of input
+};
+
+struct result_record
+{
+  char kind;       // result_kind
+  int status;      // booking_status or parse_error
+  city_id_t city;
+  int args[3];
+  long count;
+  int *flights;    // RESULT_FLIGHTS, freed by the formatter
+  struct batch_tuple *batch; // RESULT_BATCH, freed by the formatter
+  char *text;      // RESULT_TEXT, freed by the formatter
+  size_t len;
+};
+
+struct pipeline
+{
+  struct ring commands;          // parser to executor
+  struct ring results;           // executor to formatter
+  struct server_client captured; // executor: text it prints goes here
+};
+
+// In sharded mode (-N) a router process parses the commands as the
+// pipeline's parser does and sends each one, as a command record, to the
+// scheduler process (shard) that holds its city, or to every shard for
+// the commands about all of them.  Every request gets exactly one reply,
+// a result record, so the replies from one shard come back in the order
+// its requests were sent.  City ids are private to each process, so
+// requests and replies carry the city's name.  Flight triples, batch
+// tuples or text follow a record when it says so.
+struct shard_request
+{
+  struct command_record cmd; // cmd.city and cmd.batch are the router's
+  city_t name;               // the city, or "" for none
+  uint32_t bytes;            // m: flight triples, B: shard tuples, after
+};
+
+// A tuple of a B as the router sends it to the shard that has its city
+struct shard_tuple
+{
+  city_t name;
+  int time;
+  int seats;
+};
+
+struct shard_reply
+{
+  struct result_record res;  // its pointers are the shard's and ignored
+  city_t name;               // res.city's name, or "" for none
+  uint32_t bytes;            // RESULT_FLIGHTS, RESULT_BATCH or RESULT_TEXT
+                             // payload after
+};
+
+// The router's end of one shard: requests not yet sent go out through
+// conn.out and replies are read into conn.in
+struct router_shard
+{
+  struct server_client conn;
+  pid_t pid;
+  size_t used; // bytes of conn.in already taken
+};
+
+// A command whose reply the router has still to print, oldest first
+enum route_kind
+{
+  ROUTE_LOCAL, // res, answered by the router itself
+  ROUTE_SHARD, // the next reply from shard
+  ROUTE_ALL    // the next reply from every shard, merged for command
+};
+
+struct route
+{
+  char kind;                // route_kind
+  char command;             // ROUTE_ALL: what is merged
+  int shard;                // ROUTE_SHARD
+  int args[2];              // ROUTE_ALL: P's page, w and W's window
+  struct result_record res; // ROUTE_LOCAL; ROUTE_ALL: B's batch
+  city_t name;              // ROUTE_LOCAL: the city when res.city is CITY_NONE
+};
+
+struct router
+{
+  int count;                               // shards
+  struct router_shard shards[SHARDS_MAX];
+  struct route *routes;                    // ring of replies to print
+  size_t head;                             // routes added
+  size_t tail;                             // routes printed
+  size_t size;                             // room in routes, a power of two
+  long routed;                             // commands since replies were read
+};
+
+// Settings from the command line that commands need while they run
+struct command_options
+{
+  const char *snapshot_path; // -s: where S and q save a snapshot
+  bool bench;                // -B: keep every command's latency
+  bool timed;                // time commands for -B or the statistics
+};
+
+// Records are appended to an in memory buffer and written and synced as a
+// group once group_ops of them are waiting or the oldest has waited
+// group_usec microseconds.  seq counts every record ever appended, so a
+// snapshot can record exactly which records it already contains.  A
+// commit swaps the buffer for spare and writes it out holding only
+// sync_lock, so bookings go on appending to the other one meanwhile.
+struct journal
+{
+  int fd;                    // journal file, -1 when journaling is off
+  char *buf;                 // records not written yet
+  size_t len;                // bytes used in buf
+  size_t size;               // bytes allocated for buf
+  uint64_t seq;              // sequence number of the last record
+  int pending;               // records in buf
+  struct timespec oldest;    // when the first record in buf was appended
+  int group_ops;             // records per group commit
+  long group_usec;           // longest a record waits to be committed
+  bool replaying;            // replaying the journal, do not log again
+  pthread_mutex_t lock;      // held only to copy a record into buf
+  char *spare;               // the other buffer, being written by a commit
+  size_t spare_size;         // bytes allocated for spare
+  bool full;                 // a group is due to be committed
+  pthread_mutex_t sync_lock; // one commit writes and syncs at a time
+};
+
+// flight_schedules_lock protects the active and free lists, the pool, the
+// schedule pointers in the city table and the city tree.  The flights of
+// each schedule are protected by one of the stripe locks, chosen by the
+// schedule's address: adding or removing a flight holds it for writing,
+// booking and listing for reading.  time_index.lock is taken last: for
+// writing by anything that adds, removes or moves flights of any schedule,
+// and for reading by time window queries, which read flights without
+// their stripes, and by bookings that fill a flight or reopen one.
+// When journaling, or when its city is followed, a booking also holds its
+// stripe's journal_stripes mutex from its compare and swap to its record
+// and delta (see journal_begin).
+// waitlist.lock comes after a stripe and its journal_stripes mutex and
+// before time_index.lock.  journal.lock and feed.lock come after all of
+// them, and nothing is taken while either is held.
+pthread_rwlock_t flight_schedules_lock = PTHREAD_RWLOCK_INITIALIZER;
+pthread_rwlock_t flight_schedule_stripes[LOCK_STRIPES];
+pthread_mutex_t journal_stripes[LOCK_STRIPES];
+
+// -B timing report: one set of samples per command character
+struct bench_samples bench_samples[128];
+struct timespec bench_start;
+
+#if SCHEDULER_STATS
+struct scheduler_stats stats;
+volatile sig_atomic_t stats_dump_requested = 0; // set by SIGUSR1
+#endif
+
+struct command_options options = {NULL, false, false};
+
+struct server server = {.epoll_fd = -1, .listen_fd = -1, .path = NULL};
+struct replica replica = {NULL, NULL, NULL, NULL, false, 0, {0},
+                          PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 1, NULL, 0,
+                          NULL, 0};
+struct batch batch = {NULL, 0};
+struct pipeline pipeline;
+struct router router;
+volatile sig_atomic_t server_stop = 0; // set by SIGINT and SIGTERM
+
+struct journal journal = {-1, NULL, 0, 0, 0, 0, {0, 0}, JOURNAL_GROUP_OPS,
+                          JOURNAL_GROUP_USEC, false, PTHREAD_MUTEX_INITIALIZER,
+                          NULL, 0, false, PTHREAD_MUTEX_INITIALIZER};
+
+/******************************************************************************
+ * Function Prototypes                                                        *
+ ******************************************************************************/
+// Misc utility io functions
+void output_flush(void);
+void output_close(void);
+void output_write(const char *s, size_t n);
+void output_str(const char *s);
+void output_char(char c);
+void output_int(long v);
+size_t output_mark(void);
+void output_truncate(size_t mark);
+void input_open(const char *path);
+int input_getc(void);
+bool input_command(char *command);
+bool input_int(int *value);
+int city_read_name(city_t city);
+city_id_t city_read(void);
+city_id_t city_read_intern(void);
+int time_read(flight_time_t *time_ptr);
+int flight_capacity_read(int *capacity_ptr);
+int page_read(int *from, int *count);
+int window_read(int *from, int *to);
+int days_read(int *days_ptr);
+int seats_read(int *seats_ptr);
+int batch_read(struct batch_tuple **tuples, int *size, int *count);
+int ticket_read(int *ticket_ptr);
+bool time_get(flight_time_t *time_ptr);
+bool flight_capacity_get(int *capacity_ptr);
+bool seats_get(int *seats_ptr);
+bool msg_parse_error(int error);
+void msg_import_line(uint32_t line);
+void msg_import_done(long flights, long cities, long rows);
+void msg_batch(const struct batch_tuple *tuples, int count);
+void msg_waitlisted(int ticket, int time);
+void msg_roll_forward(long retired, int first, int last);
+void msg_waitlist_notices(void);
+void msg_feed(struct feed_subscriber *s);
+void print_command_help(void);
+void msg_snapshot_failed(void);
+void msg_command_bad(void);
+void msg_replica_read_only(void);
+bool command_run(char command);
+
+// Core functions of the program
+void flight_schedule_initialize(long n, bool huge_pages);
+bool flight_schedule_pool_reserve(size_t n);
+int *flight_arena_alloc(int slots);
+void flight_arena_release(int *block, int slots);
+bool flight_schedule_reserve_flights(struct flight_schedule *fs, int n);
+int flight_schedule_lower_bound(struct flight_schedule *fs, int time);
+int flight_schedule_insert_flight(struct flight_schedule *fs, int time,
+                                  int capacity);
+void flight_schedule_delete_flight(struct flight_schedule *fs, int i);
+void flight_schedule_drop_flights(struct flight_schedule *fs, int k);
+void flight_schedule_shrink_flights(struct flight_schedule *fs);
+int flight_schedule_next_open(struct flight_schedule *fs, int from);
+int flight_seek(const int *times, const int *available, int from, int n,
+                int time);
+int flight_schedule_seek(struct flight_schedule *fs, int time, int from);
+bool flight_schedule_take_seats(struct flight_schedule *fs, int i, int n,
+                                int *left);
+bool flight_schedule_give_seats(struct flight_schedule *fs, int i, int n,
+                                int *left);
+void waitlist_seat(struct flight_schedule *fs, int i, int n, bool logging);
+void waitlist_drop(struct flight_schedule *fs, int i);
+void waitlist_forget(struct server_client *c);
+bool feed_subscribe(struct feed_subscriber **s, struct server_client *client,
+                    city_id_t city, uint32_t seq);
+bool feed_unsubscribe(struct feed_subscriber *s, city_id_t city,
+                      uint32_t *seq);
+void feed_close(struct feed_subscriber *s);
+void feed_emit(char op, city_id_t city, int time, int available, int capacity);
+bool feed_waiting(const struct feed_subscriber *s);
+int feed_take(struct feed_subscriber *s, struct feed_delta *deltas, int max);
+bool snapshot_write(const char *path);
+bool snapshot_checkpoint(const char *path);
+bool snapshot_load(const char *path);
+uint64_t bench_now(void);
+void bench_record(char command, uint64_t ns);
+bool bench_report(const char *path);
+void stats_init(void);
+void stats_record(struct stats_histogram *h, uint64_t value);
+void stats_command(char command, uint64_t ns);
+void stats_dump(FILE *f);
+void stats_print(void);
+void stats_poll(void);
+void journal_open(const char *path);
+void journal_append(char op, city_id_t city, int time, int capacity);
+bool journal_logging(void);
+bool journal_begin(struct flight_schedule *fs);
+void journal_end(struct flight_schedule *fs, bool ordered);
+void journal_commit_if_full(void);
+void journal_record(char op, city_id_t city, int time, int capacity);
+void journal_record_flight(char op, city_id_t city, int time, int available,
+                           int capacity);
+void journal_commit(void);
+void journal_checkpoint(void);
+long journal_commit_due(void);
+long journal_commit_if_due(void);
+void server_listen(const char *path, int port);
+void server_queue(struct server_client *c, const char *s, size_t n);
+void server_watch(struct server_client *c);
+void server_loop(void);
+void server_shutdown(void);
+void ring_init(struct ring *r, size_t size, size_t records);
+void *ring_claim(struct ring *r);
+void ring_publish(struct ring *r);
+void *ring_next(struct ring *r, long (*idle)(void));
+void ring_release(struct ring *r);
+void pipeline_loop(void);
+void result_print(struct result_record *res);
+void router_start(int count, const char *snapshot_path,
+                  const char *journal_path);
+void router_loop(void);
+bool timetable_import(const char *path);
+void replica_open(const char *name);
+void replica_close(void);
+void replica_schedule(city_id_t city, bool scheduled);
+void replica_publish(struct flight_schedule *fs);
+void replica_seat(struct flight_schedule *fs, int i, int delta);
+void replica_calendar(void);
+void replica_attach(const char *name);
+bool replica_run(char command);
+unsigned int city_hash(const char *city);
+city_id_t city_find(const char *city);
+city_id_t city_intern(const char *city);
+struct city_entry *city_entry(city_id_t city);
+char *city_name(city_id_t city);
+bool city_tree_insert(const char *name);
+void city_tree_remove(const char *name);
+void city_tree_list(uint32_t skip, uint32_t count);
+void city_tree_list_prefix(const char *prefix);
+bool time_index_add(struct flight_schedule *fs, int i);
+void time_index_remove(struct flight_schedule *fs, int i);
+void time_index_initialize(int days);
+int calendar_first(void);
+int calendar_last(void);
+void time_index_mark(struct flight_schedule *fs, int i, bool open);
+int time_index_next_open(int from);
+void time_index_list(int from, int to);
+long time_index_count(int from, int to);
+void time_index_retire(int first);
+struct flight_schedule *flight_schedule_find(city_id_t city);
+struct flight_schedule *flight_schedule_allocate(void);
+void flight_schedule_free(struct flight_schedule *fs);
+void flight_schedule_add(city_id_t city);
+void flight_schedule_listAll(void);
+void flight_schedule_list_prefix(void);
+void flight_schedule_list_page(void);
+void flight_schedule_list(city_id_t city);
+void flight_schedule_add_flight(city_id_t city);
+void flight_schedule_remove_flight(city_id_t city);
+void flight_schedule_schedule_seat(city_id_t city);
+void flight_schedule_unschedule_seat(city_id_t city);
+void flight_schedule_book_seats(city_id_t city, bool book);
+void flight_schedule_batch(void);
+void flight_schedule_queue_seat(city_id_t city);
+void flight_schedule_cancel(city_id_t city);
+void flight_schedule_subscribe(city_id_t city, bool subscribe);
+void flight_schedule_remove(city_id_t city);
+void flight_schedule_next_departure(void);
+void flight_schedule_list_window(void);
+void flight_schedule_count_window(void);
+void flight_schedule_roll_forward(void);
+void flight_schedule_print_prefix(const char *prefix);
+void flight_schedule_print_page(int from, int count);
+void flight_schedule_print_window(int from, int to);
+
+// Thread safe booking API
+void flight_schedules_read_lock(void);
+void flight_schedules_write_lock(void);
+void flight_schedules_unlock(void);
+pthread_rwlock_t *flight_schedule_lock(struct flight_schedule *fs,
+                                       bool exclusive);
+void msg_booking_status(int status, city_id_t city);
+bool booking_has_schedule(city_id_t city);
+int booking_add_schedule(city_id_t city);
+int booking_remove_schedule(city_id_t city);
+int booking_add_flight(city_id_t city, int time, int capacity);
+int booking_remove_flight(city_id_t city, int time);
+int booking_schedule_seat(city_id_t city, int time);
+int booking_unschedule_seat(city_id_t city, int time);
+int booking_book_seats(city_id_t city, int time, int seats);
+int booking_free_seats(city_id_t city, int time, int seats);
+void booking_batch(struct batch_tuple *tuples, int count);
+int booking_queue_seat(city_id_t city, int time, struct server_client *client,
+                       int *ticket, int *departure);
+int booking_cancel(city_id_t city, int ticket);
+int booking_next_departure(int time, city_id_t *city, int *departure,
+                           int *available, int *capacity);
+int booking_roll_forward(int days, long *retired, int *first, int *last);
+int booking_list_flights(city_id_t city, int **flights, int *count);
+int booking_load_flights(city_id_t city, const int *flights, int count);
+
+int main(int argc, char *argv[])
+{
+  long n = MAX_DEFAULT_SCHEDULES;
+  bool huge_pages = false;
+  bool quiet = false;
+  bool pipelined = false;
+  const char *input_path = NULL;
+  const char *snapshot_path = NULL;
+  const char *journal_path = NULL;
+  const char *bench_path = NULL;
+  const char *import_path = NULL;
+  const char *socket_path = NULL;
+  const char *replica_name = NULL;
+  bool replica_reader = false;
+  int shards = 0;
+  int port = 0;
+  int days = 1;
+  char command;
+  int opt;
+
+  // Options:
+  //   -H       back the schedule pool with huge pages when the system has them
+  //   -i file  read commands from file instead of standard input
+  //   -q       do not print the command help at startup
+  //   -s file  load state from the snapshot file at startup and save it
+  //            there on S and q
+  //   -j file  log every change to the journal file and replay it at startup
+  //   -g ops   sync the journal after at most ops changes
+  //   -t usec  sync the journal at most usec microseconds after a change
+  //   -I file  import the city,time,capacity rows of a timetable file at
+  //            startup
+  //   -B file  time every command and write a latency report to file
+  //   -u path  serve clients on the Unix socket path instead of reading
+  //            standard input
+  //   -p port  serve clients on port of the loopback address
+  //   -P       parse, run and print commands on three threads
+  //   -m name  mirror the schedules into the shared memory object name
+  //   -r name  answer L, l, p and P from the mirror another scheduler
+  //            keeps in name, without changing anything
+  //   -N n     route the commands to n scheduler processes, each holding
+  //            the cities that hash to it
+  //   -D n     take times in a calendar of n days rather than one
+  while ((opt = getopt(argc, argv, "Hi:qs:j:g:t:I:B:u:p:Pm:r:N:D:")) != -1)
+  {
+    switch (opt)
+    {
+    case 'H':
+      huge_pages = true;
+      break;
+    case 'q':
+      quiet = true;
+      break;
+    case 's':
+      snapshot_path = optarg;
+      break;
+    case 'j':
+      journal_path = optarg;
+      break;
+    case 'g':
+      journal.group_ops = atoi(optarg) > 0 ? atoi(optarg) : 1;
+      break;
+    case 't':
+      journal.group_usec = atol(optarg) > 0 ? atol(optarg) : 0;
+      break;
+    case 'i':
+      input_path = optarg;
+      break;
+    case 'I':
+      import_path = optarg;
+      break;
+    case 'B':
+      bench_path = optarg;
+      break;
+    case 'u':
+      socket_path = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      if (port <= 0 || port > 65535)
+      {
+        printf("ERROR: Bad port %s.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'P':
+      pipelined = true;
+      break;
+    case 'm':
+    case 'r':
+      replica_name = optarg;
+      replica_reader = opt == 'r';
+      break;
+    case 'N':
+      shards = atoi(optarg);
+      if (shards <= 0 || shards > SHARDS_MAX)
+      {
+        printf("ERROR: Bad number of shards %s.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    case 'D':
+      days = atoi(optarg);
+      if (days <= 0 || days > CALENDAR_DAYS_MAX)
+      {
+        printf("ERROR: Bad number of days %s.\n", optarg);
+        exit(EXIT_FAILURE);
+      }
+      break;
+    default:
+      printf("Usage: %s [-H] [-i file] [-q] [-s file] [-j file [-g ops] "
+             "[-t usec]] [-I file] [-B file] [-u path | -p port | -P] "
+             "[-m name | -r name] [-N shards] [-D days] [schedules]\n",
+             argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (replica_reader && (snapshot_path != NULL || journal_path != NULL ||
+                         import_path != NULL || pipelined))
+  {
+    printf("ERROR: A replica reader has no schedules of its own.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (shards > 0 && (socket_path != NULL || port != 0 || pipelined ||
+                     import_path != NULL || replica_name != NULL ||
+                     bench_path != NULL))
+  {
+    printf("ERROR: -N takes none of -u, -p, -P, -I, -m, -r and -B.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  if (optind < argc)
+  {
+    // If the program was passed an argument then try and convert the first
+    // argument in the a number that will override the default number of
+    // schedules we reserve up front.  The pool grows past it on demand.
+    char *end;
+    n = strtol(argv[optind], &end, 10); // CPAMA p 787
+    if (n <= 0)
+    {
+      printf("ERROR: Bad number of default max scedules specified.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // The schedules used to be a C99 variable length array local to main,
+  // which overflowed the stack for large counts.  They now come from a
+  // heap pool that is reserved here and grows in slabs as needed.
+  flight_schedule_initialize(n, huge_pages);
+  time_index_initialize(days);
+  if (socket_path != NULL || port != 0)
+    server_listen(socket_path, port);
+  else
+    input_open(input_path);
+  atexit(output_flush);
+  stats_init();
+
+  // DEFENSIVE PROGRAMMING:  Write code that avoids bad things from happening.
+  //  When possible, if we know that some particular thing should have happened
+  //  we think of that as an assertion and write code to test them.
+  // Use the assert function (CPAMA p749) to be sure the initilization has
+  // reserved the pool and the the active list is a null value.
+  assert(flight_schedules_pool.total >= (size_t)n &&
+         flight_schedules_active == NULL);
+
+  if (shards > 0)
+  {
+    // the router holds no schedules; every shard loads and saves its own
+    options.timed = SCHEDULER_STATS;
+    router_start(shards, snapshot_path, journal_path);
+    if (!quiet)
+      print_command_help();
+    router_loop();
+    return EXIT_SUCCESS;
+  }
+
+  if (snapshot_path != NULL && !snapshot_load(snapshot_path))
+  {
+    printf("ERROR: Bad snapshot file %s.\n", snapshot_path);
+    exit(EXIT_FAILURE);
+  }
+  if (journal_path != NULL)
+    journal_open(journal_path);
+  if (import_path != NULL && !timetable_import(import_path))
+  {
+    printf("ERROR: Cannot read timetable file %s.\n", import_path);
+    exit(EXIT_FAILURE);
+  }
+  if (replica_reader)
+    replica_attach(replica_name);
+  else if (replica_name != NULL)
+    replica_open(replica_name); // after loading, which it mirrors in one go
+
+  // Print the instruction in the beginning
+  if (!quiet && server.listen_fd < 0)
+    print_command_help();
+
+  // Command processing loop
+  if (bench_path != NULL)
+    clock_gettime(CLOCK_MONOTONIC, &bench_start);
+  options.snapshot_path = snapshot_path;
+  options.bench = bench_path != NULL;
+  options.timed = options.bench || SCHEDULER_STATS;
+  if (server.listen_fd >= 0)
+  {
+    // A client's q only ends its own session; the server stops on a
+    // signal and then saves just as q does
+    server_loop();
+    server_shutdown();
+    if (snapshot_path != NULL && !snapshot_checkpoint(snapshot_path))
+      msg_snapshot_failed();
+  }
+  else if (pipelined)
+  {
+    pipeline_loop(); // which saves the snapshot on q itself
+  }
+  else
+  {
+    while (input_command(&command))
+    {
+      if (!command_run(command))
+      {
+        if (snapshot_path != NULL && !snapshot_checkpoint(snapshot_path))
+          msg_snapshot_failed();
+        break;
+      }
+      STATS_POLL();
+    }
+  }
+  journal_commit();
+  if (bench_path != NULL && !bench_report(bench_path))
+    printf("ERROR: Cannot write timing report %s.\n", bench_path);
+  return EXIT_SUCCESS;
+}
+
+/**********************************************************************
+ * command_run: carries out one command of the protocol, wherever it  *
+ * was read from                                                      *
+ *********************************************************************/
+
+// Run the command whose letter has just been read, timing it for -B and
+// the statistics.  Returns false for q, which the caller acts on.
+bool command_run(char command)
+{
+  city_id_t city;
+  uint64_t started = options.timed ? bench_now() : 0;
+
+  if (replica.reader)
+    return replica_run(command); // -r: nothing here but the mirror
+  switch (command)
+  {
+  case 'A':
+    //  Add an active flight schedule for a new city eg "A Toronto\n"
+    city = city_read_intern();
+    flight_schedule_add(city);
+
+    break;
+  case 'L':
+    // List all active flight schedules eg. "L\n"
+    flight_schedule_listAll();
+    break;
+  case 'p':
+    // List the cities whose names start with a prefix "p Ch\n"
+    flight_schedule_list_prefix();
+    break;
+  case 'P':
+    // List count cities in alphabetical order from an offset "P 0 20\n"
+    flight_schedule_list_page();
+    break;
+  case 'l':
+    // List the flights for a particular city eg. "l\n"
+    city = city_read();
+    flight_schedule_list(city);
+    break;
+  case 'a':
+    // Adds a flight for a particular city "a Toronto\n
+    //                                      360 100\n"
+    city = city_read();
+    flight_schedule_add_flight(city);
+    break;
+  case 'r':
+    // Remove a flight for a particular city "r Toronto\n
+    //                                        360\n"
+    city = city_read();
+    flight_schedule_remove_flight(city);
+    break;
+  case 's':
+    // schedule a seat on a flight for a particular city "s Toronto\n
+    //                                                    300\n"
+    city = city_read();
+    flight_schedule_schedule_seat(city);
+    break;
+  case 'u':
+    // unschedule a seat on a flight for a particular city "u Toronto\n
+    //                                                      360\n"
+    city = city_read();
+    flight_schedule_unschedule_seat(city);
+    break;
+  case 'b':
+    // schedule seats together on a flight for a city "b Toronto\n
+    //                                                   300 4\n"
+    city = city_read();
+    flight_schedule_book_seats(city, true);
+    break;
+  case 'f':
+    // unschedule seats together on a flight for a city "f Toronto\n
+    //                                                     360 4\n"
+    city = city_read();
+    flight_schedule_book_seats(city, false);
+    break;
+  case 'B':
+    // schedule or unschedule seats for many cities "B 2\n
+    //                                               Toronto\n
+    //                                               300 4\n
+    //                                               Chicago\n
+    //                                               360 -1\n"
+    flight_schedule_batch();
+    break;
+  case 'Q':
+    // schedule a seat as s does, or wait in line for one "Q Toronto\n
+    //                                                     300\n"
+    city = city_read();
+    flight_schedule_queue_seat(city);
+    break;
+  case 'c':
+    // cancel a waitlist ticket for a particular city "c Toronto\n
+    //                                                  1\n"
+    city = city_read();
+    flight_schedule_cancel(city);
+    break;
+  case 'F':
+    // print the changes to a city's schedule as they are made "F Toronto\n"
+    city = city_read_intern(); // it may be followed before it is added
+    flight_schedule_subscribe(city, true);
+    break;
+  case 'X':
+    // stop printing them "X Toronto\n"
+    city = city_read();
+    flight_schedule_subscribe(city, false);
+    break;
+  case 'R':
+    // remove the schedule for a particular city "R Toronto\n"
+    city = city_read();
+    flight_schedule_remove(city);
+    break;
+  case 'n':
+    // find the earliest flight to anywhere with a seat "n 360\n"
+    flight_schedule_next_departure();
+    break;
+  case 'w':
+    // list the flights with a seat departing in a window "w 360 420\n"
+    flight_schedule_list_window();
+    break;
+  case 'W':
+    // count the flights with a seat departing in a window "W 360 420\n"
+    flight_schedule_count_window();
+    break;
+  case 'D':
+    // retire the first days of the calendar and open as many "D 1\n"
+    flight_schedule_roll_forward();
+    break;
+  case 'S':
+    // save a snapshot of every schedule "S\n"
+    if (options.snapshot_path == NULL ||
+        !snapshot_checkpoint(options.snapshot_path))
+      msg_snapshot_failed();
+    break;
+  case 'T':
+    // print counters and latency histograms "T\n"
+    stats_print();
+    break;
+  case 'h':
+    print_command_help();
+    break;
+  case 'q':
+    return false;
+  default:
+    msg_command_bad();
+  }
+  if (waitlist_notices.count > 0)
+    msg_waitlist_notices(); // after the reply of the command that seated them
+  if (feed_waiting(feed.session))
+    msg_feed(feed.session); // and then its changes to the cities followed
+  if (options.timed)
+  {
+    uint64_t ns = bench_now() - started;
+    if (options.bench)
+      bench_record(command, ns);
+    STATS_COMMAND(command, ns);
+  }
+  return true;
+}
+
+/**********************************************************************
+ * Input: a small tokenizer over the raw command stream that replaces *
+ * scanf and getchar.  Each function accepts exactly what the stdio   *
+ * call it replaced did.                                              *
+ *********************************************************************/
+void input_open(const char *path)
+{
+  struct stat st;
+
+  if (path != NULL)
+  {
+    input.fd = open(path, O_RDONLY);
+    if (input.fd < 0)
+    {
+      printf("ERROR: Cannot open %s.\n", path);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (fstat(input.fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+  {
+    void *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, input.fd, 0);
+    if (p != MAP_FAILED)
+    {
+      madvise(p, st.st_size, MADV_SEQUENTIAL);
+      input.buf = p;
+      input.len = st.st_size;
+      input.mapped = true;
+      return;
+    }
+  }
+
+  input.buf = malloc(INPUT_BUFFER_SIZE);
+  if (input.buf == NULL)
+  {
+    printf("ERROR: Out of memory allocating the input buffer.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Make sure at least one unread byte is in the buffer.  Returns false at
+// end of input.
+static bool input_fill(void)
+{
+  if (input.pos < input.len)
+    return true;
+  if (input.mapped || input.eof)
+    return false;
+  // the rest of a server client's command has not arrived yet
+  if (input.starved != NULL)
+    longjmp(*input.starved, 1);
+
+  // whoever is feeding us may be waiting to see our answers
+  if (input.waiting != NULL)
+    input.waiting();
+  output_flush();
+
+  // Do not sit on uncommitted journal records while waiting for input
+  // longer than the group commit interval allows.
+  long due = journal_commit_if_due();
+  if (due > 0)
+  {
+    struct pollfd pfd = {input.fd, POLLIN, 0};
+    if (poll(&pfd, 1, (due + 999) / 1000) == 0)
+      journal_commit();
+  }
+
+  ssize_t got;
+  do
+  {
+    STATS_POLL(); // SIGUSR1 interrupts a blocked read
+    got = read(input.fd, input.buf, INPUT_BUFFER_SIZE);
+  } while (got < 0 && errno == EINTR);
+
+  if (got <= 0)
+  {
+    input.eof = true;
+    return false;
+  }
+  input.len = got;
+  input.pos = 0;
+  return true;
+}
+
+int input_getc(void)
+{
+  return input_fill() ? (unsigned char)input.buf[input.pos++] : EOF;
+}
+
+static int input_peek(void)
+{
+  return input_fill() ? (unsigned char)input.buf[input.pos] : EOF;
+}
+
+static bool input_is_space(int ch)
+{
+  return ch == ' ' || (ch >= '\t' && ch <= '\r');
+}
+
+static void input_skip_space(void)
+{
+  while (input_fill())
+  {
+    if (!input_is_space(input.buf[input.pos]))
+      return;
+    input.pos++;
+  }
+}
+
+// Same as scanf(" %c", command) == 1
+bool input_command(char *command)
+{
+  input_skip_space();
+  int ch = input_getc();
+  if (ch == EOF)
+    return false;
+  *command = ch;
+  return true;
+}
+
+// Parse a number as input_int does from the text at *p, which ends at
+// end, and move *p past it
+static bool text_int(const char **p, const char *end, int *value)
+{
+  const char *c = *p;
+  bool negative = false;
+  long v = 0;
+
+  while (c < end && input_is_space(*c))
+    c++;
+  if (c < end && (*c == '-' || *c == '+'))
+    negative = *c++ == '-';
+  *p = c;
+  if (c == end || *c < '0' || *c > '9')
+    return false;
+  for (; c < end && *c >= '0' && *c <= '9'; c++)
+  {
+    if (v <= INT32_MAX)
+      v = v * 10 + (*c - '0');
+  }
+  if (v > INT32_MAX)
+    v = INT32_MAX; // out of range for every caller anyway
+  *value = negative ? (int)-v : (int)v;
+  *p = c;
+  return true;
+}
+
+// Same as scanf("%d", value) == 1: leading white space, an optional sign
+// and at least one digit.  A sign with no digit after it is consumed, the
+// character that stops the number is not.
+bool input_int(int *value)
+{
+  bool negative = false;
+  int ch;
+
+  input_skip_space();
+  ch = input_peek();
+  if (ch == '-' || ch == '+')
+  {
+    negative = ch == '-';
+    input.pos++;
+    ch = input_peek();
+  }
+  if (ch < '0' || ch > '9')
+    return false;
+
+  long v = 0;
+  while ((ch = input_peek()) >= '0' && ch <= '9')
+  {
+    if (v <= INT32_MAX)
+      v = v * 10 + (ch - '0');
+    input.pos++;
+  }
+  if (v > INT32_MAX)
+    v = INT32_MAX; // out of range for every caller anyway
+  *value = negative ? (int)-v : (int)v;
+  return true;
+}
+
+// Read the rest of the line, newline and all, keeping at most size - 1
+// bytes of it in line, and return how many were kept
+static int input_line(char *line, int size)
+{
+  int ch, len = 0;
+
+  while ((ch = input_getc()) != '\n' && ch != EOF)
+  {
+    if (len < size - 1)
+      line[len++] = ch;
+  }
+  line[len] = '\0';
+  return len;
+}
+
+/**********************************************************************
+ * city_read: Takes in and processes a given city following a command *
+ * and returns the id of its name in the city table, or CITY_NONE     *
+ *********************************************************************/
+city_id_t city_read(void)
+{
+  city_t city;
+
+  city_read_name(city);
+  return city_find(city);
+}
+
+// Read a city as city_read does, adding its name to the table if it is new
+city_id_t city_read_intern(void)
+{
+  city_t city;
+
+  city_read_name(city);
+  return city_intern(city);
+}
+
+// Read a city name into city without interning it, returning its length
+int city_read_name(city_t city)
+{
+  int ch, i = 0;
+
+  // skip leading non letter characters
+  while (true)
+  {
+    ch = input_getc();
+    if (ch == EOF)
+    {
+      city[0] = '\0';
+      return 0;
+    }
+    if ((ch >= 'A' && ch <= 'Z') || (ch >= 'a' && ch <= 'z'))
+    {
+      city[i++] = ch;
+      break;
+    }
+  }
+
+  // The rest of the line is usually already in the buffer; copy it in one
+  // go and only fall back to a byte at a time when it runs past the end.
+  char *start = input.buf + input.pos;
+  char *nl = memchr(start, '\n', input.len - input.pos);
+  if (nl != NULL)
+  {
+    size_t n = nl - start;
+    if (n > (size_t)(MAX_CITY_NAME_LEN - i))
+      n = MAX_CITY_NAME_LEN - i;
+    memcpy(city + i, start, n);
+    i += n;
+    input.pos = nl - input.buf + 1;
+  }
+  else
+  {
+    while ((ch = input_getc()) != '\n' && ch != EOF)
+    {
+      if (i < MAX_CITY_NAME_LEN)
+      {
+        city[i++] = ch;
+      }
+    }
+  }
+  city[i] = '\0';
+  return i;
+}
+
+/**********************************************************************
+ * Output: formats text and numbers into the output chunks            *
+ *********************************************************************/
+void output_flush(void)
+{
+  struct iovec iov[OUTPUT_CHUNKS];
+  int count = 0;
+
+  if (output.client != NULL)
+  {
+    for (int i = 0; i <= output.current; i++)
+    {
+      if (output.used[i] > 0)
+        server_queue(output.client, output.chunks[i], output.used[i]);
+      output.used[i] = 0;
+    }
+    output.current = 0;
+    return;
+  }
+
+  for (int i = 0; i <= output.current; i++)
+  {
+    if (output.used[i] == 0)
+      continue;
+    iov[count].iov_base = output.chunks[i];
+    iov[count].iov_len = output.used[i];
+    count++;
+  }
+
+  struct iovec *v = iov;
+  while (count > 0)
+  {
+    ssize_t put = writev(output.fd, v, count);
+    if (put < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      break; // nowhere to send it, drop it
+    }
+    while (count > 0 && (size_t)put >= v->iov_len)
+    {
+      put -= v->iov_len;
+      v++;
+      count--;
+    }
+    if (count > 0)
+    {
+      v->iov_base = (char *)v->iov_base + put;
+      v->iov_len -= put;
+    }
+  }
+
+  for (int i = 0; i <= output.current; i++)
+    output.used[i] = 0;
+  output.current = 0;
+}
+
+// Flush and free the chunks of a thread that is about to end
+void output_close(void)
+{
+  output_flush();
+  for (int i = 0; i < OUTPUT_CHUNKS; i++)
+  {
+    free(output.chunks[i]);
+    output.chunks[i] = NULL;
+  }
+}
+
+// Room left in the current chunk, moving on to the next chunk (or
+// flushing them all) when it is full
+static size_t output_room(void)
+{
+  if (output.chunks[output.current] != NULL &&
+      output.used[output.current] < OUTPUT_CHUNK_SIZE)
+    return OUTPUT_CHUNK_SIZE - output.used[output.current];
+
+  if (output.chunks[output.current] != NULL)
+  {
+    if (output.current + 1 == OUTPUT_CHUNKS)
+      output_flush();
+    else
+      output.current++;
+  }
+  if (output.chunks[output.current] == NULL)
+  {
+    output.chunks[output.current] = malloc(OUTPUT_CHUNK_SIZE);
+    if (output.chunks[output.current] == NULL)
+    {
+      // fall back to whatever chunks we already have
+      if (output.current == 0)
+        abort();
+      output.current--;
+      output_flush();
+    }
+  }
+  return OUTPUT_CHUNK_SIZE - output.used[output.current];
+}
+
+// Bytes written for the current server client so far
+size_t output_mark(void)
+{
+  size_t n = output.client->out_len;
+  for (int i = 0; i <= output.current; i++)
+    n += output.used[i];
+  return n;
+}
+
+// Take back everything written for the current server client since mark
+void output_truncate(size_t mark)
+{
+  if (mark < output.client->out_len)
+  {
+    output.client->out_len = mark;
+    mark = 0;
+  }
+  else
+  {
+    mark -= output.client->out_len;
+  }
+  for (int i = 0; i <= output.current; i++)
+  {
+    if (output.used[i] > mark)
+      output.used[i] = mark;
+    mark -= output.used[i];
+  }
+  while (output.current > 0 && output.used[output.current] == 0)
+    output.current--;
+}
+
+void output_write(const char *s, size_t n)
+{
+  while (n > 0)
+  {
+    size_t room = output_room();
+    size_t take = n < room ? n : room;
+    memcpy(output.chunks[output.current] + output.used[output.current], s,
+           take);
+    output.used[output.current] += take;
+    s += take;
+    n -= take;
+  }
+}
+
+void output_str(const char *s)
+{
+  output_write(s, strlen(s));
+}
+
+void output_char(char c)
+{
+  output_room();
+  output.chunks[output.current][output.used[output.current]++] = c;
+}
+
+void output_int(long v)
+{
+  char digits[24];
+  char *p = digits + sizeof(digits);
+  unsigned long u = v < 0 ? -(unsigned long)v : (unsigned long)v;
+
+  do
+  {
+    *--p = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (v < 0)
+    *--p = '-';
+  output_write(p, digits + sizeof(digits) - p);
+}
+
+/****************************************************************
+ * Message functions so that your messages match what we expect *
+ ****************************************************************/
+void msg_city_bad(char *city)
+{
+  output_str("No schedule for ");
+  output_str(city);
+  output_char('\n');
+}
+
+void msg_city_exists(char *city)
+{
+  output_str("There is a schedule of ");
+  output_str(city);
+  output_str(" already.\n");
+}
+
+void msg_schedule_no_free(void)
+{
+  output_str("Sorry no more free schedules.\n");
+}
+
+void msg_city_flights(char *city)
+{
+  output_str("The flights for ");
+  output_str(city);
+  output_str(" are:");
+}
+
+void msg_next_departure(char *city)
+{
+  output_str("The next flight with a seat is to ");
+  output_str(city);
+  output_char(':');
+}
+
+void msg_window_flights(int from, int to)
+{
+  output_str("The flights with seats from ");
+  output_int(from);
+  output_str(" to ");
+  output_int(to);
+  output_str(" are:\n");
+}
+
+void msg_window_count(int from, int to, long count)
+{
+  output_str("There are ");
+  output_int(count);
+  output_str(" flights with seats from ");
+  output_int(from);
+  output_str(" to ");
+  output_int(to);
+  output_str(".\n");
+}
+
+void msg_roll_forward(long retired, int first, int last)
+{
+  output_str("Retired ");
+  output_int(retired);
+  output_str(" flights. Times now run from ");
+  output_int(first);
+  output_str(" to ");
+  output_int(last);
+  output_str(".\n");
+}
+
+void msg_flight_info(int time, int avail, int capacity)
+{
+  output_str(" (");
+  output_int(time);
+  output_str(", ");
+  output_int(avail);
+  output_str(", ");
+  output_int(capacity);
+  output_char(')');
+}
+
+void msg_city_max_flights_reached(char *city)
+{
+  output_str("Sorry we cannot add more flights on this city.\n");
+}
+
+void msg_flight_bad_time(void)
+{
+  output_str("Sorry there's no flight scheduled on this time.\n");
+}
+
+void msg_flight_no_seats(void)
+{
+  output_str("Sorry there's no more seats available!\n");
+}
+
+void msg_flight_all_seats_empty(void)
+{
+  output_str("All the seats on this flights are empty!\n");
+}
+
+void msg_flight_too_few_seats(void)
+{
+  output_str("Sorry not that many seats are taken on this flight.\n");
+}
+
+void msg_seats_booked(int seats, int time)
+{
+  output_str("Booked ");
+  output_int(seats);
+  output_str(seats == 1 ? " seat on the flight at " : " seats on the flight at ");
+  output_int(time);
+  output_str(".\n");
+}
+
+void msg_seats_freed(int seats, int time)
+{
+  output_str("Freed ");
+  output_int(seats);
+  output_str(seats == 1 ? " seat on the flight at " : " seats on the flight at ");
+  output_int(time);
+  output_str(".\n");
+}
+
+void msg_waitlisted(int ticket, int time)
+{
+  output_str("Waitlisted with ticket ");
+  output_int(ticket);
+  output_str(" for the flight at ");
+  output_int(time);
+  output_str(".\n");
+}
+
+void msg_ticket_bad(void)
+{
+  output_str("Invalid ticket value\n");
+}
+
+void msg_no_ticket(char *city)
+{
+  output_str("Sorry there's no such ticket waiting for ");
+  output_str(city);
+  output_str(".\n");
+}
+
+void msg_waitlist_notice(const struct waitlist_notice *n)
+{
+  output_str("Ticket ");
+  output_int(n->ticket);
+  output_str(n->seated ? " has a seat on the flight to "
+                       : " is off the waitlist: no more flight to ");
+  output_str(city_name(n->city));
+  output_str(" at ");
+  output_int(n->time);
+  output_str(".\n");
+}
+
+// Tell the waiters the command just run seated or dropped.  In server
+// mode each hears it on its own connection, whoever sent the command.
+void msg_waitlist_notices(void)
+{
+  struct server_client *self = output.client;
+
+  for (int k = 0; k < waitlist_notices.count; k++)
+  {
+    const struct waitlist_notice *n = &waitlist_notices.items[k];
+    if (n->client == NULL || n->client == self)
+    {
+      msg_waitlist_notice(n);
+      continue;
+    }
+    output_flush();
+    output.client = n->client;
+    msg_waitlist_notice(n);
+    output_flush();
+    output.client = self;
+    server_watch(n->client);
+  }
+  waitlist_notices.count = 0;
+}
+
+void msg_feed_delta(const struct feed_delta *d)
+{
+  output_str("Delta ");
+  output_str(city_name(d->city));
+  output_char(' ');
+  output_int(d->seq);
+  output_str(": ");
+  output_char(d->op);
+  if (d->op != 'A' && d->op != 'R')
+    msg_flight_info(d->time, d->available, d->capacity);
+  output_char('\n');
+}
+
+// Print s's deltas, oldest first.  A server client only gets them while
+// its unsent replies are below SERVER_OUTPUT_MAX; the rest wait in the
+// ring for it to catch up.
+void msg_feed(struct feed_subscriber *s)
+{
+  struct feed_delta deltas[FEED_TAKE];
+  struct server_client *c = s->client;
+  int n;
+
+  while ((c == NULL || c->out_len - c->out_sent < SERVER_OUTPUT_MAX) &&
+         (n = feed_take(s, deltas, FEED_TAKE)) > 0)
+  {
+    for (int k = 0; k < n; k++)
+      msg_feed_delta(&deltas[k]);
+    if (c != NULL)
+      output_flush(); // so the next look sees them queued
+  }
+}
+
+void msg_snapshot_failed(void)
+{
+  output_str("Sorry the snapshot could not be saved.\n");
+}
+
+void msg_time_bad()
+{
+  output_str("Invalid time value\n");
+}
+
+void msg_capacity_bad()
+{
+  output_str("Invalid capacity value\n");
+}
+
+void msg_page_bad(void)
+{
+  output_str("Invalid page value\n");
+}
+
+void msg_row_bad(void)
+{
+  output_str("Invalid timetable row\n");
+}
+
+void msg_shard_bad(void)
+{
+  output_str("Invalid shard value\n");
+}
+
+void msg_seats_bad(void)
+{
+  output_str("Invalid seats value\n");
+}
+
+void msg_batch_bad(void)
+{
+  output_str("Invalid batch value\n");
+}
+
+void msg_days_bad(void)
+{
+  output_str("Invalid days value\n");
+}
+
+// Start of the message for a timetable row that was not imported, or for
+// a tuple of a batch
+void msg_import_line(uint32_t line)
+{
+  output_str("Line ");
+  output_int(line);
+  output_str(": ");
+}
+
+void msg_import_done(long flights, long cities, long rows)
+{
+  output_str("Imported ");
+  output_int(flights);
+  output_str(" flights to ");
+  output_int(cities);
+  output_str(" cities from ");
+  output_int(rows);
+  output_str(" rows.\n");
+}
+
+// One line for each tuple of a batch, in batch order
+void msg_batch(const struct batch_tuple *tuples, int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    const struct batch_tuple *t = &tuples[i];
+    msg_import_line(i + 1);
+    if (t->error != PARSE_OK)
+      msg_parse_error(t->error);
+    else if (t->city == CITY_NONE) // a name nobody added has no schedule
+      msg_city_bad((char *)t->name);
+    else if (t->status != BOOKING_OK)
+      msg_booking_status(t->status, t->city);
+    else if (t->seats > 0)
+      msg_seats_booked(t->seats, t->time);
+    else
+      msg_seats_freed(-t->seats, t->time);
+  }
+}
+
+void msg_command_bad(void)
+{
+  output_str("Bad command. Use h to see help.\n");
+}
+
+void msg_replica_read_only(void)
+{
+  output_str("This replica only answers L, l, p and P.\n");
+}
+
+// Print the message for a parse_error other than PARSE_NO_SCHEDULE.
+// Returns true when there was no error.
+bool msg_parse_error(int error)
+{
+  switch (error)
+  {
+  case PARSE_TIME_BAD:
+    msg_time_bad();
+    break;
+  case PARSE_CAPACITY_BAD:
+    msg_capacity_bad();
+    break;
+  case PARSE_PAGE_BAD:
+    msg_page_bad();
+    break;
+  case PARSE_ROW_BAD:
+    msg_row_bad();
+    break;
+  case PARSE_SHARD_BAD:
+    msg_shard_bad();
+    break;
+  case PARSE_SEATS_BAD:
+    msg_seats_bad();
+    break;
+  case PARSE_BATCH_BAD:
+    msg_batch_bad();
+    break;
+  case PARSE_TICKET_BAD:
+    msg_ticket_bad();
+    break;
+  case PARSE_DAYS_BAD:
+    msg_days_bad();
+    break;
+  default: // PARSE_OK, PARSE_QUIET
+    break;
+  }
+  return error == PARSE_OK;
+}
+
+void print_command_help()
+{
+  output_str("Here are the possible commands:\n"
+         "A <city name>     - Add an active empty flight schedule for\n"
+         "                    <city name>\n"
+         "L                 - List cities which have an active schedule\n"
+         "p <prefix>        - List those cities whose names start with\n"
+         "                    <prefix>\n"
+         "P <from> <count>  - List <count> of those cities starting with\n"
+         "                    the <from>th (from 0) in alphabetical order\n"
+         "l <city name>     - List the flights for <city name>\n"
+         "a <city name>\n"
+         "<time> <capacity> - Add a flight for <city name> @ <time> time\n"
+         "                    with <capacity> seats\n"
+         "r <city name>\n"
+         "<time>            - Remove a flight form <city name> whose time is\n"
+         "                    <time>\n"
+         "s <city name>\n"
+         "<time>            - Attempt to schedule seat on flight to \n"
+         "                    <city name> at <time> or next closest time on\n"
+         "                    which their is an available seat\n"
+         "u <city name>\n"
+         "<time>            - unschedule a seat from flight to <city name>\n"
+         "                    at <time>\n"
+         "b <city name>\n"
+         "<time> <seats>    - Schedule <seats> seats together on the first\n"
+         "                    flight to <city name> at or after <time>\n"
+         "                    that has that many available\n"
+         "f <city name>\n"
+         "<time> <seats>    - unschedule <seats> seats together from flight\n"
+         "                    to <city name> at <time>\n"
+         "B <count>         - Schedule seats as b does for <count> pairs of\n"
+         "                    lines <city name> and <time> <seats> that\n"
+         "                    follow, or unschedule them as f does if\n"
+         "                    <seats> is negative, printing a line for each\n"
+         "Q <city name>\n"
+         "<time>            - Schedule a seat as s does, or if there is none\n"
+         "                    wait in line for the first flight to\n"
+         "                    <city name> at or after <time>\n"
+         "c <city name>\n"
+         "<ticket>          - Stop waiting in line with <ticket>\n"
+         "F <city name>     - Print every change to the flights for\n"
+         "                    <city name> after the reply to the command\n"
+         "                    that made it\n"
+         "X <city name>     - Stop printing the changes for <city name>\n"
+         "R <city name>     - Remove schedule for <city name>\n"
+         "n <time>          - List the earliest flight to any city at or\n"
+         "                    after <time> with an available seat\n"
+         "w <from> <to>     - List the flights to any city departing from\n"
+         "                    <from> to <to> with an available seat\n"
+         "W <from> <to>     - Count the flights to any city departing from\n"
+         "                    <from> to <to> with an available seat\n"
+         "D <days>          - Retire the first <days> days of the calendar\n"
+         "                    with their flights and open as many after\n"
+         "                    its last day (0 shows the range)\n"
+         "S                 - Save a snapshot of all schedules\n"
+         "T                 - Print statistics\n"
+         "h                 - print this help message\n"
+         "q                 - quit\n");
+  if (router.count > 0)
+    output_str("M <city name>\n"
+               "<shard>           - Move the schedule for <city name> to\n"
+               "                    <shard>\n");
+}
+
+// Point fs's flight arrays into block, which has room for slots flights
+static void flight_schedule_use_block(struct flight_schedule *fs, int *block,
+                                      int slots)
+{
+  fs->times = block;
+  fs->available = block + slots;
+  fs->capacity = block + 2 * (size_t)slots;
+  fs->entries = block + 3 * (size_t)slots;
+  fs->waitlists = block + 4 * (size_t)slots;
+  fs->flight_slots = slots;
+}
+
+/****************************************************************
+ * Resets a flight schedule                                     *
+ ****************************************************************/
+void flight_schedule_reset(struct flight_schedule *fs)
+{
+  fs->destination = CITY_NONE;
+  // a schedule fresh from the pool has a NULL flights pointer
+  if (fs->times != NULL && fs->times != fs->flights_inline)
+    flight_arena_release(fs->times, fs->flight_slots);
+  if (fs->open_seats != NULL && fs->open_seats != &fs->open_seats_inline)
+    free(fs->open_seats);
+  flight_schedule_use_block(fs, fs->flights_inline, MAX_FLIGHTS_INLINE);
+  fs->flight_count = 0;
+  fs->open_seats = &fs->open_seats_inline;
+  fs->open_seats_inline = 0;
+  fs->next = NULL;
+  fs->prev = NULL;
+}
+
+/******************************************************************
+ * Schedule pool                                                  *
+ * Slabs are mapped anonymously so their pages are zero-filled by *
+ * the kernel on first touch rather than by us.  A schedule is    *
+ * only reset when it is handed out for the first time.           *
+ *****************************************************************/
+static void *pool_map(size_t *bytes)
+{
+  void *p;
+
+  if (flight_schedules_pool.huge_pages)
+  {
+    size_t huge = (*bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    p = mmap(NULL, huge, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+    {
+      *bytes = huge;
+      return p;
+    }
+    // no huge pages configured; fall back to normal pages
+  }
+
+  p = mmap(NULL, *bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+           -1, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Map a new slab holding at least n schedules and make it the bump region.
+// Whatever was left of the previous bump region is pushed on the free list
+// so it is not lost.
+bool flight_schedule_pool_reserve(size_t n)
+{
+  struct flight_schedule_pool *pool = &flight_schedules_pool;
+  size_t bytes = sizeof(struct flight_schedule_slab) +
+                 n * sizeof(struct flight_schedule);
+  struct flight_schedule_slab *slab = pool_map(&bytes);
+
+  if (slab == NULL)
+    return false;
+
+  // use any slack at the end of the mapping (page or huge page rounding)
+  slab->count = (bytes - sizeof(*slab)) / sizeof(struct flight_schedule);
+  slab->bytes = bytes;
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  pool->total += slab->count;
+
+  while (pool->bump_left > 0)
+  {
+    struct flight_schedule *fs = pool->bump++;
+    pool->bump_left--;
+    flight_schedule_reset(fs);
+    fs->next = flight_schedules_free;
+    if (flight_schedules_free)
+      flight_schedules_free->prev = fs;
+    flight_schedules_free = fs;
+  }
+  pool->bump = slab->schedules;
+  pool->bump_left = slab->count;
+  return true;
+}
+
+/******************************************************************
+ * Flight arena                                                   *
+ * Blocks hold FLIGHT_ARENA_MIN_BLOCK << class flights.  Small    *
+ * blocks are cut from shared chunks; a block bigger than a chunk *
+ * gets a mapping of its own.                                     *
+ *****************************************************************/
+static int flight_arena_class(int slots)
+{
+  int cls = 0;
+  while ((FLIGHT_ARENA_MIN_BLOCK << cls) < slots)
+    cls++;
+  return cls;
+}
+
+static int *flight_arena_alloc_locked(int slots)
+{
+  struct flight_arena *arena = &flight_arena;
+  int cls = flight_arena_class(slots);
+  size_t bytes = ((size_t)FLIGHT_ARENA_MIN_BLOCK << cls) * FLIGHT_FIELDS *
+                 sizeof(int);
+  int *block;
+
+  if (cls >= FLIGHT_ARENA_CLASSES)
+    return NULL;
+
+  if ((block = arena->free_blocks[cls]) != NULL)
+  {
+    arena->free_blocks[cls] = *(int **)block;
+    return block;
+  }
+
+  if (bytes > FLIGHT_ARENA_CHUNK)
+    return pool_map(&bytes);
+
+  if (arena->chunk_left < bytes)
+  {
+    size_t chunk_bytes = FLIGHT_ARENA_CHUNK;
+    char *chunk = pool_map(&chunk_bytes);
+    if (chunk == NULL)
+      return NULL;
+    // the tail of the old chunk is simply abandoned
+    arena->chunk = chunk;
+    arena->chunk_left = chunk_bytes;
+  }
+  block = (int *)arena->chunk;
+  arena->chunk += bytes;
+  arena->chunk_left -= bytes;
+  return block;
+}
+
+// Schedules of different cities may grow at the same time
+int *flight_arena_alloc(int slots)
+{
+  pthread_mutex_lock(&flight_arena_lock);
+  int *block = flight_arena_alloc_locked(slots);
+  pthread_mutex_unlock(&flight_arena_lock);
+  return block;
+}
+
+void flight_arena_release(int *block, int slots)
+{
+  struct flight_arena *arena = &flight_arena;
+  int cls = flight_arena_class(slots);
+
+  pthread_mutex_lock(&flight_arena_lock);
+  *(int **)block = arena->free_blocks[cls];
+  arena->free_blocks[cls] = block;
+  pthread_mutex_unlock(&flight_arena_lock);
+}
+
+// Make room for at least n flights in fs, moving its flights to a bigger
+// block if needed.  Returns false when n is past the per city limit or
+// memory is exhausted.
+bool flight_schedule_reserve_flights(struct flight_schedule *fs, int n)
+{
+  if (n <= fs->flight_slots)
+    return true;
+  if (n > MAX_FLIGHTS_PER_CITY)
+    return false;
+
+  int slots = FLIGHT_ARENA_MIN_BLOCK;
+  while (slots < n)
+    slots *= 2;
+
+  size_t old_words = (fs->flight_slots + 63) / 64;
+  size_t words = (slots + 63) / 64;
+  uint64_t *bits = fs->open_seats;
+  if (words > old_words)
+  {
+    bits = malloc(words * sizeof(uint64_t));
+    if (bits == NULL)
+      return false;
+    memcpy(bits, fs->open_seats, old_words * sizeof(uint64_t));
+    memset(bits + old_words, 0, (words - old_words) * sizeof(uint64_t));
+  }
+
+  int *block = flight_arena_alloc(slots);
+  if (block == NULL)
+  {
+    if (bits != fs->open_seats)
+      free(bits);
+    return false;
+  }
+
+  size_t bytes = fs->flight_count * sizeof(int);
+  memcpy(block, fs->times, bytes);
+  memcpy(block + slots, fs->available, bytes);
+  memcpy(block + 2 * (size_t)slots, fs->capacity, bytes);
+  memcpy(block + 3 * (size_t)slots, fs->entries, bytes);
+  memcpy(block + 4 * (size_t)slots, fs->waitlists, bytes);
+  if (fs->times != fs->flights_inline)
+    flight_arena_release(fs->times, fs->flight_slots);
+  if (bits != fs->open_seats && fs->open_seats != &fs->open_seats_inline)
+    free(fs->open_seats);
+  flight_schedule_use_block(fs, block, slots);
+  fs->open_seats = bits;
+  return true;
+}
+
+// Move fs's flights to a smaller block once they fill no more than a
+// quarter of an arena block, giving that back for other cities to grow
+// into.  Keeps the block it has when there is no memory for a new one.
+void flight_schedule_shrink_flights(struct flight_schedule *fs)
+{
+  int n = fs->flight_count;
+  if (fs->times == fs->flights_inline || n > fs->flight_slots / 4)
+    return;
+
+  int slots = MAX_FLIGHTS_INLINE;
+  int *block = fs->flights_inline;
+  if (n > MAX_FLIGHTS_INLINE)
+  {
+    slots = FLIGHT_ARENA_MIN_BLOCK;
+    while (slots < n)
+      slots *= 2;
+    if ((block = flight_arena_alloc(slots)) == NULL)
+      return;
+  }
+
+  size_t bytes = n * sizeof(int);
+  memcpy(block, fs->times, bytes);
+  memcpy(block + slots, fs->available, bytes);
+  memcpy(block + 2 * (size_t)slots, fs->capacity, bytes);
+  memcpy(block + 3 * (size_t)slots, fs->entries, bytes);
+  memcpy(block + 4 * (size_t)slots, fs->waitlists, bytes);
+  flight_arena_release(fs->times, fs->flight_slots);
+  if (slots <= 64 && fs->open_seats != &fs->open_seats_inline)
+  {
+    fs->open_seats_inline = fs->open_seats[0];
+    free(fs->open_seats);
+    fs->open_seats = &fs->open_seats_inline;
+  }
+  flight_schedule_use_block(fs, block, slots);
+}
+
+/******************************************************************
+ * Flight ordering                                                *
+ * Flights are kept sorted by time as they are added and removed, *
+ * so a seat request is a binary search for the first flight at   *
+ * or after the requested time followed by a scan of the          *
+ * open_seats bitmap for the first flight that is not sold out.   *
+ * Bits at or past flight_count are always zero.                  *
+ *****************************************************************/
+
+// Index of the first flight departing at or after time
+int flight_schedule_lower_bound(struct flight_schedule *fs, int time)
+{
+  int lo = 0, hi = fs->flight_count;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (fs->times[mid] < time)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Insert a new full capacity flight after any flights with the same time
+// and file it in the time index.  Returns its index, or -1 if there is no
+// room for it.  The caller holds time_index.lock for writing.
+int flight_schedule_insert_flight(struct flight_schedule *fs, int time,
+                                  int capacity)
+{
+  int n = fs->flight_count;
+  if (!flight_schedule_reserve_flights(fs, n + 1))
+    return -1;
+
+  int i = flight_schedule_lower_bound(fs, time + 1);
+  size_t bytes = (n - i) * sizeof(int);
+  memmove(&fs->times[i + 1], &fs->times[i], bytes);
+  memmove(&fs->available[i + 1], &fs->available[i], bytes);
+  memmove(&fs->capacity[i + 1], &fs->capacity[i], bytes);
+  memmove(&fs->entries[i + 1], &fs->entries[i], bytes);
+  memmove(&fs->waitlists[i + 1], &fs->waitlists[i], bytes);
+  fs->times[i] = time;
+  fs->available[i] = capacity;
+  fs->capacity[i] = capacity;
+  fs->waitlists[i] = 0;
+  fs->flight_count = n + 1;
+  if (!time_index_add(fs, i))
+  {
+    memmove(&fs->times[i], &fs->times[i + 1], bytes);
+    memmove(&fs->available[i], &fs->available[i + 1], bytes);
+    memmove(&fs->capacity[i], &fs->capacity[i + 1], bytes);
+    memmove(&fs->entries[i], &fs->entries[i + 1], bytes);
+    memmove(&fs->waitlists[i], &fs->waitlists[i + 1], bytes);
+    fs->flight_count = n;
+    return -1;
+  }
+
+  // shift bits i .. n - 1 of the bitmap up one place and set bit i
+  uint64_t *w = fs->open_seats;
+  int k = i / 64;
+  for (int j = n / 64; j > k; j--)
+    w[j] = (w[j] << 1) | (w[j - 1] >> 63);
+  uint64_t low = (UINT64_C(1) << (i % 64)) - 1;
+  w[k] = (w[k] & low) | ((w[k] & ~low) << 1) | (UINT64_C(1) << (i % 64));
+  return i;
+}
+
+// Take flight i out of fs and the time index.  The caller holds
+// time_index.lock for writing and has dropped the flight's waitlist.
+void flight_schedule_delete_flight(struct flight_schedule *fs, int i)
+{
+  int n = fs->flight_count;
+  time_index_remove(fs, i);
+  size_t bytes = (n - i - 1) * sizeof(int);
+  memmove(&fs->times[i], &fs->times[i + 1], bytes);
+  memmove(&fs->available[i], &fs->available[i + 1], bytes);
+  memmove(&fs->capacity[i], &fs->capacity[i + 1], bytes);
+  memmove(&fs->entries[i], &fs->entries[i + 1], bytes);
+  memmove(&fs->waitlists[i], &fs->waitlists[i + 1], bytes);
+
+  // shift bits i + 1 .. n - 1 of the bitmap down one place
+  uint64_t *w = fs->open_seats;
+  int k = i / 64;
+  uint64_t low = (UINT64_C(1) << (i % 64)) - 1;
+  w[k] = (w[k] & low) | ((w[k] >> 1) & ~low);
+  for (int j = k; j < (n - 1) / 64; j++)
+  {
+    w[j] |= w[j + 1] << 63;
+    w[j + 1] >>= 1;
+  }
+
+  fs->flight_count = n - 1;
+}
+
+// Take the first k flights out of fs, as D retires the days they leave
+// on.  Their buckets are emptied all at once by time_index_retire, so
+// only the arrays and the bitmap move.  The caller holds time_index.lock
+// for writing and has dropped the flights' waitlists.
+void flight_schedule_drop_flights(struct flight_schedule *fs, int k)
+{
+  int n = fs->flight_count;
+  size_t bytes = (n - k) * sizeof(int);
+  memmove(&fs->times[0], &fs->times[k], bytes);
+  memmove(&fs->available[0], &fs->available[k], bytes);
+  memmove(&fs->capacity[0], &fs->capacity[k], bytes);
+  memmove(&fs->entries[0], &fs->entries[k], bytes);
+  memmove(&fs->waitlists[0], &fs->waitlists[k], bytes);
+
+  // shift the bitmap down k places
+  uint64_t *w = fs->open_seats;
+  int words = (n + 63) / 64, skip = k / 64, shift = k % 64;
+  for (int j = 0; j < words; j++)
+  {
+    uint64_t lo = j + skip < words ? w[j + skip] : 0;
+    uint64_t hi = j + skip + 1 < words ? w[j + skip + 1] : 0;
+    w[j] = shift == 0 ? lo : (lo >> shift) | (hi << (64 - shift));
+  }
+
+  fs->flight_count = n - k;
+  flight_schedule_shrink_flights(fs);
+}
+
+// Index of the first flight at or after from with a seat available, or -1
+int flight_schedule_next_open(struct flight_schedule *fs, int from)
+{
+  int n = fs->flight_count;
+  if (from >= n)
+    return -1;
+
+  int k = from / 64;
+  uint64_t word = __atomic_load_n(&fs->open_seats[k], __ATOMIC_RELAXED) &
+                  (~UINT64_C(0) << (from % 64));
+  while (word == 0)
+  {
+    if (++k * 64 >= n)
+      return -1;
+    word = __atomic_load_n(&fs->open_seats[k], __ATOMIC_RELAXED);
+  }
+  return k * 64 + __builtin_ctzll(word);
+}
+
+/******************************************************************
+ * Seek kernel                                                    *
+ * flight_seek finds the first flight in from .. n - 1 departing  *
+ * at or after a time with a seat available, comparing 8 (AVX2)   *
+ * or 4 (SSE2) flights per step with no branch per flight.  The   *
+ * widest kernel the CPU supports is picked at startup.  Seat     *
+ * counts are read without atomics here; like the open_seats bit, *
+ * the answer is only a hint that take_seats' compare and swap   *
+ * confirms.                                                      *
+ *****************************************************************/
+static int flight_seek_scalar(const int *times, const int *available, int from,
+                              int n, int time)
+{
+  for (int i = from; i < n; i++)
+  {
+    if (times[i] >= time && __atomic_load_n(&available[i], __ATOMIC_RELAXED) > 0)
+      return i;
+  }
+  return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static int flight_seek_sse2(const int *times, const int *available, int from,
+                            int n, int time)
+{
+  __m128i before = _mm_set1_epi32(time - 1);
+  __m128i zero = _mm_setzero_si128();
+  int i = from;
+
+  for (; i + 4 <= n; i += 4)
+  {
+    __m128i t = _mm_loadu_si128((const __m128i *)(times + i));
+    __m128i a = _mm_loadu_si128((const __m128i *)(available + i));
+    __m128i hit = _mm_and_si128(_mm_cmpgt_epi32(t, before),
+                                _mm_cmpgt_epi32(a, zero));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(hit));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return flight_seek_scalar(times, available, i, n, time);
+}
+
+__attribute__((target("avx2")))
+static int flight_seek_avx2(const int *times, const int *available, int from,
+                            int n, int time)
+{
+  __m256i before = _mm256_set1_epi32(time - 1);
+  __m256i zero = _mm256_setzero_si256();
+  __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+
+  for (int i = from; i < n; i += 8)
+  {
+    // lanes past n are masked off so nothing beyond the arrays is read
+    __m256i live = _mm256_cmpgt_epi32(_mm256_set1_epi32(n - i), lanes);
+    __m256i t = _mm256_maskload_epi32(times + i, live);
+    __m256i a = _mm256_maskload_epi32(available + i, live);
+    __m256i hit = _mm256_and_si256(_mm256_cmpgt_epi32(t, before),
+                                   _mm256_cmpgt_epi32(a, zero));
+    int mask = _mm256_movemask_ps(_mm256_castsi256_ps(hit));
+    if (mask != 0)
+      return i + __builtin_ctz(mask);
+  }
+  return -1;
+}
+#endif
+
+static int (*flight_seek_kernel)(const int *, const int *, int, int, int) =
+    flight_seek_scalar;
+
+// Choose the kernel once, before any other thread can be searching
+static void flight_seek_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    flight_seek_kernel = flight_seek_avx2;
+  else if (__builtin_cpu_supports("sse2"))
+    flight_seek_kernel = flight_seek_sse2;
+#endif
+}
+
+int flight_seek(const int *times, const int *available, int from, int n,
+                int time)
+{
+  return flight_seek_kernel(times, available, from, n, time);
+}
+
+// First flight at index from or later departing at or after time with a
+// seat, or -1.  Short runs are scanned by the kernel in one pass; a long
+// one is narrowed by binary search and the open_seats bitmap instead,
+// which skips sold out flights 64 at a time.
+int flight_schedule_seek(struct flight_schedule *fs, int time, int from)
+{
+  int n = fs->flight_count;
+  if (n - from <= FLIGHT_SCAN_MAX)
+    return flight_seek(fs->times, fs->available, from, n, time);
+
+  int i = flight_schedule_lower_bound(fs, time);
+  if (i < from)
+    i = from;
+  if (n - i <= FLIGHT_SCAN_MAX)
+    return flight_seek(fs->times, fs->available, i, n, time);
+  return flight_schedule_next_open(fs, i);
+}
+
+// Seats are taken and given back with compare and swap so any number of
+// threads holding the schedule's stripe for reading can book at once
+// without ever taking available below zero or above capacity.
+//
+// The open_seats bit is only a hint that may briefly be set for a full
+// flight, never clear for one with seats: whoever takes the last seat
+// clears the bit and then looks again in case a seat came back meanwhile,
+// and whoever gives a seat back to a full flight sets it.  The flight's
+// bit in the time index is kept the same way alongside it.
+
+// Take n seats on flight i all at once; false if it has fewer free.
+// *left is set to the seats the swap left, as later ones may change them.
+bool flight_schedule_take_seats(struct flight_schedule *fs, int i, int n,
+                                int *left)
+{
+  int *available = &fs->available[i];
+  uint64_t bit = UINT64_C(1) << (i % 64);
+  int v = __atomic_load_n(available, __ATOMIC_RELAXED);
+
+  do
+  {
+    if (v < n)
+      return false;
+  } while (!__atomic_compare_exchange_n(available, &v, v - n, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+  *left = v - n;
+  if (v == n)
+  {
+    pthread_rwlock_rdlock(&time_index.lock);
+    __atomic_fetch_and(&fs->open_seats[i / 64], ~bit, __ATOMIC_SEQ_CST);
+    time_index_mark(fs, i, false);
+    if (__atomic_load_n(available, __ATOMIC_SEQ_CST) > 0)
+    {
+      __atomic_fetch_or(&fs->open_seats[i / 64], bit, __ATOMIC_SEQ_CST);
+      time_index_mark(fs, i, true);
+    }
+    pthread_rwlock_unlock(&time_index.lock);
+  }
+  return true;
+}
+
+// Give n seats back to flight i all at once; false if fewer are taken.
+// *left is set as take_seats sets it.
+bool flight_schedule_give_seats(struct flight_schedule *fs, int i, int n,
+                                int *left)
+{
+  int *available = &fs->available[i];
+  int capacity = fs->capacity[i];
+  int v = __atomic_load_n(available, __ATOMIC_RELAXED);
+
+  do
+  {
+    if (v > capacity - n)
+      return false;
+  } while (!__atomic_compare_exchange_n(available, &v, v + n, true,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+  *left = v + n;
+  if (v == 0)
+  {
+    pthread_rwlock_rdlock(&time_index.lock);
+    __atomic_fetch_or(&fs->open_seats[i / 64], UINT64_C(1) << (i % 64),
+                      __ATOMIC_SEQ_CST);
+    time_index_mark(fs, i, true);
+    pthread_rwlock_unlock(&time_index.lock);
+  }
+  return true;
+}
+
+/******************************************************************
+ * Change feed                                                    *
+ * feed_emit is called wherever a change is made, with the        *
+ * city's stripe held.  Subscribing and taking deltas out happen  *
+ * on the thread that reads the commands.                         *
+ *****************************************************************/
+static void feed_fail(void)
+{
+  output_flush();
+  printf("ERROR: Out of memory subscribing to a city.\n");
+  exit(EXIT_FAILURE);
+}
+
+// Subscribe *s to city, making *s first if it is NULL; false if it was
+// subscribed already.  seq is the number of the last delta, which is 0
+// unless -N moves the subscription from another shard.
+bool feed_subscribe(struct feed_subscriber **s, struct server_client *client,
+                    city_id_t city, uint32_t seq)
+{
+  struct feed_link *link;
+
+  pthread_mutex_lock(&feed.lock);
+  if (*s == NULL)
+  {
+    if ((*s = calloc(1, sizeof(struct feed_subscriber))) == NULL)
+      feed_fail();
+    (*s)->client = client;
+    (*s)->next = feed.subscribers;
+    if (feed.subscribers != NULL)
+      feed.subscribers->prev = *s;
+    feed.subscribers = *s;
+  }
+  for (link = (*s)->links; link != NULL; link = link->next)
+  {
+    if (link->city == city)
+    {
+      pthread_mutex_unlock(&feed.lock);
+      return false;
+    }
+  }
+  if ((link = malloc(sizeof(*link))) == NULL)
+    feed_fail();
+  struct city_entry *e = city_entry(city);
+  link->city = city;
+  link->seq = seq;
+  link->subscriber = *s;
+  link->next = (*s)->links;
+  (*s)->links = link;
+  link->city_next = e->feed;
+  // stored atomically for feed_emit's look without the lock
+  __atomic_store_n(&e->feed, link, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&feed.lock);
+  return true;
+}
+
+// Take link off its city's list and free it; the caller has taken it off
+// its subscriber's
+static void feed_unlink(struct feed_link *link)
+{
+  struct feed_link **at = &city_entry(link->city)->feed;
+
+  while (*at != link)
+    at = &(*at)->city_next;
+  __atomic_store_n(at, link->city_next, __ATOMIC_RELAXED);
+  free(link);
+}
+
+// End s's subscription to city, setting *seq to the number of its last
+// delta; false if there was none.  Deltas already in the ring stay.
+bool feed_unsubscribe(struct feed_subscriber *s, city_id_t city,
+                      uint32_t *seq)
+{
+  bool found = false;
+
+  if (s == NULL)
+    return false;
+  pthread_mutex_lock(&feed.lock);
+  for (struct feed_link **at = &s->links; *at != NULL; at = &(*at)->next)
+  {
+    struct feed_link *link = *at;
+    if (link->city == city)
+    {
+      if (seq != NULL)
+        *seq = link->seq;
+      *at = link->next;
+      feed_unlink(link);
+      found = true;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&feed.lock);
+  return found;
+}
+
+// A server client is going: end its subscriptions and free its ring
+void feed_close(struct feed_subscriber *s)
+{
+  if (s == NULL)
+    return;
+  pthread_mutex_lock(&feed.lock);
+  while (s->links != NULL)
+  {
+    struct feed_link *link = s->links;
+    s->links = link->next;
+    feed_unlink(link);
+  }
+  for (struct feed_subscriber **at = &feed.ready; s->ready;
+       at = &(*at)->ready_next)
+  {
+    if (*at == s)
+    {
+      *at = s->ready_next;
+      s->ready = false;
+    }
+  }
+  if (s->prev != NULL)
+    s->prev->next = s->next;
+  else
+    feed.subscribers = s->next;
+  if (s->next != NULL)
+    s->next->prev = s->prev;
+  pthread_mutex_unlock(&feed.lock);
+  free(s);
+}
+
+// Put a delta for a change to city in the ring of each of its
+// subscribers.  A city nobody follows costs one load.
+void feed_emit(char op, city_id_t city, int time, int available, int capacity)
+{
+  struct city_entry *e = city_entry(city);
+
+  if (__atomic_load_n(&e->feed, __ATOMIC_RELAXED) == NULL)
+    return;
+  pthread_mutex_lock(&feed.lock);
+  for (struct feed_link *link = e->feed; link != NULL; link = link->city_next)
+  {
+    struct feed_subscriber *s = link->subscriber;
+    if (s->head - s->tail == FEED_RING_RECORDS)
+    {
+      // the subscriber is that far behind: lose the oldest
+      __atomic_store_n(&s->tail, s->tail + 1, __ATOMIC_RELAXED);
+      STATS_COUNT(feed_dropped);
+    }
+    s->ring[s->head % FEED_RING_RECORDS] = (struct feed_delta){
+        ++link->seq, city, op, time, available, capacity};
+    __atomic_store_n(&s->head, s->head + 1, __ATOMIC_RELAXED);
+    STATS_COUNT(feed_deltas);
+    if (s->client != NULL && !s->ready)
+    {
+      s->ready = true;
+      s->ready_next = feed.ready;
+      feed.ready = s;
+    }
+  }
+  pthread_mutex_unlock(&feed.lock);
+}
+
+// A delta for flight i of fs as it is now, with the stripe held for
+// writing so no seat can move
+static void feed_flight(char op, struct flight_schedule *fs, int i)
+{
+  feed_emit(op, fs->destination, fs->times[i], fs->available[i],
+            fs->capacity[i]);
+}
+
+// A delta for seats taken or given back on flight i of fs, leaving
+// available, as the compare and swap that moved them left it
+static void feed_seats(char op, struct flight_schedule *fs, int i,
+                       int available)
+{
+  feed_emit(op, fs->destination, fs->times[i], available, fs->capacity[i]);
+}
+
+// Whether s has deltas to print, looked at without the lock
+bool feed_waiting(const struct feed_subscriber *s)
+{
+  return s != NULL && __atomic_load_n(&s->head, __ATOMIC_RELAXED) !=
+                          __atomic_load_n(&s->tail, __ATOMIC_RELAXED);
+}
+
+// Copy up to max of s's oldest deltas out of its ring; how many
+int feed_take(struct feed_subscriber *s, struct feed_delta *deltas, int max)
+{
+  pthread_mutex_lock(&feed.lock);
+  int n = s->head - s->tail < (uint64_t)max ? (int)(s->head - s->tail) : max;
+  for (int k = 0; k < n; k++)
+    deltas[k] = s->ring[(s->tail + k) % FEED_RING_RECORDS];
+  __atomic_store_n(&s->tail, s->tail + n, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&feed.lock);
+  return n;
+}
+
+/******************************************************************
+ * Waitlists                                                      *
+ * Everything here runs with the flight's stripe held and, apart  *
+ * from waitlist_forget, with waitlist.lock held as well.          *
+ *****************************************************************/
+static struct waiter *waiter_at(int slot)
+{
+  return &waitlist.slabs[slot / WAITLIST_SLAB][slot % WAITLIST_SLAB];
+}
+
+static int waiter_ticket(int slot)
+{
+  return (int)((waiter_at(slot)->gen & 0x7f) << 24) | slot;
+}
+
+// A free slot, or 0 when there is no room for another waiter
+static int waiter_alloc(void)
+{
+  int slot = waitlist.free;
+
+  if (slot != 0)
+  {
+    waitlist.free = waiter_at(slot)->next;
+    return slot;
+  }
+  if (waitlist.used == WAITLIST_SLAB * WAITLIST_SLABS)
+    return 0;
+  slot = waitlist.used;
+  struct waiter **slab = &waitlist.slabs[slot / WAITLIST_SLAB];
+  if (*slab == NULL &&
+      (*slab = calloc(WAITLIST_SLAB, sizeof(struct waiter))) == NULL)
+    return 0;
+  waitlist.used++;
+  return slot;
+}
+
+// The slot of city's waiter with ticket, or 0
+static int waiter_find(int ticket, city_id_t city)
+{
+  int slot = ticket & ((1 << 24) - 1);
+
+  if (ticket <= 0 || slot >= waitlist.used)
+    return 0;
+  struct waiter *w = waiter_at(slot);
+  if (w->city != city || waiter_ticket(slot) != ticket)
+    return 0;
+  return slot;
+}
+
+// Put a new waiter at the back of flight i's line; its slot, or 0 when
+// there is no room for it
+static int waitlist_add(struct flight_schedule *fs, int i,
+                        struct server_client *client)
+{
+  int slot = waiter_alloc();
+  if (slot == 0)
+    return 0;
+
+  struct waiter *w = waiter_at(slot);
+  int first = fs->waitlists[i];
+  w->city = fs->destination;
+  w->time = fs->times[i];
+  w->client = client;
+  if (first == 0)
+  {
+    w->next = w->prev = slot;
+    // a seat given back from here on finds the waiter (see
+    // flight_schedule_free_seats_at)
+    __atomic_store_n(&fs->waitlists[i], slot, __ATOMIC_SEQ_CST);
+  }
+  else
+  {
+    struct waiter *f = waiter_at(first);
+    w->next = first;
+    w->prev = f->prev;
+    waiter_at(f->prev)->next = slot;
+    f->prev = slot;
+  }
+  w->client_prev = 0;
+  w->client_next = 0;
+  if (client != NULL)
+  {
+    w->client_next = client->waiters;
+    if (client->waiters != 0)
+      waiter_at(client->waiters)->client_prev = slot;
+    client->waiters = slot;
+  }
+  return slot;
+}
+
+// Take waiter slot out of the line it is in, which is flight i's if it is
+// the first in it, and free the slot
+static void waitlist_remove(struct flight_schedule *fs, int i, int slot)
+{
+  struct waiter *w = waiter_at(slot);
+
+  // stored atomically for flight_schedule_free_seats_at's look
+  if (w->next == slot)
+  {
+    __atomic_store_n(&fs->waitlists[i], 0, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    waiter_at(w->prev)->next = w->next;
+    waiter_at(w->next)->prev = w->prev;
+    if (fs->waitlists[i] == slot)
+      __atomic_store_n(&fs->waitlists[i], w->next, __ATOMIC_RELAXED);
+  }
+  if (w->client != NULL)
+  {
+    if (w->client_prev != 0)
+      waiter_at(w->client_prev)->client_next = w->client_next;
+    else
+      w->client->waiters = w->client_next;
+    if (w->client_next != 0)
+      waiter_at(w->client_next)->client_prev = w->client_prev;
+  }
+  w->city = CITY_NONE;
+  w->client = NULL;
+  w->gen++;
+  w->next = waitlist.free;
+  waitlist.free = slot;
+}
+
+// Note what became of waiter slot for msg_waitlist_notices
+static void waitlist_notice(int slot, bool seated)
+{
+  struct waitlist_notices *n = &waitlist_notices;
+  struct waiter *w = waiter_at(slot);
+
+  if (n->count == n->size)
+  {
+    int size = n->size > 0 ? 2 * n->size : WAITLIST_NOTICES_MIN;
+    struct waitlist_notice *items = realloc(n->items, size * sizeof(*items));
+    if (items == NULL)
+    {
+      output_flush();
+      printf("ERROR: Out of memory telling a waiter.\n");
+      exit(EXIT_FAILURE);
+    }
+    n->items = items;
+    n->size = size;
+  }
+  n->items[n->count++] = (struct waitlist_notice){waiter_ticket(slot), w->city,
+                                                  w->time, seated, w->client};
+}
+
+// Hand up to n of flight i's free seats to its waiters, oldest first.
+// Each is journaled as the s that books it, after the record that gave
+// the seat back, so a replay ends up with the same seats taken.
+void waitlist_seat(struct flight_schedule *fs, int i, int n, bool logging)
+{
+  int slot, left;
+
+  while (n-- > 0 && (slot = fs->waitlists[i]) != 0 &&
+         flight_schedule_take_seats(fs, i, 1, &left))
+  {
+    replica_seat(fs, i, -1);
+    feed_seats('s', fs, i, left);
+    if (logging)
+      journal_record('s', fs->destination, fs->times[i], 1);
+    STATS_COUNT(waitlist_seated);
+    waitlist_notice(slot, true);
+    waitlist_remove(fs, i, slot);
+  }
+}
+
+// Empty flight i's line as the flight goes away.  The caller holds the
+// stripe for writing, so nothing else can join it meanwhile.
+void waitlist_drop(struct flight_schedule *fs, int i)
+{
+  if (fs->waitlists[i] == 0)
+    return;
+  pthread_mutex_lock(&waitlist.lock);
+  while (fs->waitlists[i] != 0)
+  {
+    waitlist_notice(fs->waitlists[i], false);
+    waitlist_remove(fs, i, fs->waitlists[i]);
+  }
+  pthread_mutex_unlock(&waitlist.lock);
+}
+
+// A server client is going: take its waiters out of line.  Runs on the
+// server thread, which is the only one that adds them.
+void waitlist_forget(struct server_client *c)
+{
+  while (c->waiters != 0)
+  {
+    pthread_mutex_lock(&waitlist.lock);
+    int ticket = waiter_ticket(c->waiters);
+    city_id_t city = waiter_at(c->waiters)->city;
+    pthread_mutex_unlock(&waitlist.lock);
+    if (booking_cancel(city, ticket) != BOOKING_OK)
+      break; // cannot happen: a waiter's flight outlives it
+  }
+}
+
+/******************************************************************
+* Initializes the schedule pool that will hold any flight         *
+* schedules created by the user. This is called in main for you.  *
+* n schedules are reserved up front; more are mapped on demand.   *
+ *****************************************************************/
+void flight_schedule_initialize(long n, bool huge_pages)
+{
+  flight_schedules_active = NULL;
+  flight_schedules_free = NULL;
+  flight_schedules_pool.huge_pages = huge_pages;
+  flight_seek_select();
+  for (int i = 0; i < LOCK_STRIPES; i++)
+  {
+    pthread_rwlock_init(&flight_schedule_stripes[i], NULL);
+    pthread_mutex_init(&journal_stripes[i], NULL);
+  }
+
+  if (!flight_schedule_pool_reserve(n))
+  {
+    printf("ERROR: Could not allocate %ld schedules.\n", n);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/******************************************************************
+ * City table                                                     *
+ * The name lookup is kept at most 3/4 full and doubles when it   *
+ * would pass that.  Pages of entries are allocated as ids reach  *
+ * them.                                                          *
+ *****************************************************************/
+#define CITY_MIN_SLOTS 64
+
+// FNV-1a over the characters of the city name
+unsigned int city_hash(const char *city)
+{
+  unsigned int h = 2166136261u;
+  while (*city)
+  {
+    h ^= (unsigned char)*city++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+struct city_entry *city_entry(city_id_t city)
+{
+  if (city == CITY_NONE)
+    return &city_missing;
+  return &city_table.pages[city / CITY_PAGE_SIZE][city % CITY_PAGE_SIZE];
+}
+
+char *city_name(city_id_t city)
+{
+  return city_entry(city)->name;
+}
+
+static void city_table_place(struct city_table *t, unsigned int hash,
+                             city_id_t id)
+{
+  size_t i = hash & t->mask;
+  while (t->slots[i].id != CITY_NONE)
+    i = (i + 1) & t->mask;
+  t->slots[i].hash = hash;
+  t->slots[i].id = id;
+}
+
+static void city_table_grow(void)
+{
+  struct city_table *t = &city_table;
+  size_t old_size = t->slots ? t->mask + 1 : 0;
+  size_t new_size = old_size ? old_size * 2 : CITY_MIN_SLOTS;
+  struct city_slot *old = t->slots;
+
+  t->slots = malloc(new_size * sizeof(*t->slots));
+  if (t->slots == NULL)
+  {
+    output_flush();
+    printf("ERROR: Out of memory growing the city table.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (size_t i = 0; i < new_size; i++)
+    t->slots[i].id = CITY_NONE;
+  t->mask = new_size - 1;
+
+  for (size_t i = 0; i < old_size; i++)
+  {
+    if (old[i].id != CITY_NONE)
+      city_table_place(t, old[i].hash, old[i].id);
+  }
+  free(old);
+}
+
+// Id of the city name in the table, or CITY_NONE.  Called with the
+// table's lock held.
+static city_id_t city_table_find(const char *city, unsigned int hash)
+{
+  struct city_table *t = &city_table;
+  size_t probes = 1;
+  city_id_t id = CITY_NONE;
+
+  if (t->slots != NULL)
+  {
+    for (size_t i = hash & t->mask; (id = t->slots[i].id) != CITY_NONE;
+         i = (i + 1) & t->mask, probes++)
+    {
+      if (t->slots[i].hash == hash && strcmp(city_name(id), city) == 0)
+        break;
+    }
+  }
+  STATS_RECORD(find_probes, probes);
+  return id;
+}
+
+// Id of the city name, or CITY_NONE, whose entry then holds the name, if
+// it is not in the table
+city_id_t city_find(const char *city)
+{
+  struct city_table *t = &city_table;
+
+  pthread_mutex_lock(&t->lock);
+  city_id_t id = city_table_find(city, city_hash(city));
+  pthread_mutex_unlock(&t->lock);
+  if (id == CITY_NONE)
+    strcpy(city_missing.name, city);
+  return id;
+}
+
+// Id of the city name, adding it to the table if it is new
+city_id_t city_intern(const char *city)
+{
+  struct city_table *t = &city_table;
+  unsigned int hash = city_hash(city);
+  city_id_t id;
+
+  pthread_mutex_lock(&t->lock);
+  if ((id = city_table_find(city, hash)) != CITY_NONE)
+  {
+    pthread_mutex_unlock(&t->lock);
+    return id;
+  }
+
+  id = t->count;
+  if (id % CITY_PAGE_SIZE == 0)
+  {
+    if (id / CITY_PAGE_SIZE == CITY_PAGES)
+    {
+      output_flush();
+      printf("ERROR: Too many city names.\n");
+      exit(EXIT_FAILURE);
+    }
+    t->pages[id / CITY_PAGE_SIZE] =
+        calloc(CITY_PAGE_SIZE, sizeof(struct city_entry));
+    if (t->pages[id / CITY_PAGE_SIZE] == NULL)
+    {
+      output_flush();
+      printf("ERROR: Out of memory growing the city table.\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  strcpy(city_name(id), city);
+  if (t->slots == NULL || ((size_t)id + 1) * 4 > (t->mask + 1) * 3)
+    city_table_grow();
+  city_table_place(t, hash, id);
+  t->count++;
+  pthread_mutex_unlock(&t->lock);
+  return id;
+}
+
+/******************************************************************
+ * City tree                                                      *
+ * A node is split in two when a name or child is added to it    *
+ * while full, and merged with a neighbour when it falls below a  *
+ * quarter full and the two fit in one node.  Every operation is  *
+ * one walk from the root plus, for listings, a scan along the    *
+ * leaves, so it costs O(log n + k) for k names listed.           *
+ *****************************************************************/
+
+// The first 8 bytes of a name, zero padded, as a number that sorts the
+// same way the names do
+static uint64_t city_tree_key(const char *name)
+{
+  uint64_t key = 0;
+  int i = 0;
+  for (; i < 8 && name[i] != '\0'; i++)
+    key = (key << 8) | (unsigned char)name[i];
+  return key << (8 * (8 - i)) % 64;
+}
+
+// strcmp of name i of n against name, whose key is key
+static int city_tree_compare(struct city_tree_node *n, int i, const char *name,
+                             uint64_t key)
+{
+  if (n->keys[i] != key)
+    return n->keys[i] < key ? -1 : 1;
+  return strcmp(n->names[i], name);
+}
+
+// Index of the first name in leaf n that is not before name
+static int city_tree_leaf_slot(struct city_tree_node *n, const char *name)
+{
+  uint64_t key = city_tree_key(name);
+  int lo = 0, hi = n->count;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (city_tree_compare(n, mid, name, key) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// Index of the child of inner node n that name belongs under
+static int city_tree_child_slot(struct city_tree_node *n, const char *name)
+{
+  uint64_t key = city_tree_key(name);
+  int lo = 1, hi = n->count;
+  while (lo < hi)
+  {
+    int mid = lo + (hi - lo) / 2;
+    if (city_tree_compare(n, mid, name, key) <= 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo - 1;
+}
+
+// Cities below a node
+static uint32_t city_tree_size(struct city_tree_node *n, bool leaf)
+{
+  if (leaf)
+    return n->count;
+  uint32_t size = 0;
+  for (int i = 0; i < n->count; i++)
+    size += n->sizes[i];
+  return size;
+}
+
+// Put name (and for an inner node, child with size cities) at index i of
+// n.  A full node is split first; the new right half is returned.  Nodes
+// come from the spare list, which city_tree_insert has filled.
+static struct city_tree_node *city_tree_put(struct city_tree_node *n, int i,
+                                            const char *name,
+                                            struct city_tree_node *child,
+                                            uint32_t size, bool leaf)
+{
+  struct city_tree_node *right = NULL;
+
+  if (n->count == CITY_TREE_FANOUT)
+  {
+    int half = CITY_TREE_FANOUT / 2;
+    right = city_tree.spare;
+    city_tree.spare = right->next;
+    city_tree.spares--;
+
+    right->count = CITY_TREE_FANOUT - half;
+    memcpy(right->names, n->names + half, right->count * sizeof(city_t));
+    memcpy(right->keys, n->keys + half, right->count * sizeof(uint64_t));
+    if (leaf)
+    {
+      right->prev = n;
+      right->next = n->next;
+      if (n->next != NULL)
+        n->next->prev = right;
+      n->next = right;
+    }
+    else
+    {
+      memcpy(right->children, n->children + half,
+             right->count * sizeof(n->children[0]));
+      memcpy(right->sizes, n->sizes + half, right->count * sizeof(uint32_t));
+    }
+    n->count = half;
+    if (i > half)
+    {
+      n = right;
+      i -= half;
+    }
+  }
+
+  int move = n->count - i;
+  memmove(n->names + i + 1, n->names + i, move * sizeof(city_t));
+  memmove(n->keys + i + 1, n->keys + i, move * sizeof(uint64_t));
+  strcpy(n->names[i], name);
+  n->keys[i] = city_tree_key(name);
+  if (!leaf)
+  {
+    memmove(n->children + i + 1, n->children + i, move * sizeof(n->children[0]));
+    memmove(n->sizes + i + 1, n->sizes + i, move * sizeof(uint32_t));
+    n->children[i] = child;
+    n->sizes[i] = size;
+  }
+  n->count++;
+  return right;
+}
+
+// Add name below n, height levels above the leaves; returns the new right
+// half if n was split
+static struct city_tree_node *city_tree_insert_at(struct city_tree_node *n,
+                                                  int height, const char *name)
+{
+  if (height == 0)
+    return city_tree_put(n, city_tree_leaf_slot(n, name), name, NULL, 0, true);
+
+  int c = city_tree_child_slot(n, name);
+  n->sizes[c]++;
+  struct city_tree_node *right =
+      city_tree_insert_at(n->children[c], height - 1, name);
+  if (right == NULL)
+    return NULL;
+
+  uint32_t moved = city_tree_size(right, height == 1);
+  n->sizes[c] -= moved;
+  return city_tree_put(n, c + 1, right->names[0], right, moved, false);
+}
+
+// Add a city; false only when out of memory, in which case nothing changed
+bool city_tree_insert(const char *name)
+{
+  struct city_tree *t = &city_tree;
+
+  // a split can reach the root and then needs a new root as well
+  while (t->spares < t->height + 2)
+  {
+    struct city_tree_node *n = malloc(sizeof(*n));
+    if (n == NULL)
+      return false;
+    n->next = t->spare;
+    t->spare = n;
+    t->spares++;
+  }
+
+  if (t->root == NULL)
+  {
+    t->root = t->spare;
+    t->spare = t->root->next;
+    t->spares--;
+    t->root->count = 0;
+    t->root->prev = t->root->next = NULL;
+  }
+
+  struct city_tree_node *right = city_tree_insert_at(t->root, t->height, name);
+  if (right != NULL)
+  {
+    struct city_tree_node *root = t->spare;
+    t->spare = root->next;
+    t->spares--;
+    uint32_t moved = city_tree_size(right, t->height == 0);
+    root->count = 2;
+    root->children[0] = t->root;
+    root->sizes[0] = t->count + 1 - moved;
+    root->children[1] = right;
+    root->sizes[1] = moved;
+    strcpy(root->names[1], right->names[0]);
+    root->keys[1] = right->keys[0];
+    t->root = root;
+    t->height++;
+  }
+  t->count++;
+  return true;
+}
+
+// Merge child c of n with a neighbour if it has become small and the two
+// fit in one node
+static void city_tree_rebalance(struct city_tree_node *n, int c, bool leaf)
+{
+  if (n->children[c]->count >= CITY_TREE_FANOUT / 4 || n->count < 2)
+    return;
+
+  int l = c + 1 < n->count ? c : c - 1; // merge children l and l + 1
+  struct city_tree_node *a = n->children[l];
+  struct city_tree_node *b = n->children[l + 1];
+  if (a->count + b->count > CITY_TREE_FANOUT)
+    return;
+
+  if (leaf)
+  {
+    a->next = b->next;
+    if (b->next != NULL)
+      b->next->prev = a;
+  }
+  else
+  {
+    // b's first child is bounded below by b's separator in n
+    strcpy(b->names[0], n->names[l + 1]);
+    b->keys[0] = n->keys[l + 1];
+    memcpy(a->children + a->count, b->children,
+           b->count * sizeof(b->children[0]));
+    memcpy(a->sizes + a->count, b->sizes, b->count * sizeof(uint32_t));
+  }
+  memcpy(a->names + a->count, b->names, b->count * sizeof(city_t));
+  memcpy(a->keys + a->count, b->keys, b->count * sizeof(uint64_t));
+  a->count += b->count;
+  n->sizes[l] += n->sizes[l + 1];
+  free(b);
+
+  int move = n->count - (l + 2);
+  memmove(n->names + l + 1, n->names + l + 2, move * sizeof(city_t));
+  memmove(n->keys + l + 1, n->keys + l + 2, move * sizeof(uint64_t));
+  memmove(n->children + l + 1, n->children + l + 2,
+          move * sizeof(n->children[0]));
+  memmove(n->sizes + l + 1, n->sizes + l + 2, move * sizeof(uint32_t));
+  n->count--;
+}
+
+// Remove name from below n; false if it is not there
+static bool city_tree_remove_at(struct city_tree_node *n, int height,
+                                const char *name)
+{
+  if (height == 0)
+  {
+    int i = city_tree_leaf_slot(n, name);
+    if (i == n->count || strcmp(n->names[i], name) != 0)
+      return false;
+    memmove(n->names + i, n->names + i + 1, (n->count - i - 1) * sizeof(city_t));
+    memmove(n->keys + i, n->keys + i + 1, (n->count - i - 1) * sizeof(uint64_t));
+    n->count--;
+    return true;
+  }
+
+  int c = city_tree_child_slot(n, name);
+  if (!city_tree_remove_at(n->children[c], height - 1, name))
+    return false;
+  n->sizes[c]--;
+  city_tree_rebalance(n, c, height == 1);
+  return true;
+}
+
+void city_tree_remove(const char *name)
+{
+  struct city_tree *t = &city_tree;
+
+  if (t->root == NULL || !city_tree_remove_at(t->root, t->height, name))
+    return;
+  t->count--;
+
+  // an inner root left with one child is not needed
+  while (t->height > 0 && t->root->count == 1)
+  {
+    struct city_tree_node *old = t->root;
+    t->root = old->children[0];
+    t->height--;
+    free(old);
+  }
+}
+
+// Print up to count names from index i of leaf n onwards, only those that
+// start with the first len characters of prefix
+static void city_tree_scan(struct city_tree_node *n, int i, uint32_t count,
+                           const char *prefix, size_t len)
+{
+  for (; n != NULL && count > 0; n = n->next, i = 0)
+  {
+    for (; i < n->count && count > 0; i++, count--)
+    {
+      if (strncmp(n->names[i], prefix, len) != 0)
+        return;
+      output_str(n->names[i]);
+      output_char('\n');
+    }
+  }
+}
+
+// Print count names in alphabetical order starting with the skip'th
+void city_tree_list(uint32_t skip, uint32_t count)
+{
+  struct city_tree_node *n = city_tree.root;
+
+  if (n == NULL || skip >= city_tree.count)
+    return;
+  for (int h = city_tree.height; h > 0; h--)
+  {
+    int c = 0;
+    while (skip >= n->sizes[c])
+      skip -= n->sizes[c++];
+    n = n->children[c];
+  }
+  city_tree_scan(n, skip, count, "", 0);
+}
+
+// Print every name starting with prefix in alphabetical order
+void city_tree_list_prefix(const char *prefix)
+{
+  struct city_tree_node *n = city_tree.root;
+
+  if (n == NULL)
+    return;
+  for (int h = city_tree.height; h > 0; h--)
+    n = n->children[city_tree_child_slot(n, prefix)];
+  city_tree_scan(n, city_tree_leaf_slot(n, prefix), UINT32_MAX, prefix,
+                 strlen(prefix));
+}
+
+/******************************************************************
+ * Time index                                                     *
+ * A bucket grows by doubling and a flight leaving it is replaced *
+ * by the bucket's last flight, so filing and unfiling are O(1)   *
+ * apart from finding the moved flight's schedule entry again.    *
+ * A search for the next flight with a seat looks at the rest of  *
+ * the first hour minute by minute, the rest of that day hour by  *
+ * hour and then whole days, so it looks at no more than about    *
+ * 170 counts plus the days of the calendar.                      *
+ *****************************************************************/
+
+// Make the wheel for a calendar of days days starting on day 0
+void time_index_initialize(int days)
+{
+  time_index.first = 0;
+  time_index.minutes = days * MINUTES_PER_DAY;
+  time_index.buckets = calloc(time_index.minutes, sizeof(struct time_bucket));
+  time_index.hour_open = calloc(days * 24, sizeof(int));
+  time_index.day_open = calloc(days, sizeof(int));
+  if (time_index.buckets == NULL || time_index.hour_open == NULL ||
+      time_index.day_open == NULL)
+  {
+    printf("ERROR: Could not allocate a calendar of %d days.\n", days);
+    exit(EXIT_FAILURE);
+  }
+  calendar.days = days;
+  calendar.first_day = 0;
+}
+
+// First and last minute a time may be, as the parser sees the calendar
+int calendar_first(void)
+{
+  return calendar.first_day * MINUTES_PER_DAY;
+}
+
+int calendar_last(void)
+{
+  return (calendar.first_day + calendar.days) * MINUTES_PER_DAY - 1;
+}
+
+static struct time_bucket *time_index_bucket(int t)
+{
+  return &time_index.buckets[t % time_index.minutes];
+}
+
+// Count a flight departing at t gaining (delta 1) or losing (-1) its
+// last seat in the bucket, hour and day totals
+static void time_index_count_open(int t, int delta)
+{
+  int m = t % time_index.minutes;
+
+  __atomic_fetch_add(&time_index.buckets[m].open_count, delta,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&time_index.hour_open[m / 60], delta, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&time_index.day_open[m / MINUTES_PER_DAY], delta,
+                     __ATOMIC_RELAXED);
+}
+
+// The same for a flight with a seat being filed or unfiled, which happens
+// under time_index.lock for writing, so no other thread counts at once
+static void time_index_count_filed(int t, int delta)
+{
+  int m = t % time_index.minutes;
+
+  time_index.buckets[m].open_count += delta;
+  time_index.hour_open[m / 60] += delta;
+  time_index.day_open[m / MINUTES_PER_DAY] += delta;
+}
+
+// File flight i of fs under its departure time, in a hole if the bucket
+// has one; false if out of memory
+bool time_index_add(struct flight_schedule *fs, int i)
+{
+  struct time_bucket *b = time_index_bucket(fs->times[i]);
+
+  if (b->hole_count == 0 && b->count == b->slots)
+  {
+    int slots = b->slots == 0 ? TIME_BUCKET_MIN_SLOTS : 2 * b->slots;
+    city_id_t *cities = realloc(b->cities, slots * sizeof(city_id_t));
+    if (cities == NULL)
+      return false;
+    b->cities = cities;
+    int *holes = realloc(b->holes, slots * sizeof(int));
+    if (holes == NULL)
+      return false;
+    b->holes = holes;
+    size_t old_words = (b->slots + 63) / 64, words = (slots + 63) / 64;
+    uint64_t *open = realloc(b->open, words * sizeof(uint64_t));
+    if (open == NULL)
+      return false;
+    memset(open + old_words, 0, (words - old_words) * sizeof(uint64_t));
+    b->open = open;
+    b->slots = slots;
+  }
+
+  int e = b->hole_count > 0 ? b->holes[--b->hole_count] : b->count++;
+  b->cities[e] = fs->destination;
+  if (fs->available[i] > 0)
+  {
+    b->open[e / 64] |= UINT64_C(1) << (e % 64);
+    time_index_count_filed(fs->times[i], 1);
+  }
+  fs->entries[i] = e;
+  return true;
+}
+
+// Unfile flight i of fs, leaving a hole in its bucket.  Nothing else in
+// the bucket moves, so no other schedule is touched.
+void time_index_remove(struct flight_schedule *fs, int i)
+{
+  struct time_bucket *b = time_index_bucket(fs->times[i]);
+  int e = fs->entries[i];
+
+  if (b->open[e / 64] & (UINT64_C(1) << (e % 64)))
+    time_index_count_filed(fs->times[i], -1);
+  b->open[e / 64] &= ~(UINT64_C(1) << (e % 64));
+  b->cities[e] = CITY_NONE;
+  if (e == b->count - 1)
+    b->count--; // the last entry needs no hole
+  else
+    b->holes[b->hole_count++] = e;
+}
+
+// Clear flight i's bit in the time index (open false) or set it (true),
+// keeping the counts in step with the bit.  The caller holds
+// time_index.lock for reading and has changed the seats already.
+void time_index_mark(struct flight_schedule *fs, int i, bool open)
+{
+  int e = fs->entries[i];
+  uint64_t bit = UINT64_C(1) << (e % 64);
+  uint64_t *word = &time_index_bucket(fs->times[i])->open[e / 64];
+
+  if (!open && (__atomic_fetch_and(word, ~bit, __ATOMIC_SEQ_CST) & bit))
+    time_index_count_open(fs->times[i], -1);
+  if (open && !(__atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST) & bit))
+    time_index_count_open(fs->times[i], 1);
+}
+
+// The first minute at or after from, up to the end of the calendar, with
+// a flight that has a seat, or -1.  The caller holds time_index.lock.
+int time_index_next_open(int from)
+{
+  int end = time_index.first + time_index.minutes;
+
+  for (int t = from < time_index.first ? time_index.first : from; t < end;)
+  {
+    int m = t % time_index.minutes;
+    if (m % MINUTES_PER_DAY == 0 &&
+        __atomic_load_n(&time_index.day_open[m / MINUTES_PER_DAY],
+                        __ATOMIC_RELAXED) == 0)
+      t += MINUTES_PER_DAY;
+    else if (m % 60 == 0 &&
+             __atomic_load_n(&time_index.hour_open[m / 60],
+                             __ATOMIC_RELAXED) == 0)
+      t += 60;
+    else if (__atomic_load_n(&time_index.buckets[m].open_count,
+                             __ATOMIC_RELAXED) == 0)
+      t++;
+    else
+      return t;
+  }
+  return -1;
+}
+
+// Index in fs of the flight filed as entry e of the bucket for time t
+static int time_index_flight(struct flight_schedule *fs, int t, int e)
+{
+  int i = flight_schedule_lower_bound(fs, t);
+  while (fs->entries[i] != e)
+    i++;
+  return i;
+}
+
+// Print every flight departing from from to to (inclusive) that has a
+// seat, in order of departure time.  The caller holds
+// flight_schedules_lock for reading.
+void time_index_list(int from, int to)
+{
+  pthread_rwlock_rdlock(&time_index.lock);
+  for (int t = time_index_next_open(from); t >= 0 && t <= to;
+       t = time_index_next_open(t + 1))
+  {
+    struct time_bucket *b = time_index_bucket(t);
+    for (int k = 0; k * 64 < b->count; k++)
+    {
+      uint64_t word = __atomic_load_n(&b->open[k], __ATOMIC_RELAXED);
+      while (word != 0)
+      {
+        int e = k * 64 + __builtin_ctzll(word);
+        word &= word - 1;
+
+        struct flight_schedule *fs = flight_schedule_find(b->cities[e]);
+        int i = time_index_flight(fs, t, e);
+        int avail = __atomic_load_n(&fs->available[i], __ATOMIC_RELAXED);
+        if (avail == 0) // sold out since the bit was read
+          continue;
+        output_str(city_name(fs->destination));
+        msg_flight_info(t, avail, fs->capacity[i]);
+        output_char('\n');
+      }
+    }
+  }
+  pthread_rwlock_unlock(&time_index.lock);
+}
+
+// Number of flights departing from from to to (inclusive) that have a
+// seat, added up from the counts of the whole days, hours and minutes
+// the window covers
+long time_index_count(int from, int to)
+{
+  long count = 0;
+
+  pthread_rwlock_rdlock(&time_index.lock);
+  for (int t = from; t <= to;)
+  {
+    int m = t % time_index.minutes;
+    if (m % MINUTES_PER_DAY == 0 && to - t >= MINUTES_PER_DAY - 1)
+    {
+      count += __atomic_load_n(&time_index.day_open[m / MINUTES_PER_DAY],
+                               __ATOMIC_RELAXED);
+      t += MINUTES_PER_DAY;
+    }
+    else if (m % 60 == 0 && to - t >= 59)
+    {
+      count += __atomic_load_n(&time_index.hour_open[m / 60],
+                               __ATOMIC_RELAXED);
+      t += 60;
+    }
+    else
+    {
+      count += __atomic_load_n(&time_index.buckets[m].open_count,
+                               __ATOMIC_RELAXED);
+      t++;
+    }
+  }
+  pthread_rwlock_unlock(&time_index.lock);
+  return count;
+}
+
+// Empty the buckets of the days before first, which D has retired, and
+// start the calendar at first.  Their flights have already been taken out
+// of their schedules.  The caller holds time_index.lock for writing.
+void time_index_retire(int first)
+{
+  int end = first - time_index.first < time_index.minutes
+                ? first
+                : time_index.first + time_index.minutes;
+
+  for (int t = time_index.first; t < end; t++)
+  {
+    struct time_bucket *b = time_index_bucket(t);
+    if (b->count == 0)
+      continue;
+    memset(b->open, 0, (b->count + 63) / 64 * sizeof(uint64_t));
+    b->count = 0;
+    b->open_count = 0;
+    b->hole_count = 0;
+  }
+  for (int t = time_index.first; t < end; t += MINUTES_PER_DAY)
+  {
+    int day = t % time_index.minutes / MINUTES_PER_DAY;
+    memset(&time_index.hour_open[day * 24], 0, 24 * sizeof(int));
+    time_index.day_open[day] = 0;
+  }
+  time_index.first = first;
+}
+
+/***********************************************************
+ * time_get: read a time from the user
+   Time in this program is a minute number counted from
+   midnight of day 0.  With the default calendar of one day
+   that is 0-((24*60)-1)=1439; -D n makes it n days long and
+   D moves it on, so valid times run from calendar_first()
+   to calendar_last().
+   -1 is used to indicate the NULL empty time 
+   This function should read in a time value and check its 
+   validity.  If it is not valid eg. not -1 or not in the
+   calendar it should print "Invalid Time" and return false.
+   othewise it should return the value in the integer pointed
+   to by time_ptr.
+ ***********************************************************/
+bool time_get(int *time_ptr)
+{
+  return msg_parse_error(time_read(time_ptr));
+}
+
+// Read a time as time_get does, returning what was wrong with it rather
+// than printing it
+int time_read(int *time_ptr)
+{
+  if (input_int(time_ptr))
+  {
+    return (TIME_NULL == *time_ptr ||
+            (*time_ptr >= calendar_first() && *time_ptr <= calendar_last()))
+               ? PARSE_OK
+               : PARSE_QUIET;
+  }
+  return PARSE_TIME_BAD;
+}
+
+/***********************************************************
+ * flight_capacity_get: read the capacity of a flight from the user
+   This function should read in a capacity value and check its 
+   validity.  If it is not greater than 0, it should print 
+   "Invalid capacity value" and return false. Othewise it should 
+   return the value in the integer pointed to by cap_ptr.
+ ***********************************************************/
+bool flight_capacity_get(int *cap_ptr)
+{
+  return msg_parse_error(flight_capacity_read(cap_ptr));
+}
+
+int flight_capacity_read(int *cap_ptr)
+{
+  if (input_int(cap_ptr))
+  {
+    return *cap_ptr > 0 ? PARSE_OK : PARSE_QUIET;
+  }
+  return PARSE_CAPACITY_BAD;
+}
+
+// The two numbers of P
+int page_read(int *from, int *count)
+{
+  if (!input_int(from) || !input_int(count) || *from < 0 || *count < 0)
+  {
+    return PARSE_PAGE_BAD;
+  }
+  return PARSE_OK;
+}
+
+/***********************************************************
+ * seats_get: read the number of seats b or f moves at once.
+   It must be greater than 0; it is checked just as a
+   capacity is by flight_capacity_get.
+ ***********************************************************/
+bool seats_get(int *seats_ptr)
+{
+  return msg_parse_error(seats_read(seats_ptr));
+}
+
+int seats_read(int *seats_ptr)
+{
+  if (input_int(seats_ptr))
+  {
+    return *seats_ptr > 0 ? PARSE_OK : PARSE_QUIET;
+  }
+  return PARSE_SEATS_BAD;
+}
+
+// The count of a B and then its tuples, each a city name line and a line
+// with the time and the seats, into *tuples, which has room for *size and
+// is grown to fit.  Each tuple is exactly two lines: the time and seats
+// are parsed from a copy of the second line, so one that is missing
+// something cannot reach into the next tuple, and the command after the
+// batch is read from the right place.  A tuple cut short by the end of
+// the input is left out.
+int batch_read(struct batch_tuple **tuples, int *size, int *count)
+{
+  int n;
+
+  if (!input_int(&n) || n < 0 || n > BATCH_TUPLES_MAX)
+  {
+    return PARSE_BATCH_BAD;
+  }
+  if (n > *size)
+  {
+    int grow = n < BATCH_TUPLES_MIN ? BATCH_TUPLES_MIN : n;
+    struct batch_tuple *p = realloc(*tuples, grow * sizeof(struct batch_tuple));
+    if (p == NULL)
+    {
+      output_flush();
+      printf("ERROR: Out of memory reading a batch.\n");
+      exit(EXIT_FAILURE);
+    }
+    *tuples = p;
+    *size = grow;
+  }
+
+  for (*count = 0; *count < n; (*count)++)
+  {
+    struct batch_tuple *t = &(*tuples)[*count];
+    char line[BATCH_LINE_MAX];
+
+    if (city_read_name(t->name) == 0)
+    {
+      break; // the input ended
+    }
+    t->city = city_find(t->name);
+    t->error = PARSE_OK;
+    t->shard = 0;
+    t->status = BOOKING_OK;
+    const char *p = line, *end = line + input_line(line, sizeof(line));
+    if (!text_int(&p, end, &t->time) ||
+        (t->time != TIME_NULL &&
+         (t->time < calendar_first() || t->time > calendar_last())))
+    {
+      t->error = PARSE_TIME_BAD;
+    }
+    else if (!text_int(&p, end, &t->seats) || t->seats == 0)
+    {
+      t->error = PARSE_SEATS_BAD;
+    }
+  }
+  return PARSE_OK;
+}
+
+// A waitlist ticket for c; whether it names a waiter is up to the cancel
+int ticket_read(int *ticket_ptr)
+{
+  return input_int(ticket_ptr) ? PARSE_OK : PARSE_TICKET_BAD;
+}
+
+// The two ends of a time window for w and W
+int window_read(int *from, int *to)
+{
+  int error = time_read(from);
+
+  if (error != PARSE_OK)
+  {
+    return error;
+  }
+  if (*from == TIME_NULL)
+  { // no flight leaves at the null time
+    *from = calendar_first();
+  }
+  return time_read(to);
+}
+
+/***********************************************************
+ * days_read: read how many days D rolls the calendar on.
+   Zero only asks for the range, and there may be few
+   enough that every time stays a 32 bit number.
+ ***********************************************************/
+int days_read(int *days_ptr)
+{
+  if (!input_int(days_ptr) || *days_ptr < 0 ||
+      *days_ptr > CALENDAR_DAY_LIMIT - calendar.first_day - calendar.days)
+  {
+    return PARSE_DAYS_BAD;
+  }
+  return PARSE_OK;
+}
+
+struct flight_schedule *flight_schedule_find(city_id_t city){//active only
+
+  return city_entry(city)->schedule; //NULL unless the city has an active schedule
+}
+
+struct flight_schedule *flight_schedule_allocate(void){
+  struct flight_schedule_pool *pool = &flight_schedules_pool;
+  struct flight_schedule *fltptr = flight_schedules_free; //pointer to first element of free list
+
+  if(fltptr != NULL){//reuse a schedule that was freed earlier
+    flight_schedules_free = fltptr->next;
+    if(flight_schedules_free){
+      flight_schedules_free->prev = NULL; //breaks the pointer off the list
+    }
+  }else{//take a never used schedule, mapping another slab if we have to
+    if(pool->bump_left == 0){
+      size_t grow = pool->total < SCHEDULE_SLAB_MIN ? SCHEDULE_SLAB_MIN : pool->total;
+      if(!flight_schedule_pool_reserve(grow)){//out of memory
+        return NULL;
+      }
+    }
+    fltptr = pool->bump++;
+    pool->bump_left--;
+    flight_schedule_reset(fltptr);
+  }
+
+  fltptr->stamp = ++pool->stamps; //so the time index can tell which is nearer the front
+  fltptr->prev = NULL;
+  fltptr->next = flight_schedules_active; // fully attaches it to the front of the list
+  if(flight_schedules_active){
+    flight_schedules_active->prev = fltptr;
+  }
+  flight_schedules_active = fltptr;
+  return fltptr;
+}
+
+void flight_schedule_free(struct flight_schedule *fs){
+
+  int i;
+  for(i = 0; i < fs->flight_count; i++){//nobody waits for a flight that is gone
+    waitlist_drop(fs, i);
+  }
+  pthread_rwlock_wrlock(&time_index.lock);
+  for(i = fs->flight_count - 1; i >= 0; i--){//unfile the flights
+    time_index_remove(fs, i);
+  }
+  pthread_rwlock_unlock(&time_index.lock);
+  city_entry(fs->destination)->schedule = NULL; //must happen while destination is still set
+  city_tree_remove(city_name(fs->destination));
+
+  if(fs->prev == NULL){//this means fs is at the front
+    flight_schedules_active = fs->next;
+  }else{
+    fs->prev->next = fs->next;
+  }
+  if(fs->next != NULL){//fs is not at the end
+    fs->next->prev = fs->prev;
+  }
+  flight_schedule_reset(fs);
+
+  /*now move fs to beginning of the free list*/
+  if(flight_schedules_free != NULL){
+    flight_schedules_free->prev = fs;
+  }
+  fs->next = flight_schedules_free;
+  flight_schedules_free = fs;
+}
+
+void flight_schedule_add(city_id_t city){ 
+
+  msg_booking_status(booking_add_schedule(city), city);
+}
+
+void flight_schedule_listAll(void){
+
+  flight_schedules_read_lock();
+  city_tree_list(0, UINT32_MAX); //the tree keeps them in alphabetical order
+  flight_schedules_unlock();
+
+  return;
+}
+
+void flight_schedule_list_prefix(void){
+  city_t prefix;
+
+  city_read_name(prefix); //a prefix is not a city, so it is not interned
+  flight_schedule_print_prefix(prefix);
+}
+
+void flight_schedule_print_prefix(const char *prefix){
+
+  flight_schedules_read_lock();
+  city_tree_list_prefix(prefix);
+  flight_schedules_unlock();
+}
+
+void flight_schedule_list_page(void){
+  int from, count;
+
+  if(!msg_parse_error(page_read(&from, &count))){
+    return;
+  }
+  flight_schedule_print_page(from, count);
+}
+
+void flight_schedule_print_page(int from, int count){
+
+  flight_schedules_read_lock();
+  city_tree_list(from, count);
+  flight_schedules_unlock();
+}
+
+void flight_schedule_list(city_id_t city){
+  flight_schedules_read_lock();
+  struct flight_schedule *city_found = flight_schedule_find(city); // tells whether city exists
+
+  if(city_found == NULL){//if the city does not exist
+    flight_schedules_unlock();
+    msg_city_bad(city_name(city));
+    return;
+  }
+
+  pthread_rwlock_t *lock = flight_schedule_lock(city_found, false);
+  msg_city_flights(city_name(city));
+  int i; //flights are already in time order
+  for(i = 0; i < city_found->flight_count; i++){
+    msg_flight_info(city_found->times[i],
+    __atomic_load_n(&city_found->available[i], __ATOMIC_RELAXED),
+    city_found->capacity[i]);
+  }
+  output_char('\n');
+  pthread_rwlock_unlock(lock);
+  flight_schedules_unlock();
+  return;
+}
+
+void flight_schedule_add_flight(city_id_t city){
+
+  if(!booking_has_schedule(city)){//only read the time if the city exists
+    msg_city_bad(city_name(city));
+    return;
+  }
+  int x; //variable to store our time
+  int y; //variable to store our capacity
+
+  if(!time_get(&x)){//makes sure time and capacity are valid
+    return;
+  }else if(!flight_capacity_get(&y)){
+    return;
+  }
+
+  msg_booking_status(booking_add_flight(city, x, y), city);
+}
+
+void flight_schedule_remove_flight(city_id_t city){
+
+  if(!booking_has_schedule(city)){
+    msg_city_bad(city_name(city));
+    return;
+  }
+  int x; //variable to store time input
+  
+  if(!time_get(&x)){
+    return;
+  }
+
+  msg_booking_status(booking_remove_flight(city, x), city);
+}
+
+void flight_schedule_schedule_seat(city_id_t city){
+
+  if(!booking_has_schedule(city)){//if the city does not exist
+    msg_city_bad(city_name(city));
+    return;
+  }
+  int x;
+  if(!time_get(&x)){
+    return;
+  }
+
+  msg_booking_status(booking_schedule_seat(city, x), city);
+}
+
+void flight_schedule_unschedule_seat(city_id_t city){
+
+  if(!booking_has_schedule(city)){//if the city does not exist
+    msg_city_bad(city_name(city));
+    return;
+  }
+  int x;
+  if(!time_get(&x)){
+    return;
+  }
+
+  msg_booking_status(booking_unschedule_seat(city, x), city);
+}
+
+void flight_schedule_book_seats(city_id_t city, bool book){
+
+  if(!booking_has_schedule(city)){//if the city does not exist
+    msg_city_bad(city_name(city));
+    return;
+  }
+  int x, n;
+  if(!time_get(&x) || !seats_get(&n)){
+    return;
+  }
+
+  msg_booking_status(book ? booking_book_seats(city, x, n)
+                          : booking_free_seats(city, x, n), city);
+}
+
+void flight_schedule_batch(void){
+
+  int count;
+  if(!msg_parse_error(batch_read(&batch.tuples, &batch.size, &count))){
+    return;
+  }
+  booking_batch(batch.tuples, count);
+  msg_batch(batch.tuples, count);
+}
+
+void flight_schedule_queue_seat(city_id_t city){
+
+  if(!booking_has_schedule(city)){//if the city does not exist
+    msg_city_bad(city_name(city));
+    return;
+  }
+  int x, ticket, departure;
+  if(!time_get(&x)){
+    return;
+  }
+  //in server mode the client hears when the seat comes, on its connection
+  struct server_client *client = server.listen_fd >= 0 ? output.client : NULL;
+  int status = booking_queue_seat(city, x, client, &ticket, &departure);
+  if(status == BOOKING_WAITLISTED){
+    msg_waitlisted(ticket, departure);
+  }else{
+    msg_booking_status(status, city);
+  }
+}
+
+void flight_schedule_cancel(city_id_t city){
+
+  if(!booking_has_schedule(city)){//if the city does not exist
+    msg_city_bad(city_name(city));
+    return;
+  }
+  int ticket;
+  if(!msg_parse_error(ticket_read(&ticket))){
+    return;
+  }
+
+  msg_booking_status(booking_cancel(city, ticket), city);
+}
+
+void flight_schedule_subscribe(city_id_t city, bool subscribe){
+
+  if(server.listen_fd < 0){//the session reading the commands
+    if(subscribe){
+      feed_subscribe(&feed.session, NULL, city, 0);
+    }else{
+      feed_unsubscribe(feed.session, city, NULL);
+    }
+  }else if(subscribe){//in server mode the client sending them
+    feed_subscribe(&output.client->feed, output.client, city, 0);
+  }else{
+    feed_unsubscribe(output.client->feed, city, NULL);
+  }
+}
+
+void flight_schedule_remove(city_id_t city){
+
+  msg_booking_status(booking_remove_schedule(city), city);
+}
+
+void flight_schedule_next_departure(void){
+  int x;
+  if(!time_get(&x)){
+    return;
+  }
+  city_id_t city; //destination of the flight found
+  int t, avail, cap;
+
+  if(booking_next_departure(x, &city, &t, &avail, &cap) != BOOKING_OK){
+    msg_flight_no_seats();
+    return;
+  }
+  msg_next_departure(city_name(city));
+  msg_flight_info(t, avail, cap);
+  output_char('\n');
+}
+
+void flight_schedule_list_window(void){
+  int from, to;
+
+  if(!msg_parse_error(window_read(&from, &to))){
+    return;
+  }
+  flight_schedule_print_window(from, to);
+}
+
+void flight_schedule_print_window(int from, int to){
+
+  msg_window_flights(from, to);
+  flight_schedules_read_lock(); //keeps every schedule found through the index alive
+  time_index_list(from, to); //an empty window when to comes before from
+  flight_schedules_unlock();
+}
+
+void flight_schedule_count_window(void){
+  int from, to;
+
+  if(!msg_parse_error(window_read(&from, &to))){
+    return;
+  }
+  flight_schedules_read_lock();
+  long count = time_index_count(from, to);
+  flight_schedules_unlock();
+  msg_window_count(from, to, count);
+}
+
+void flight_schedule_roll_forward(void){
+  int days, first, last;
+  long retired;
+
+  if(!msg_parse_error(days_read(&days))){
+    return;
+  }
+  calendar.first_day += days; //times are read in the new days from here on
+  booking_roll_forward(days, &retired, &first, &last);
+  msg_roll_forward(retired, first, last);
+}
+
+/******************************************************************
+ * Booking API                                                    *
+ * These functions may be called from any number of threads.      *
+ * Adding or removing a schedule takes flight_schedules_lock for  *
+ * writing; everything else takes it for reading, which keeps the *
+ * schedule alive, plus the lock stripe of the one schedule it    *
+ * touches.  So bookings on different cities run in parallel and  *
+ * only wait for each other when two cities share a stripe.        *
+ * Nothing here prints; the result is a booking_status that       *
+ * msg_booking_status turns into the command's message.           *
+ *****************************************************************/
+void flight_schedules_read_lock(void)
+{
+  pthread_rwlock_rdlock(&flight_schedules_lock);
+}
+
+void flight_schedules_write_lock(void)
+{
+  pthread_rwlock_wrlock(&flight_schedules_lock);
+}
+
+void flight_schedules_unlock(void)
+{
+  pthread_rwlock_unlock(&flight_schedules_lock);
+}
+
+// Which of the LOCK_STRIPES stripes fs belongs to
+static int flight_schedule_stripe(const struct flight_schedule *fs)
+{
+  return (uintptr_t)fs / sizeof(struct flight_schedule) % LOCK_STRIPES;
+}
+
+// Lock and return the stripe guarding fs's flights: exclusive to move
+// flights around, shared to read them or book seats
+pthread_rwlock_t *flight_schedule_lock(struct flight_schedule *fs,
+                                       bool exclusive)
+{
+  pthread_rwlock_t *lock = &flight_schedule_stripes[flight_schedule_stripe(fs)];
+  if (exclusive)
+    pthread_rwlock_wrlock(lock);
+  else
+    pthread_rwlock_rdlock(lock);
+  return lock;
+}
+
+void msg_booking_status(int status, city_id_t city)
+{
+  switch (status)
+  {
+  case BOOKING_NO_SCHEDULE:
+    msg_city_bad(city_name(city));
+    break;
+  case BOOKING_EXISTS:
+    msg_city_exists(city_name(city));
+    break;
+  case BOOKING_NO_FREE:
+    msg_schedule_no_free();
+    break;
+  case BOOKING_MAX_FLIGHTS:
+    msg_city_max_flights_reached(city_name(city));
+    break;
+  case BOOKING_BAD_TIME:
+    msg_flight_bad_time();
+    break;
+  case BOOKING_NO_SEATS:
+    msg_flight_no_seats();
+    break;
+  case BOOKING_ALL_EMPTY:
+    msg_flight_all_seats_empty();
+    break;
+  case BOOKING_TOO_FEW:
+    msg_flight_too_few_seats();
+    break;
+  case BOOKING_NO_TICKET:
+    msg_no_ticket(city_name(city));
+    break;
+  default: // BOOKING_OK, BOOKING_NOTHING, BOOKING_WAITLISTED
+    break;
+  }
+}
+
+bool booking_has_schedule(city_id_t city)
+{
+  flight_schedules_read_lock();
+  bool found = flight_schedule_find(city) != NULL;
+  flight_schedules_unlock();
+  return found;
+}
+
+int booking_add_schedule(city_id_t city)
+{
+  int status = BOOKING_OK;
+
+  flight_schedules_write_lock();
+  if(flight_schedule_find(city)){
+    status = BOOKING_EXISTS;
+  }else if(!city_tree_insert(city_name(city))){//no memory for the tree nodes
+    status = BOOKING_NO_FREE;
+  }else{
+    struct flight_schedule *to_add = flight_schedule_allocate();
+
+    if(to_add == NULL){//if we cannot add any more flights
+      city_tree_remove(city_name(city));
+      status = BOOKING_NO_FREE;
+    }else{
+      to_add->destination = city;
+      city_entry(city)->schedule = to_add;
+      journal_append('A', city, 0, 0);
+      replica_schedule(city, true);
+      feed_emit('A', city, 0, 0, 0);
+    }
+  }
+  flight_schedules_unlock();
+  journal_commit_if_full();
+  STATS_COUNT(status[status]);
+  return status;
+}
+
+int booking_remove_schedule(city_id_t city)
+{
+  int status = BOOKING_OK;
+
+  flight_schedules_write_lock();
+  struct flight_schedule *to_remove = flight_schedule_find(city);
+  if(to_remove == NULL){//if the city does not exist
+    status = BOOKING_NO_SCHEDULE;
+  }else{
+    flight_schedule_free(to_remove);
+    journal_append('R', city, 0, 0);
+    replica_schedule(city, false);
+    feed_emit('R', city, 0, 0, 0);
+  }
+  flight_schedules_unlock();
+  journal_commit_if_full();
+  STATS_COUNT(status[status]);
+  return status;
+}
+
+// The *_at functions carry out a request on a schedule that has been found
+// and locked, with arguments that have already been validated.
+static int flight_schedule_add_flight_at(struct flight_schedule *fltptr, int x, int y){
+
+  if(x == TIME_NULL){//a flight at the null time is an empty slot, nothing to store
+    return BOOKING_NOTHING;
+  }
+
+  pthread_rwlock_wrlock(&time_index.lock);
+  int i = flight_schedule_insert_flight(fltptr, x, y);
+  pthread_rwlock_unlock(&time_index.lock);
+  if(i < 0){//if we couldn't make room
+    return BOOKING_MAX_FLIGHTS;
+  }
+
+  journal_append('a', fltptr->destination, x, y);
+  replica_publish(fltptr); //readers see the flights shifted all at once
+  feed_flight('a', fltptr, i);
+  return BOOKING_OK;
+}
+
+static int flight_schedule_remove_flight_at(struct flight_schedule *fltptr, int x){
+
+  if(x == TIME_NULL){//removing an empty slot does nothing
+    return BOOKING_NOTHING;
+  }
+
+  int i = flight_schedule_lower_bound(fltptr, x); //first flight with this time, if any
+  if(i < fltptr->flight_count && fltptr->times[i] == x){
+    waitlist_drop(fltptr, i);
+    int avail = fltptr->available[i], cap = fltptr->capacity[i]; //as it goes
+    pthread_rwlock_wrlock(&time_index.lock);
+    flight_schedule_delete_flight(fltptr, i);
+    pthread_rwlock_unlock(&time_index.lock);
+    journal_append('r', fltptr->destination, x, 0);
+    replica_publish(fltptr);
+    feed_emit('r', fltptr->destination, x, avail, cap);
+    return BOOKING_OK;
+  }
+  return BOOKING_BAD_TIME;
+}
+
+//n seats together on the first flight at or after *x that has them all;
+//*x becomes the time of the flight booked
+static int flight_schedule_book_seats_at(struct flight_schedule *fltptr, int *x, int n){
+
+  //first flight at or after the time that still has a seat; it may have
+  //too few, or another thread may take them first, so then try the next
+  int i = 0, left;
+  bool ordered = journal_begin(fltptr), logging = ordered && journal_logging();
+  while((i = flight_schedule_seek(fltptr, *x, i)) != -1){
+    if(flight_schedule_take_seats(fltptr, i, n, &left)){
+      replica_seat(fltptr, i, -n);
+      feed_seats('s', fltptr, i, left);
+      if(fltptr->times[i] > *x){//fell through to a later flight
+        STATS_COUNT(seat_later_flight);
+      }
+      *x = fltptr->times[i];
+      //log the flight actually booked so a replay picks the same one
+      if(logging){
+        journal_record(n == 1 ? 's' : 'b', fltptr->destination, *x, n);
+      }
+      journal_end(fltptr, ordered);
+      return BOOKING_OK;
+    }
+    STATS_COUNT(seat_retries);
+    i++;
+  }
+  journal_end(fltptr, ordered);
+  return BOOKING_NO_SEATS;
+}
+
+//n seats back to the flight at x, all of them or none
+static int flight_schedule_free_seats_at(struct flight_schedule *fltptr, int x, int n){
+
+  if(x == TIME_NULL){//an empty slot never has seats taken
+    return BOOKING_ALL_EMPTY;
+  }
+  int i = flight_schedule_lower_bound(fltptr, x); //first flight with this time, if any
+  if(i == fltptr->flight_count || fltptr->times[i] != x){
+    return BOOKING_BAD_TIME;
+  }
+  int left;
+  bool ordered = journal_begin(fltptr), logging = ordered && journal_logging();
+  if(!flight_schedule_give_seats(fltptr, i, n, &left)){//fewer than n seats are taken
+    journal_end(fltptr, ordered);
+    if(n > 1 && __atomic_load_n(&fltptr->available[i], __ATOMIC_RELAXED) < fltptr->capacity[i]){
+      return BOOKING_TOO_FEW;
+    }
+    return BOOKING_ALL_EMPTY;
+  }
+  replica_seat(fltptr, i, n);
+  feed_seats('u', fltptr, i, left);
+  if(logging){
+    journal_record(n == 1 ? 'u' : 'f', fltptr->destination, x, n);
+  }
+  //looked at without waitlist.lock: a waiter that joins after this look
+  //sees the seats given back (both sides are sequentially consistent)
+  if(__atomic_load_n(&fltptr->waitlists[i], __ATOMIC_SEQ_CST) != 0){
+    pthread_mutex_lock(&waitlist.lock);
+    waitlist_seat(fltptr, i, n, logging); //the seats go to whoever waits first
+    pthread_mutex_unlock(&waitlist.lock);
+  }
+  journal_end(fltptr, ordered);
+
+  return BOOKING_OK;
+}
+
+//a seat as s books it, or else a place in line for the first flight at or
+//after *x; *x becomes the time of the flight booked or waited for
+static int flight_schedule_queue_seat_at(struct flight_schedule *fltptr, int *x,
+                                         struct server_client *client, int *ticket){
+
+  int status = flight_schedule_book_seats_at(fltptr, x, 1);
+  if(status != BOOKING_NO_SEATS){
+    return status;
+  }
+  int i = flight_schedule_lower_bound(fltptr, *x);
+  if(i == fltptr->flight_count){//no flight to wait for
+    return BOOKING_NO_SEATS;
+  }
+  //taken before waitlist.lock, as u does
+  bool ordered = journal_begin(fltptr), logging = ordered && journal_logging();
+  pthread_mutex_lock(&waitlist.lock);
+  int slot = waitlist_add(fltptr, i, client);
+  if(slot != 0){
+    status = BOOKING_WAITLISTED;
+    *ticket = waiter_ticket(slot);
+    *x = fltptr->times[i];
+    //a seat given back since the search was not handed to anyone
+    if(__atomic_load_n(&fltptr->available[i], __ATOMIC_SEQ_CST) > 0){
+      waitlist_seat(fltptr, i, INT_MAX, logging);
+    }
+  }
+  pthread_mutex_unlock(&waitlist.lock);
+  journal_end(fltptr, ordered);
+  return status;
+}
+
+//take ticket out of line, wherever it is in it
+static int flight_schedule_cancel_at(struct flight_schedule *fltptr, int ticket, int unused){
+
+  (void)unused;
+  pthread_mutex_lock(&waitlist.lock);
+  int slot = waiter_find(ticket, fltptr->destination);
+  if(slot == 0){
+    pthread_mutex_unlock(&waitlist.lock);
+    return BOOKING_NO_TICKET;
+  }
+  int time = waiter_at(slot)->time;
+  int i = flight_schedule_lower_bound(fltptr, time);
+  //with flights at the same time, find the one whose line it heads, if any
+  while(fltptr->waitlists[i] != slot && i + 1 < fltptr->flight_count &&
+        fltptr->times[i + 1] == time){
+    i++;
+  }
+  waitlist_remove(fltptr, i, slot);
+  pthread_mutex_unlock(&waitlist.lock);
+  return BOOKING_OK;
+}
+
+// Find city's schedule, lock it and run fn on it
+static int booking_run(city_id_t city, int (*fn)(struct flight_schedule *, int, int),
+                       int time, int capacity, bool exclusive)
+{
+  int status = BOOKING_NO_SCHEDULE;
+
+  flight_schedules_read_lock();
+  struct flight_schedule *fs = flight_schedule_find(city);
+  if (fs != NULL)
+  {
+    pthread_rwlock_t *lock = flight_schedule_lock(fs, exclusive);
+    status = fn(fs, time, capacity);
+    pthread_rwlock_unlock(lock);
+  }
+  flight_schedules_unlock();
+  journal_commit_if_full();
+  STATS_COUNT(status[status]);
+  return status;
+}
+
+static int booking_remove_flight_fn(struct flight_schedule *fs, int time, int unused)
+{
+  (void)unused;
+  return flight_schedule_remove_flight_at(fs, time);
+}
+
+static int booking_book_seats_fn(struct flight_schedule *fs, int time, int seats)
+{
+  return flight_schedule_book_seats_at(fs, &time, seats);
+}
+
+static int booking_free_seats_fn(struct flight_schedule *fs, int time, int seats)
+{
+  return flight_schedule_free_seats_at(fs, time, seats);
+}
+
+int booking_add_flight(city_id_t city, int time, int capacity)
+{
+  return booking_run(city, flight_schedule_add_flight_at, time, capacity, true);
+}
+
+int booking_remove_flight(city_id_t city, int time)
+{
+  return booking_run(city, booking_remove_flight_fn, time, 0, true);
+}
+
+int booking_schedule_seat(city_id_t city, int time)
+{
+  return booking_run(city, booking_book_seats_fn, time, 1, false);
+}
+
+int booking_unschedule_seat(city_id_t city, int time)
+{
+  return booking_run(city, booking_free_seats_fn, time, 1, false);
+}
+
+// seats seats on one flight, all of them or none
+int booking_book_seats(city_id_t city, int time, int seats)
+{
+  return booking_run(city, booking_book_seats_fn, time, seats, false);
+}
+
+int booking_free_seats(city_id_t city, int time, int seats)
+{
+  return booking_run(city, booking_free_seats_fn, time, seats, false);
+}
+
+// A seat on the first flight at or after time with one, or else a place
+// in line for the first flight at or after time.  BOOKING_WAITLISTED sets
+// *ticket and *departure; client is who to tell in server mode, or NULL.
+int booking_queue_seat(city_id_t city, int time, struct server_client *client,
+                       int *ticket, int *departure)
+{
+  int status = BOOKING_NO_SCHEDULE;
+
+  flight_schedules_read_lock();
+  struct flight_schedule *fs = flight_schedule_find(city);
+  if (fs != NULL)
+  {
+    pthread_rwlock_t *lock = flight_schedule_lock(fs, false);
+    status = flight_schedule_queue_seat_at(fs, &time, client, ticket);
+    *departure = time;
+    pthread_rwlock_unlock(lock);
+  }
+  flight_schedules_unlock();
+  journal_commit_if_full();
+  STATS_COUNT(status[status]);
+  return status;
+}
+
+int booking_cancel(city_id_t city, int ticket)
+{
+  return booking_run(city, flight_schedule_cancel_at, ticket, 0, false);
+}
+
+static int batch_order_compare(const void *a, const void *b)
+{
+  const struct batch_order *x = a, *y = b;
+  if (x->city != y->city)
+    return x->city < y->city ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+// Run every tuple of a batch that was read without error.  The tuples are
+// taken city by city, each city's in batch order, so every schedule is
+// found and locked once however many tuples it has.  Tuples for different
+// cities never affect one another, so the statuses are what running them
+// one by one in batch order would give.
+void booking_batch(struct batch_tuple *tuples, int count)
+{
+  struct batch_order *order = malloc((count > 0 ? count : 1) * sizeof(*order));
+  int n = 0;
+
+  if (order == NULL)
+  {
+    output_flush();
+    printf("ERROR: Out of memory running a batch.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < count; i++)
+  {
+    if (tuples[i].error == PARSE_OK)
+    {
+      order[n].city = tuples[i].city;
+      order[n++].index = i;
+    }
+  }
+  qsort(order, n, sizeof(*order), batch_order_compare);
+
+  for (int start = 0, end; start < n; start = end)
+  {
+    city_id_t city = order[start].city;
+    for (end = start + 1; end < n && order[end].city == city; end++)
+      ;
+
+    flight_schedules_read_lock();
+    struct flight_schedule *fs = flight_schedule_find(city);
+    pthread_rwlock_t *lock = fs != NULL ? flight_schedule_lock(fs, false) : NULL;
+    for (int k = start; k < end; k++)
+    {
+      struct batch_tuple *t = &tuples[order[k].index];
+      if (fs == NULL)
+        t->status = BOOKING_NO_SCHEDULE;
+      else if (t->seats > 0)
+        t->status = flight_schedule_book_seats_at(fs, &t->time, t->seats);
+      else
+        t->status = flight_schedule_free_seats_at(fs, t->time, -t->seats);
+      STATS_COUNT(status[t->status]);
+    }
+    if (lock != NULL)
+      pthread_rwlock_unlock(lock);
+    flight_schedules_unlock();
+    journal_commit_if_full();
+  }
+  free(order);
+}
+
+// Earliest flight to any destination departing at or after time with a
+// seat available.  The time index finds the first minute with one, across
+// any number of days; of the flights with a seat then, the schedule
+// nearest the front of the active list wins, and its first flight.  The
+// flight is copied out, since it may change once the locks are dropped.
+int booking_next_departure(int time, city_id_t *city, int *departure,
+                           int *available, int *capacity)
+{
+  int status = BOOKING_NO_SEATS;
+  struct flight_schedule *found = NULL;
+  int found_i = 0, found_avail = 0;
+
+  flight_schedules_read_lock();
+  pthread_rwlock_rdlock(&time_index.lock);
+  for (int t = time_index_next_open(time); t >= 0 && found == NULL;
+       t = time_index_next_open(t + 1))
+  {
+    struct time_bucket *b = time_index_bucket(t);
+    for (int k = 0; k * 64 < b->count; k++)
+    {
+      uint64_t word = __atomic_load_n(&b->open[k], __ATOMIC_RELAXED);
+      while (word != 0)
+      {
+        int e = k * 64 + __builtin_ctzll(word);
+        word &= word - 1;
+
+        struct flight_schedule *fs = flight_schedule_find(b->cities[e]);
+        if (found != NULL && fs->stamp < found->stamp)
+          continue;
+        int i = time_index_flight(fs, t, e);
+        int avail = __atomic_load_n(&fs->available[i], __ATOMIC_RELAXED);
+        if (avail == 0 || (fs == found && i > found_i))
+          continue; // sold out since the bit was read, or a later one
+        found = fs;
+        found_i = i;
+        found_avail = avail;
+      }
+    }
+  }
+  if (found != NULL)
+  {
+    *city = found->destination;
+    *departure = found->times[found_i];
+    *available = found_avail;
+    *capacity = found->capacity[found_i];
+    status = BOOKING_OK;
+  }
+  pthread_rwlock_unlock(&time_index.lock);
+  flight_schedules_unlock();
+  STATS_COUNT(status[status]);
+  return status;
+}
+
+// Retire the first days days of the calendar and open as many after its
+// end, giving the first and last minute it now has.  Only the buckets of
+// the days retired are visited: a schedule with a flight in one of them
+// loses every flight before the new first day at once, and the buckets
+// stay for the new days.  Each flight retired drops its waitlist and is
+// an r to the city's followers.  Journaled as one D record; days 0 only
+// reports the calendar.
+int booking_roll_forward(int days, long *retired, int *first, int *last)
+{
+  *retired = 0;
+  flight_schedules_write_lock();
+  int start = time_index.first + days * MINUTES_PER_DAY;
+  if (days > 0)
+  {
+    int end = days * MINUTES_PER_DAY < time_index.minutes
+                  ? start
+                  : time_index.first + time_index.minutes;
+    // the buckets only change in time_index_retire, and nothing else
+    // runs while the write lock is held
+    for (int t = time_index.first; t < end; t++)
+    {
+      struct time_bucket *b = time_index_bucket(t);
+      for (int e = 0; e < b->count; e++)
+      {
+        if (b->cities[e] == CITY_NONE)
+          continue; // a hole
+        struct flight_schedule *fs = flight_schedule_find(b->cities[e]);
+        if (fs->flight_count == 0 || fs->times[0] >= start)
+          continue; // its earlier flights went already
+        int k = flight_schedule_lower_bound(fs, start);
+        for (int i = 0; i < k; i++)
+        {
+          waitlist_drop(fs, i);
+          feed_flight('r', fs, i);
+        }
+        pthread_rwlock_wrlock(&time_index.lock);
+        flight_schedule_drop_flights(fs, k);
+        pthread_rwlock_unlock(&time_index.lock);
+        replica_publish(fs);
+        *retired += k;
+      }
+    }
+    pthread_rwlock_wrlock(&time_index.lock);
+    time_index_retire(start);
+    pthread_rwlock_unlock(&time_index.lock);
+    journal_append('D', CITY_NONE, 0, days);
+    replica_calendar();
+    STATS_ADD(flights_retired, *retired);
+  }
+  *first = time_index.first;
+  *last = time_index.first + time_index.minutes - 1;
+  flight_schedules_unlock();
+  journal_commit_if_full();
+  STATS_COUNT(status[BOOKING_OK]);
+  return BOOKING_OK;
+}
+
+// Copy city's flights out as time, available, capacity triples into a new
+// array, which the caller frees, so they can be printed without the locks
+int booking_list_flights(city_id_t city, int **flights, int *count)
+{
+  flight_schedules_read_lock();
+  struct flight_schedule *fs = flight_schedule_find(city);
+  if (fs == NULL)
+  {
+    flight_schedules_unlock();
+    return BOOKING_NO_SCHEDULE;
+  }
+
+  pthread_rwlock_t *lock = flight_schedule_lock(fs, false);
+  int *out = malloc((fs->flight_count * 3 + 1) * sizeof(int));
+  if (out == NULL)
+  {
+    output_flush();
+    printf("ERROR: Out of memory listing flights.\n");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < fs->flight_count; i++)
+  {
+    out[3 * i] = fs->times[i];
+    out[3 * i + 1] = __atomic_load_n(&fs->available[i], __ATOMIC_RELAXED);
+    out[3 * i + 2] = fs->capacity[i];
+  }
+  *flights = out;
+  *count = fs->flight_count;
+  pthread_rwlock_unlock(lock);
+  flight_schedules_unlock();
+  return BOOKING_OK;
+}
+
+// Put count flights at once after the flights of city's schedule, given
+// as time, available, capacity triples in time order and departing no
+// earlier than its last flight, as when a schedule moves in from another
+// shard (-N).  Journaled as one m record per flight, which the journal
+// replays through here too, so each flight comes back with its own seats
+// whatever other flights share its time.
+int booking_load_flights(city_id_t city, const int *flights, int count)
+{
+  int status = BOOKING_NO_SCHEDULE;
+
+  flight_schedules_read_lock();
+  struct flight_schedule *fs = flight_schedule_find(city);
+  if (fs != NULL)
+  {
+    pthread_rwlock_t *lock = flight_schedule_lock(fs, true);
+    int base = fs->flight_count;
+    status = BOOKING_OK;
+    if ((count > 0 && base > 0 && flights[0] < fs->times[base - 1]) ||
+        (count > 0 && !flight_schedule_reserve_flights(fs, base + count)))
+      status = BOOKING_MAX_FLIGHTS;
+    pthread_rwlock_wrlock(&time_index.lock);
+    for (int i = base; status == BOOKING_OK && i < base + count; i++)
+    {
+      const int *f = &flights[3 * (i - base)];
+      fs->times[i] = f[0];
+      fs->available[i] = f[1];
+      fs->capacity[i] = f[2];
+      fs->waitlists[i] = 0;
+      if (fs->available[i] > 0)
+        fs->open_seats[i / 64] |= UINT64_C(1) << (i % 64);
+      fs->flight_count = i + 1;
+      if (!time_index_add(fs, i))
+      {
+        output_flush();
+        printf("ERROR: Out of memory moving a schedule.\n");
+        exit(EXIT_FAILURE);
+      }
+    }
+    pthread_rwlock_unlock(&time_index.lock);
+    bool logging = status == BOOKING_OK && journal_logging();
+    for (int i = base; logging && i < base + count; i++)
+      journal_record_flight('m', city, fs->times[i], fs->available[i],
+                            fs->capacity[i]);
+    if (status == BOOKING_OK)
+      replica_publish(fs);
+    pthread_rwlock_unlock(lock);
+  }
+  flight_schedules_unlock();
+  journal_commit_if_full();
+  STATS_COUNT(status[status]);
+  return status;
+}
+
+/******************************************************************
+ * Snapshots                                                      *
+ * The whole state is written to a temporary file through a       *
+ * shared mapping and renamed over the snapshot, so a crash while *
+ * saving leaves the previous snapshot intact.  Loading maps the  *
+ * file read only and copies the records straight into schedules *
+ * taken from the pool, one reservation for all of them.          *
+ *****************************************************************/
+
+// Make a rename into the directory holding path survive a crash
+static bool snapshot_sync_dir(const char *path)
+{
+  const char *slash = strrchr(path, '/');
+  size_t len = slash == NULL || slash == path ? 1 : (size_t)(slash - path);
+  char *dir = malloc(len + 1);
+
+  if (dir == NULL)
+    return false;
+  memcpy(dir, slash == NULL ? "." : path, len);
+  dir[len] = '\0';
+  int fd = open(dir, O_RDONLY | O_DIRECTORY);
+  free(dir);
+  bool ok = fd >= 0 && fsync(fd) == 0;
+  if (fd >= 0)
+    close(fd);
+  return ok;
+}
+
+bool snapshot_write(const char *path)
+{
+  uint64_t schedules = 0, flights = 0;
+  struct flight_schedule *fs;
+
+  for (fs = flight_schedules_active; fs != NULL; fs = fs->next)
+  {
+    schedules++;
+    flights += fs->flight_count;
+  }
+
+  size_t bytes = sizeof(struct snapshot_header) +
+                 schedules * sizeof(struct snapshot_schedule) +
+                 flights * sizeof(struct snapshot_flight);
+
+  size_t tmp_len = strlen(path) + sizeof(".tmp");
+  char *tmp = malloc(tmp_len);
+  if (tmp == NULL)
+    return false;
+  snprintf(tmp, tmp_len, "%s.tmp", path);
+
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+  {
+    free(tmp);
+    return false;
+  }
+
+  char *map = MAP_FAILED;
+  if (ftruncate(fd, bytes) == 0)
+    map = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    return false;
+  }
+
+  struct snapshot_header *hdr = (struct snapshot_header *)map;
+  struct snapshot_schedule *rec = (struct snapshot_schedule *)(hdr + 1);
+  struct snapshot_flight *fl = (struct snapshot_flight *)(rec + schedules);
+
+  memcpy(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic));
+  hdr->version = SNAPSHOT_VERSION;
+  hdr->byte_order = SNAPSHOT_BYTE_ORDER;
+  hdr->schedules = schedules;
+  hdr->flights = flights;
+  hdr->journal_seq = journal.seq;
+  hdr->first_day = time_index.first / MINUTES_PER_DAY;
+
+  for (fs = flight_schedules_active; fs != NULL; fs = fs->next, rec++)
+  {
+    // the file was just truncated so the padding is already zero
+    const char *name = city_name(fs->destination);
+    memcpy(rec->destination, name, strlen(name));
+    rec->flight_count = fs->flight_count;
+    for (int i = 0; i < fs->flight_count; i++, fl++)
+    {
+      fl->time = fs->times[i];
+      fl->available = fs->available[i];
+      fl->capacity = fs->capacity[i];
+    }
+  }
+
+  bool ok = msync(map, bytes, MS_SYNC) == 0;
+  munmap(map, bytes);
+  ok = ok && fsync(fd) == 0;
+  close(fd);
+  ok = ok && rename(tmp, path) == 0 && snapshot_sync_dir(path);
+  if (!ok)
+    unlink(tmp);
+  free(tmp);
+  return ok;
+}
+
+// Save a snapshot and empty the journal it makes redundant.  No booking
+// may slip in between, so both happen under the write lock.
+bool snapshot_checkpoint(const char *path)
+{
+  flight_schedules_write_lock();
+  bool ok = snapshot_write(path);
+  if (ok)
+    journal_checkpoint();
+  flight_schedules_unlock();
+  return ok;
+}
+
+// Check one schedule's flight records before adopting them.  Every flight
+// must fall in the calendar, which may be shorter than the one it was
+// saved with.
+static bool snapshot_flights_valid(const struct snapshot_flight *fl, uint32_t n)
+{
+  for (uint32_t i = 0; i < n; i++)
+  {
+    if (fl[i].time < calendar_first() || fl[i].time > calendar_last() ||
+        fl[i].capacity <= 0 || fl[i].available < 0 ||
+        fl[i].available > fl[i].capacity ||
+        (i > 0 && fl[i].time < fl[i - 1].time))
+      return false;
+  }
+  return true;
+}
+
+// Load the snapshot at path into the (empty) schedule lists.  A missing
+// file is not an error -- there is simply nothing to restore yet.
+bool snapshot_load(const char *path)
+{
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0)
+    return errno == ENOENT;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(struct snapshot_header))
+  {
+    close(fd);
+    return false;
+  }
+
+  size_t bytes = st.st_size;
+  char *map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  madvise(map, bytes, MADV_SEQUENTIAL);
+
+  const struct snapshot_header *hdr = (const struct snapshot_header *)map;
+  bool ok = memcmp(hdr->magic, SNAPSHOT_MAGIC, sizeof(hdr->magic)) == 0 &&
+            hdr->version == SNAPSHOT_VERSION &&
+            hdr->byte_order == SNAPSHOT_BYTE_ORDER &&
+            hdr->first_day >= 0 &&
+            hdr->first_day <= CALENDAR_DAY_LIMIT - calendar.days &&
+            hdr->schedules <= bytes / sizeof(struct snapshot_schedule) &&
+            hdr->flights <= bytes / sizeof(struct snapshot_flight) &&
+            bytes == sizeof(*hdr) +
+                         hdr->schedules * sizeof(struct snapshot_schedule) +
+                         hdr->flights * sizeof(struct snapshot_flight);
+
+  if (ok)
+  {
+    calendar.first_day = hdr->first_day;
+    time_index.first = calendar_first();
+  }
+  const struct snapshot_schedule *recs =
+      (const struct snapshot_schedule *)(hdr + 1);
+  const struct snapshot_flight *fl =
+      (const struct snapshot_flight *)(recs + (ok ? hdr->schedules : 0));
+
+  // Schedules are pushed on the front of the active list so add them last
+  // record first; that needs each record's offset into the flight records.
+  uint64_t *first = NULL;
+  if (ok && hdr->schedules > 0)
+  {
+    first = malloc(hdr->schedules * sizeof(uint64_t));
+    ok = first != NULL;
+  }
+  uint64_t total = 0;
+  for (uint64_t r = 0; ok && r < hdr->schedules; r++)
+  {
+    first[r] = total;
+    total += recs[r].flight_count;
+    ok = recs[r].destination[MAX_CITY_NAME_LEN] == '\0' &&
+         recs[r].destination[0] != '\0' && total <= hdr->flights &&
+         recs[r].flight_count <= MAX_FLIGHTS_PER_CITY &&
+         snapshot_flights_valid(fl + first[r], recs[r].flight_count);
+  }
+  ok = ok && total == hdr->flights;
+
+  if (ok && flight_schedules_pool.bump_left < hdr->schedules)
+    ok = flight_schedule_pool_reserve(hdr->schedules);
+
+  for (uint64_t r = hdr->schedules; ok && r-- > 0;)
+  {
+    const struct snapshot_flight *src = fl + first[r];
+    uint32_t n = recs[r].flight_count;
+
+    city_id_t city = city_intern(recs[r].destination);
+    if (flight_schedule_find(city) != NULL)
+    {
+      ok = false; // the same city twice
+      break;
+    }
+    if (!city_tree_insert(city_name(city)))
+    {
+      ok = false;
+      break;
+    }
+    struct flight_schedule *fs = flight_schedule_allocate();
+    if (fs == NULL || !flight_schedule_reserve_flights(fs, n))
+    {
+      ok = false; // the program exits, so nothing is undone
+      break;
+    }
+    fs->destination = city;
+    for (uint32_t i = 0; i < n; i++)
+    {
+      fs->times[i] = src[i].time;
+      fs->available[i] = src[i].available;
+      fs->capacity[i] = src[i].capacity;
+      fs->waitlists[i] = 0;
+      if (src[i].available > 0)
+        fs->open_seats[i / 64] |= UINT64_C(1) << (i % 64);
+    }
+    fs->flight_count = n;
+    city_entry(city)->schedule = fs;
+    for (uint32_t i = 0; ok && i < n; i++)
+      ok = time_index_add(fs, i);
+  }
+
+  if (ok)
+    journal.seq = hdr->journal_seq;
+  free(first);
+  munmap(map, bytes);
+  return ok;
+}
+
+/******************************************************************
+ * Journal                                                        *
+ * Every change is logged as a compact record.  Records are       *
+ * written and synced in groups so a burst of bookings costs one  *
+ * fdatasync rather than one each.  A snapshot checkpoint empties *
+ * the journal; at startup the records newer than the snapshot    *
+ * are replayed through the same *_at functions the commands use. *
+ *****************************************************************/
+static long journal_usec_since(const struct timespec *t)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) * 1000000L +
+         (now.tv_nsec - t->tv_nsec) / 1000;
+}
+
+// Microseconds until the pending records must be committed.  Called with
+// journal.lock held.
+long journal_commit_due(void)
+{
+  long left = journal.group_usec - journal_usec_since(&journal.oldest);
+  return left > 0 ? left : 0;
+}
+
+// Write all n bytes to fd, going on after a short write or a signal
+static bool journal_write_all(int fd, const char *p, size_t n)
+{
+  while (n > 0)
+  {
+    ssize_t put = write(fd, p, n);
+    if (put < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      return false;
+    }
+    p += put;
+    n -= put;
+  }
+  return true;
+}
+
+// Write and sync the pending records.  They are swapped out under
+// journal.lock and written holding only sync_lock, which keeps the groups
+// in order, so the sync never holds up a booking.
+void journal_commit(void)
+{
+  if (journal.fd < 0)
+    return;
+
+  pthread_mutex_lock(&journal.sync_lock);
+  pthread_mutex_lock(&journal.lock);
+  char *buf = journal.buf;
+  size_t len = journal.len, size = journal.size;
+  int pending = journal.pending;
+  journal.buf = journal.spare;
+  journal.size = journal.spare_size;
+  journal.spare = buf;
+  journal.spare_size = size;
+  journal.len = 0;
+  journal.pending = 0;
+  journal.full = false;
+  pthread_mutex_unlock(&journal.lock);
+
+  if (pending > 0 &&
+      (!journal_write_all(journal.fd, buf, len) ||
+       fdatasync(journal.fd) != 0))
+  {
+    // a change we have already made cannot be made durable
+    output_flush();
+    printf("ERROR: Cannot write the journal.\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_mutex_unlock(&journal.sync_lock);
+}
+
+// Commit the pending records now if they are due, otherwise return how
+// many microseconds until they are (or -1 if nothing is pending)
+long journal_commit_if_due(void)
+{
+  long due = -1;
+
+  pthread_mutex_lock(&journal.lock);
+  if (journal.pending > 0)
+    due = journal.full ? 0 : journal_commit_due();
+  pthread_mutex_unlock(&journal.lock);
+  if (due == 0)
+    journal_commit();
+  return due;
+}
+
+// Commit a group that journal_record found complete.  The booking API
+// calls it once it has let go of its locks.
+void journal_commit_if_full(void)
+{
+  if (__atomic_load_n(&journal.full, __ATOMIC_RELAXED))
+    journal_commit();
+}
+
+bool journal_logging(void)
+{
+  return journal.fd >= 0 && !journal.replaying;
+}
+
+// Seats are booked holding the stripe only for reading, so when
+// journaling, a seat change and its record are made under the stripe's
+// journal_stripes mutex: records of one flight land in the journal in
+// the order the seats moved, while other stripes go on booking.  A city
+// someone follows has its seat changes made under the mutex too, so its
+// deltas are numbered in that order.  Changes made holding the stripe or
+// flight_schedules_lock for writing are ordered already and just use
+// journal_append.  journal_begin returns whether it took the mutex, and
+// the caller logs only if journal_logging() says so as well.
+bool journal_begin(struct flight_schedule *fs)
+{
+  if (!journal_logging() &&
+      __atomic_load_n(&city_entry(fs->destination)->feed, __ATOMIC_RELAXED) ==
+          NULL)
+    return false;
+  pthread_mutex_lock(&journal_stripes[flight_schedule_stripe(fs)]);
+  return true;
+}
+
+void journal_end(struct flight_schedule *fs, bool ordered)
+{
+  if (ordered)
+    pthread_mutex_unlock(&journal_stripes[flight_schedule_stripe(fs)]);
+}
+
+void journal_append(char op, city_id_t city, int time, int capacity)
+{
+  if (journal_logging())
+    journal_record(op, city, time, capacity);
+}
+
+// Write one record at p in the current format, returning its length
+static size_t journal_encode(char *p, char op, const char *name, int time,
+                             int count, int available)
+{
+  size_t len = strlen(name);
+  char *start = p;
+
+  *p++ = op;
+  *p++ = (char)len;
+  memcpy(p, name, len);
+  p += len;
+  if (op != 'A' && op != 'R' && op != 'D')
+  {
+    int32_t t = time;
+    memcpy(p, &t, sizeof(t));
+    p += sizeof(t);
+  }
+  if (op == 'a' || op == 'b' || op == 'f' || op == 'm' || op == 'D')
+  {
+    int32_t c = count;
+    memcpy(p, &c, sizeof(c));
+    p += sizeof(c);
+  }
+  if (op == 'm')
+  {
+    int32_t a = available;
+    memcpy(p, &a, sizeof(a));
+    p += sizeof(a);
+  }
+  return p - start;
+}
+
+// Append a record to the buffer.  D has no city and logs its days as the
+// capacity.  A full group is only marked here and committed by
+// journal_commit_if_full once the caller has let go of its locks.
+void journal_record(char op, city_id_t city, int time, int capacity)
+{
+  journal_record_flight(op, city, time, 0, capacity);
+}
+
+// journal_record with the seats available too, which only m logs
+void journal_record_flight(char op, city_id_t city, int time, int available,
+                           int capacity)
+{
+  pthread_mutex_lock(&journal.lock);
+  if (journal.size - journal.len < JOURNAL_RECORD_MAX)
+  {
+    size_t size = journal.size ? journal.size * 2 : 4096;
+    char *buf = realloc(journal.buf, size);
+    if (buf == NULL)
+    {
+      output_flush();
+      printf("ERROR: Out of memory journaling a change.\n");
+      exit(EXIT_FAILURE);
+    }
+    journal.buf = buf;
+    journal.size = size;
+  }
+
+  journal.len += journal_encode(journal.buf + journal.len, op,
+                                op == 'D' ? "" : city_name(city), time,
+                                capacity, available);
+  journal.seq++;
+
+  if (journal.pending++ == 0)
+    clock_gettime(CLOCK_MONOTONIC, &journal.oldest);
+  if (journal.pending >= journal.group_ops || journal_commit_due() == 0)
+    journal.full = true;
+  pthread_mutex_unlock(&journal.lock);
+}
+
+static bool journal_write_header(void)
+{
+  struct journal_header hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, JOURNAL_MAGIC, sizeof(hdr.magic));
+  hdr.version = JOURNAL_VERSION;
+  hdr.byte_order = SNAPSHOT_BYTE_ORDER;
+  hdr.base_seq = journal.seq;
+  return ftruncate(journal.fd, 0) == 0 &&
+         lseek(journal.fd, 0, SEEK_SET) == 0 &&
+         journal_write_all(journal.fd, (const char *)&hdr, sizeof(hdr)) &&
+         fdatasync(journal.fd) == 0;
+}
+
+// Called once a snapshot holding every change so far has been saved: the
+// records in the journal (and any not written yet) are no longer needed.
+void journal_checkpoint(void)
+{
+  if (journal.fd < 0)
+    return;
+
+  pthread_mutex_lock(&journal.sync_lock);
+  pthread_mutex_lock(&journal.lock);
+  journal.len = 0;
+  journal.pending = 0;
+  journal.full = false;
+  bool ok = journal_write_header();
+  pthread_mutex_unlock(&journal.lock);
+  pthread_mutex_unlock(&journal.sync_lock);
+  if (!ok)
+  {
+    output_flush();
+    printf("ERROR: Cannot write the journal.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+// Read one record with times of time_bytes bytes into e, returning its
+// length or 0 if it is incomplete or bad
+static size_t journal_decode(const char *p, size_t left, size_t time_bytes,
+                             struct journal_entry *e)
+{
+  if (left < 2)
+    return 0;
+  char op = p[0];
+  size_t len = (unsigned char)p[1];
+  size_t need = 2 + len;
+  bool counted =
+      op == 'a' || op == 'b' || op == 'f' || op == 'm' || op == 'D';
+  bool timed = op == 'a' || op == 'b' || op == 'f' || op == 'm' ||
+               op == 'r' || op == 's' || op == 'u';
+  if (!counted && !timed && op != 'A' && op != 'R')
+    return 0;
+  if (timed)
+    need += time_bytes;
+  if (counted)
+    need += sizeof(int32_t);
+  if (op == 'm')
+    need += sizeof(int32_t);
+  if ((len == 0) != (op == 'D') || len > MAX_CITY_NAME_LEN || need > left)
+    return 0;
+
+  e->op = op;
+  memcpy(e->name, p + 2, len);
+  e->name[len] = '\0';
+  e->time = 0;
+  e->count = 0;
+  e->available = 0;
+  p += 2 + len;
+  if (timed && time_bytes == sizeof(int16_t))
+  {
+    int16_t time;
+    memcpy(&time, p, sizeof(time));
+    e->time = time;
+  }
+  else if (timed)
+  {
+    int32_t time;
+    memcpy(&time, p, sizeof(time));
+    e->time = time;
+  }
+  if (counted)
+  {
+    int32_t count;
+    memcpy(&count, p + (timed ? time_bytes : 0), sizeof(count));
+    e->count = count;
+  }
+  if (op == 'm')
+  {
+    int32_t available;
+    memcpy(&available, p + time_bytes + sizeof(int32_t), sizeof(available));
+    e->available = available;
+    if (e->count <= 0 || available < 0 || available > e->count)
+      return 0;
+  }
+  return need;
+}
+
+// Apply one record.  A time outside the calendar, as when the journal was
+// written with a longer -D, is reported and the record skipped.
+static void journal_apply(const struct journal_entry *e)
+{
+  long retired;
+  int first, last;
+
+  if (e->op == 'D')
+  {
+    if (e->count <= 0 ||
+        e->count > CALENDAR_DAY_LIMIT - calendar.first_day - calendar.days)
+      msg_days_bad();
+    else
+      booking_roll_forward(e->count, &retired, &first, &last);
+    calendar.first_day = time_index.first / MINUTES_PER_DAY;
+    return;
+  }
+  if (e->op != 'A' && e->op != 'R' && e->time != TIME_NULL &&
+      (e->time < calendar_first() || e->time > calendar_last()))
+  {
+    msg_time_bad();
+    return;
+  }
+
+  city_id_t city = city_intern(e->name);
+  int status;
+  if (e->op == 'A')
+    status = booking_add_schedule(city);
+  else if (e->op == 'R')
+    status = booking_remove_schedule(city);
+  else if (e->op == 'a')
+    status = booking_add_flight(city, e->time, e->count);
+  else if (e->op == 'r')
+    status = booking_remove_flight(city, e->time);
+  else if (e->op == 's')
+    status = booking_schedule_seat(city, e->time);
+  else if (e->op == 'u')
+    status = booking_unschedule_seat(city, e->time);
+  else if (e->op == 'b')
+    status = booking_book_seats(city, e->time, e->count);
+  else if (e->op == 'f')
+    status = booking_free_seats(city, e->time, e->count);
+  else
+  {
+    int flight[3] = {e->time, e->available, e->count};
+    status = booking_load_flights(city, flight, 1);
+  }
+  msg_booking_status(status, city); // only when the journal disagrees
+}
+
+// An older journal has 16 bit times, so the records we append would not
+// read back.  Write its first records records, in bytes before end, to a
+// new file in the current format and put that in its place.
+static bool journal_upgrade(const char *path, const char *map, size_t end,
+                            uint64_t records)
+{
+  const struct journal_header *old = (const struct journal_header *)map;
+  struct journal_header hdr = *old;
+  struct journal_entry e;
+  size_t tmp_len = strlen(path) + sizeof(".tmp");
+  char *tmp = malloc(tmp_len);
+  // each record grows by the two bytes its time gains at most
+  char *buf = malloc(end - sizeof(hdr) + 2 * records);
+  size_t len = 0;
+  bool ok = tmp != NULL && buf != NULL;
+
+  hdr.version = JOURNAL_VERSION;
+  for (size_t pos = sizeof(hdr); ok && pos < end;)
+  {
+    size_t n = journal_decode(map + pos, end - pos, sizeof(int16_t), &e);
+    len += journal_encode(buf + len, e.op, e.name, e.time, e.count,
+                          e.available);
+    pos += n;
+  }
+
+  int fd = -1;
+  if (ok)
+  {
+    snprintf(tmp, tmp_len, "%s.tmp", path);
+    fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ok = fd >= 0 &&
+         journal_write_all(fd, (const char *)&hdr, sizeof(hdr)) &&
+         journal_write_all(fd, buf, len) && fdatasync(fd) == 0 &&
+         rename(tmp, path) == 0 && snapshot_sync_dir(path);
+  }
+  if (ok)
+  {
+    close(journal.fd);
+    journal.fd = fd;
+  }
+  else if (fd >= 0)
+  {
+    close(fd);
+    unlink(tmp);
+  }
+  free(buf);
+  free(tmp);
+  return ok;
+}
+
+// Open (or create) the journal, replay the records that are newer than the
+// snapshot that was loaded, and drop anything after the last whole record.
+void journal_open(const char *path)
+{
+  struct stat st;
+  struct journal_entry e;
+
+  journal.fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (journal.fd < 0 || fstat(journal.fd, &st) != 0)
+  {
+    printf("ERROR: Cannot open journal %s.\n", path);
+    exit(EXIT_FAILURE);
+  }
+
+  if ((size_t)st.st_size < sizeof(struct journal_header))
+  {
+    // new (or never completed) journal
+    if (!journal_write_header())
+    {
+      printf("ERROR: Cannot write journal %s.\n", path);
+      exit(EXIT_FAILURE);
+    }
+    return;
+  }
+
+  size_t bytes = st.st_size;
+  char *map = mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, journal.fd, 0);
+  const struct journal_header *hdr = (const struct journal_header *)map;
+  if (map == MAP_FAILED ||
+      memcmp(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic)) != 0 ||
+      hdr->version < 1 || hdr->version > JOURNAL_VERSION ||
+      hdr->byte_order != SNAPSHOT_BYTE_ORDER || hdr->base_seq > journal.seq)
+  {
+    // base_seq past the snapshot means records the snapshot lacks are gone
+    printf("ERROR: Bad journal file %s.\n", path);
+    exit(EXIT_FAILURE);
+  }
+  madvise(map, bytes, MADV_SEQUENTIAL);
+
+  uint64_t seq = hdr->base_seq;
+  bool older = hdr->version < 3;
+  size_t time_bytes = older ? sizeof(int16_t) : sizeof(int32_t);
+  size_t pos = sizeof(*hdr);
+  size_t len;
+  journal.replaying = true;
+  while ((len = journal_decode(map + pos, bytes - pos, time_bytes, &e)) > 0)
+  {
+    if (seq + 1 > journal.seq)
+      journal_apply(&e);
+    pos += len;
+    seq++;
+  }
+  journal.replaying = false;
+
+  // rewrite an older journal in the format of the records to come, or cut
+  // off a record that was only partly written when we stopped
+  bool ok = older ? journal_upgrade(path, map, pos, seq - hdr->base_seq)
+                  : pos == bytes || ftruncate(journal.fd, pos) == 0;
+  munmap(map, bytes);
+  if (seq > journal.seq)
+    journal.seq = seq;
+  if (!ok || lseek(journal.fd, 0, SEEK_END) < 0)
+  {
+    printf("ERROR: Cannot write journal %s.\n", path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+/******************************************************************
+ * Timetable import (-I)                                          *
+ * Each row is checked as a and its time and capacity would be.   *
+ * A city gets a schedule the first time it appears unless it has *
+ * one already.  A city whose schedule is still empty has its     *
+ * flights written straight into a block of the right size, as a  *
+ * snapshot is loaded; one that already has flights, or has more  *
+ * rows than a city may have flights, gets them one at a time in  *
+ * file order through booking_add_flight.  Either way the result  *
+ * and the journal records are the same as for the A and a        *
+ * commands.                                                      *
+ *****************************************************************/
+
+// Parse a number as input_int does from a field that holds nothing else
+// but white space
+static bool import_int(const char *p, const char *end, int *value)
+{
+  if (!text_int(&p, end, value))
+    return false;
+  while (p < end && input_is_space(*p))
+    p++;
+  return p == end;
+}
+
+// Check one line of the timetable, returning a parse_error and the city
+// name in city.  PARSE_QUIET also covers a row for the null time, which
+// adds nothing.
+static int import_parse_row(const char *p, const char *end, city_t city,
+                            struct import_row *row)
+{
+  const char *time_at = NULL, *capacity_at = NULL;
+
+  // the time and capacity are the last two fields, so the city name
+  // may hold commas just as it may in A
+  for (const char *c = end; c > p; c--)
+  {
+    if (c[-1] == ',')
+    {
+      if (capacity_at == NULL)
+      {
+        capacity_at = c;
+      }
+      else
+      {
+        time_at = c;
+        break;
+      }
+    }
+  }
+  // skip leading non letter characters, as city_read_name does
+  while (p < end && !((*p >= 'A' && *p <= 'Z') || (*p >= 'a' && *p <= 'z')))
+    p++;
+  if (time_at == NULL || p >= time_at - 1)
+    return PARSE_ROW_BAD;
+
+  size_t len = time_at - 1 - p;
+  if (len > MAX_CITY_NAME_LEN)
+    len = MAX_CITY_NAME_LEN;
+  memcpy(city, p, len);
+  city[len] = '\0';
+
+  if (!import_int(time_at, capacity_at - 1, &row->time))
+    return PARSE_TIME_BAD;
+  bool time_ok = row->time == TIME_NULL || (row->time >= calendar_first() &&
+                                            row->time <= calendar_last());
+  if (!time_ok)
+    return PARSE_QUIET;
+  if (!import_int(capacity_at, end, &row->capacity))
+    return PARSE_CAPACITY_BAD;
+  if (row->capacity <= 0 || row->time == TIME_NULL)
+    return PARSE_QUIET;
+  return PARSE_OK;
+}
+
+// Make room for one more element of a growable array, false when out of
+// memory
+static bool import_grow(void **array, size_t *size, size_t count,
+                        size_t element)
+{
+  if (count < *size)
+    return true;
+  size_t grown = *size > 0 ? *size * 2 : IMPORT_ROWS_MIN;
+  void *p = realloc(*array, grown * element);
+  if (p == NULL)
+    return false;
+  *array = p;
+  *size = grown;
+  return true;
+}
+
+// Thread body: parse one part of the timetable
+static void *import_parse_part(void *arg)
+{
+  struct import_part *part = arg;
+  const char *p = part->begin;
+  city_t city, last_city = "";
+  city_id_t last_id = CITY_NONE;
+
+  while (p < part->end && !part->failed)
+  {
+    const char *nl = memchr(p, '\n', part->end - p);
+    const char *end = nl != NULL ? nl : part->end;
+    const char *last = end;
+    part->lines++;
+
+    while (last > p && input_is_space(last[-1]))
+      last--;
+    if (last > p) // blank lines are skipped
+    {
+      struct import_row row;
+      int error = import_parse_row(p, last, city, &row);
+      row.line = part->lines;
+      if (error == PARSE_OK)
+      {
+        // timetables tend to list a city's flights together
+        if (last_id == CITY_NONE || strcmp(city, last_city) != 0)
+        {
+          last_id = city_intern(city);
+          strcpy(last_city, city);
+        }
+        row.city = last_id;
+        part->failed = !import_grow((void **)&part->rows, &part->size,
+                                    part->count, sizeof(row));
+        if (!part->failed)
+          part->rows[part->count++] = row;
+      }
+      else if (error == PARSE_QUIET)
+      {
+        part->skipped++;
+      }
+      else
+      {
+        part->failed = !import_grow((void **)&part->errors, &part->error_size,
+                                    part->error_count,
+                                    sizeof(struct import_error));
+        if (!part->failed)
+        {
+          part->errors[part->error_count].line = part->lines;
+          part->errors[part->error_count++].error = error;
+        }
+      }
+    }
+    p = end + 1;
+  }
+  return NULL;
+}
+
+static int import_line_compare(const void *a, const void *b)
+{
+  const struct import_row *x = a, *y = b;
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static int import_group_compare(const void *a, const void *b)
+{
+  const struct import_group *x = a, *y = b;
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+static int import_error_compare(const void *a, const void *b)
+{
+  const struct import_error *x = a, *y = b;
+  return x->line < y->line ? -1 : x->line > y->line;
+}
+
+// Keep the message for a row that booking refused
+static void import_refused(struct import_error *errors, size_t *error_count,
+                           uint32_t line, int status, city_id_t city)
+{
+  struct import_error *e = &errors[(*error_count)++];
+  e->line = line;
+  e->error = PARSE_OK;
+  e->status = status;
+  e->city = city;
+}
+
+// Add the n rows of one city, sorted by time then line, the first of which
+// is on the given line.  Rows that are refused go on errors.  Returns the
+// number of flights added.
+static long import_city(struct import_row *rows, size_t n, uint32_t line,
+                        long *cities, struct import_error *errors,
+                        size_t *error_count)
+{
+  city_id_t city = rows[0].city;
+  long added = 0;
+
+  int status = booking_add_schedule(city);
+  if (status != BOOKING_OK && status != BOOKING_EXISTS)
+  {
+    import_refused(errors, error_count, line, status, city);
+    return 0;
+  }
+  (*cities)++;
+
+  flight_schedules_read_lock();
+  struct flight_schedule *fs = flight_schedule_find(city);
+  pthread_rwlock_t *lock = flight_schedule_lock(fs, true);
+  if (fs->flight_count == 0 && flight_schedule_reserve_flights(fs, n))
+  {
+    pthread_rwlock_wrlock(&time_index.lock);
+    for (size_t i = 0; i < n; i++)
+    {
+      fs->times[i] = rows[i].time;
+      fs->available[i] = rows[i].capacity;
+      fs->capacity[i] = rows[i].capacity;
+      fs->waitlists[i] = 0;
+      fs->open_seats[i / 64] |= UINT64_C(1) << (i % 64);
+      fs->flight_count = i + 1;
+      if (!time_index_add(fs, i))
+      {
+        output_flush();
+        printf("ERROR: Out of memory importing the timetable.\n");
+        exit(EXIT_FAILURE);
+      }
+      journal_append('a', city, rows[i].time, rows[i].capacity);
+    }
+    pthread_rwlock_unlock(&time_index.lock);
+    pthread_rwlock_unlock(lock);
+    flight_schedules_unlock();
+    journal_commit_if_full();
+    return n;
+  }
+  pthread_rwlock_unlock(lock);
+  flight_schedules_unlock();
+
+  // the flights go in one at a time, in the order of the file
+  qsort(rows, n, sizeof(struct import_row), import_line_compare);
+  for (size_t i = 0; i < n; i++)
+  {
+    status = booking_add_flight(city, rows[i].time, rows[i].capacity);
+    if (status == BOOKING_OK)
+    {
+      added++;
+    }
+    else
+    {
+      import_refused(errors, error_count, rows[i].line, status, city);
+    }
+  }
+  return added;
+}
+
+static void import_fail(void)
+{
+  output_flush();
+  printf("ERROR: Out of memory importing the timetable.\n");
+  exit(EXIT_FAILURE);
+}
+
+// Load the timetable at path on top of the schedules there are.  Returns
+// false if it cannot be read.
+bool timetable_import(const char *path)
+{
+  struct import_part parts[IMPORT_THREADS_MAX];
+  pthread_t threads[IMPORT_THREADS_MAX];
+  bool started[IMPORT_THREADS_MAX] = {false};
+  struct stat st;
+  int fd = open(path, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    if (fd >= 0)
+      close(fd);
+    return false;
+  }
+  size_t bytes = st.st_size;
+  const char *map = bytes > 0 ? mmap(NULL, bytes, PROT_READ, MAP_PRIVATE, fd, 0)
+                              : NULL;
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+  if (bytes > 0)
+    madvise((void *)map, bytes, MADV_SEQUENTIAL);
+
+  // one part per CPU, each at least IMPORT_SPLIT_MIN bytes, ending on a
+  // line boundary
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  size_t count = bytes / IMPORT_SPLIT_MIN;
+  if (count > (size_t)cpus)
+    count = cpus;
+  if (count > IMPORT_THREADS_MAX)
+    count = IMPORT_THREADS_MAX;
+  if (count < 1)
+    count = 1;
+  memset(parts, 0, sizeof(parts));
+  const char *p = map;
+  for (size_t i = 0; i < count; i++)
+  {
+    const char *end = map + bytes / count * (i + 1);
+    if (i + 1 == count)
+      end = map + bytes;
+    if (end < p)
+      end = p;
+    const char *nl = memchr(end, '\n', map + bytes - end);
+    if (end < map + bytes)
+      end = nl != NULL ? nl + 1 : map + bytes;
+    parts[i].begin = p;
+    parts[i].end = end;
+    p = end;
+  }
+  for (size_t i = 1; i < count; i++)
+    started[i] = pthread_create(&threads[i], NULL, import_parse_part,
+                                &parts[i]) == 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (started[i])
+      pthread_join(threads[i], NULL);
+    else
+      import_parse_part(&parts[i]); // on this thread after all
+  }
+
+  // number the lines in the whole file; every valid row may yet be
+  // refused as well
+  long rows = 0, flights = 0, cities = 0;
+  size_t total = 0, error_count = 0;
+  uint32_t base = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    if (parts[i].failed)
+      import_fail();
+    total += parts[i].count;
+    error_count += parts[i].error_count;
+  }
+  struct import_error *errors = malloc((total + error_count + 1) *
+                                       sizeof(struct import_error));
+  if (errors == NULL)
+    import_fail();
+  error_count = 0;
+  for (size_t i = 0; i < count; i++)
+  {
+    for (size_t e = 0; e < parts[i].error_count; e++)
+    {
+      errors[error_count] = parts[i].errors[e];
+      errors[error_count++].line += base;
+    }
+    for (size_t r = 0; r < parts[i].count; r++)
+      parts[i].rows[r].line += base;
+    rows += parts[i].count + parts[i].error_count + parts[i].skipped;
+    base += parts[i].lines;
+  }
+
+  // Stable counting sort by time and then by city, which leaves each
+  // city's rows together in order of time and then line
+  size_t minutes = (size_t)calendar.days * MINUTES_PER_DAY;
+  int first = calendar_first();
+  size_t keys = city_table.count > minutes ? city_table.count : minutes;
+  size_t *starts = calloc(keys + 1, sizeof(size_t));
+  struct import_row *by_time = malloc((total + 1) * sizeof(struct import_row));
+  struct import_row *by_city = malloc((total + 1) * sizeof(struct import_row));
+  if (starts == NULL || by_time == NULL || by_city == NULL)
+    import_fail();
+  for (size_t i = 0; i < count; i++)
+    for (size_t r = 0; r < parts[i].count; r++)
+      starts[parts[i].rows[r].time - first + 1]++;
+  for (size_t k = 0; k < minutes; k++)
+    starts[k + 1] += starts[k];
+  for (size_t i = 0; i < count; i++)
+    for (size_t r = 0; r < parts[i].count; r++)
+      by_time[starts[parts[i].rows[r].time - first]++] = parts[i].rows[r];
+
+  memset(starts, 0, (keys + 1) * sizeof(size_t));
+  for (size_t r = 0; r < total; r++)
+    starts[by_time[r].city + 1]++;
+  for (size_t k = 0; k < city_table.count; k++)
+    starts[k + 1] += starts[k];
+  for (size_t r = 0; r < total; r++)
+    by_city[starts[by_time[r].city]++] = by_time[r];
+
+  // the cities in the order they first appear, as A would add them
+  struct import_group *groups = malloc((city_table.count + 1) *
+                                       sizeof(struct import_group));
+  size_t group_count = 0;
+  if (groups == NULL)
+    import_fail();
+  for (size_t r = 0, n; r < total; r += n)
+  {
+    struct import_group *g = &groups[group_count++];
+    g->line = by_city[r].line;
+    for (n = 1; r + n < total && by_city[r + n].city == by_city[r].city; n++)
+      g->line = by_city[r + n].line < g->line ? by_city[r + n].line : g->line;
+    g->start = r;
+    g->count = n;
+  }
+  qsort(groups, group_count, sizeof(struct import_group),
+        import_group_compare);
+  for (size_t i = 0; i < group_count; i++)
+    flights += import_city(by_city + groups[i].start, groups[i].count,
+                           groups[i].line, &cities, errors, &error_count);
+
+  // the rejected rows in file order; each has one message
+  qsort(errors, error_count, sizeof(struct import_error),
+        import_error_compare);
+  for (size_t e = 0; e < error_count; e++)
+  {
+    msg_import_line(errors[e].line);
+    if (errors[e].error == PARSE_OK)
+      msg_booking_status(errors[e].status, errors[e].city);
+    else
+      msg_parse_error(errors[e].error);
+  }
+  msg_import_done(flights, cities, rows);
+
+  free(errors);
+  free(groups);
+  free(by_city);
+  free(by_time);
+  free(starts);
+  for (size_t i = 0; i < count; i++)
+  {
+    free(parts[i].rows);
+    free(parts[i].errors);
+  }
+  if (bytes > 0)
+    munmap((void *)map, bytes);
+  return true;
+}
+
+/******************************************************************
+ * Replica (-m, -r)                                               *
+ * The writer mirrors every change into the segment while it      *
+ * still holds the locks that made it: a schedule added or        *
+ * removed under flight_schedules_lock for writing, a city's      *
+ * flights rewritten under its stripe for writing, a seat under   *
+ * its stripe for reading.  So no two threads write one slot at   *
+ * once and the slot's seq is a plain seqlock.  A reader is a     *
+ * separate process that never writes to the segment at all.     *
+ *****************************************************************/
+static void replica_fail(const char *what)
+{
+  output_flush();
+  printf("ERROR: Cannot %s the replica %s.\n", what, replica.name);
+  exit(EXIT_FAILURE);
+}
+
+static struct replica_flight *replica_flights(uint64_t offset)
+{
+  return (struct replica_flight *)(replica.base + offset);
+}
+
+// Start a change that readers must not see half done
+static void replica_seq_begin(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void replica_seq_end(uint32_t *seq)
+{
+  __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+// Wait for an even seq and return it
+static uint32_t replica_seq_read(uint32_t *seq)
+{
+  uint32_t v;
+  for (int tries = 1; (v = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1;
+       tries++)
+  {
+    if (tries % REPLICA_RETRIES == 0)
+      sched_yield(); // the writer may be off the CPU mid change
+  }
+  return v;
+}
+
+static bool replica_seq_retry(uint32_t *seq, uint32_t v)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(seq, __ATOMIC_RELAXED) != v;
+}
+
+// The writer stops mirroring for good once the segment is full; readers
+// see stale and give up rather than answer from an old state
+static void replica_stale(void)
+{
+  __atomic_store_n(&replica.header->stale, 1, __ATOMIC_RELEASE);
+}
+
+static bool replica_writing(void)
+{
+  return replica.base != NULL && !replica.reader &&
+         !__atomic_load_n(&replica.header->stale, __ATOMIC_RELAXED);
+}
+
+// Create the segment, replacing any left by an earlier writer, and mirror
+// the schedules there are so far
+void replica_open(const char *name)
+{
+  size_t slots = sizeof(struct replica_city) * REPLICA_CITIES;
+  size_t heap = (sizeof(struct replica_header) + slots + 63) & ~(size_t)63;
+  size_t bytes = heap + REPLICA_HEAP_BYTES;
+
+  replica.name = name;
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd >= 0)
+  {
+    // tell the readers of the old segment to come over to the new one
+    void *old = mmap(NULL, sizeof(struct replica_header),
+                     PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (old != MAP_FAILED)
+    {
+      __atomic_store_n(&((struct replica_header *)old)->retired, 1,
+                       __ATOMIC_RELEASE);
+      munmap(old, sizeof(struct replica_header));
+    }
+    close(fd);
+    shm_unlink(name);
+  }
+  fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+  struct stat st;
+  if (fd < 0 || ftruncate(fd, bytes) != 0 || fstat(fd, &st) != 0)
+    replica_fail("create");
+  replica.base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (replica.base == MAP_FAILED)
+    replica_fail("map");
+  replica.dev = st.st_dev;
+  replica.ino = st.st_ino;
+  atexit(replica_close);
+
+  replica.header = (struct replica_header *)replica.base;
+  replica.cities = (struct replica_city *)(replica.header + 1);
+  replica.heap_used = heap;
+  memcpy(replica.header->magic, REPLICA_MAGIC, sizeof(replica.header->magic));
+  replica.header->version = REPLICA_VERSION;
+  replica.header->byte_order = SNAPSHOT_BYTE_ORDER;
+  replica.header->bytes = bytes;
+  replica.header->heap = heap;
+  replica.header->city_slots = REPLICA_CITIES;
+  replica.header->days = calendar.days;
+  replica.header->first_day = time_index.first / MINUTES_PER_DAY;
+
+  flight_schedules_read_lock();
+  for (struct flight_schedule *fs = flight_schedules_active; fs != NULL;
+       fs = fs->next)
+  {
+    replica_schedule(fs->destination, true);
+    replica_publish(fs);
+  }
+  flight_schedules_unlock();
+}
+
+// At exit, tell the readers the segment is no longer kept up to date and
+// take its name away, unless a newer writer has already taken the name
+// over.  A reader then moves to the next writer's segment, or stops with
+// an error when there is none, rather than answer from this one.
+void replica_close(void)
+{
+  struct stat st;
+
+  __atomic_store_n(&replica.header->retired, 1, __ATOMIC_RELEASE);
+  int fd = shm_open(replica.name, O_RDONLY, 0);
+  if (fd < 0)
+    return;
+  if (fstat(fd, &st) == 0 && st.st_dev == replica.dev &&
+      st.st_ino == replica.ino)
+    shm_unlink(replica.name);
+  close(fd);
+}
+
+// A block for n flight records, or 0 when the heap is full
+static uint64_t replica_block_alloc(int n, uint32_t *class_out)
+{
+  uint32_t c = 0;
+  while ((FLIGHT_ARENA_MIN_BLOCK << c) < n)
+    c++;
+  size_t size = (size_t)(FLIGHT_ARENA_MIN_BLOCK << c) *
+                sizeof(struct replica_flight);
+  uint64_t block;
+
+  pthread_mutex_lock(&replica.lock);
+  block = replica.free_blocks[c];
+  if (block != 0)
+  {
+    replica.free_blocks[c] =
+        __atomic_load_n((uint64_t *)(replica.base + block), __ATOMIC_RELAXED);
+  }
+  else if (replica.heap_used + size <= replica.header->bytes)
+  {
+    block = replica.heap_used;
+    replica.heap_used += size;
+  }
+  pthread_mutex_unlock(&replica.lock);
+  *class_out = c;
+  return block;
+}
+
+// Readers may still be copying from a block that is freed; the seq of
+// its old city has moved on, so they will throw the copy away
+static void replica_block_free(uint64_t block, uint32_t c)
+{
+  pthread_mutex_lock(&replica.lock);
+  __atomic_store_n((uint64_t *)(replica.base + block), replica.free_blocks[c],
+                   __ATOMIC_RELAXED);
+  replica.free_blocks[c] = block;
+  pthread_mutex_unlock(&replica.lock);
+}
+
+// Mirror a schedule being added or removed.  Called with
+// flight_schedules_lock held for writing.
+void replica_schedule(city_id_t city, bool scheduled)
+{
+  struct replica_header *h = replica.header;
+
+  if (!replica_writing())
+    return;
+  if (city >= h->city_slots)
+  {
+    replica_stale();
+    return;
+  }
+  replica_seq_begin(&h->directory);
+  // name every slot up to this one so a reader can read names in order
+  for (uint32_t id = h->cities; id <= city; id++)
+  {
+    strcpy(replica.cities[id].name, city_name(id));
+    __atomic_store_n(&h->cities, id + 1, __ATOMIC_RELEASE);
+  }
+  struct replica_city *rc = &replica.cities[city];
+  replica_seq_begin(&rc->seq);
+  __atomic_store_n(&rc->scheduled, scheduled, __ATOMIC_RELAXED);
+  __atomic_store_n(&rc->flight_count, 0, __ATOMIC_RELAXED);
+  if (!scheduled && rc->flights != 0)
+  {
+    replica_block_free(rc->flights, rc->flight_class);
+    __atomic_store_n(&rc->flights, 0, __ATOMIC_RELAXED);
+  }
+  replica_seq_end(&rc->seq);
+  replica_seq_end(&h->directory);
+}
+
+// Mirror all of fs's flights after they were added to, removed or
+// loaded.  Called with fs's stripe held for writing.
+void replica_publish(struct flight_schedule *fs)
+{
+  if (!replica_writing())
+    return;
+  if (fs->destination >= replica.header->city_slots)
+  {
+    replica_stale();
+    return;
+  }
+  struct replica_city *rc = &replica.cities[fs->destination];
+  uint64_t old = rc->flights;
+  uint32_t old_class = rc->flight_class, c = old_class;
+  uint64_t block = old;
+
+  if (fs->flight_count > 0 &&
+      (old == 0 || (FLIGHT_ARENA_MIN_BLOCK << c) < fs->flight_count))
+  {
+    block = replica_block_alloc(fs->flight_count, &c);
+    if (block == 0)
+    {
+      replica_stale();
+      return;
+    }
+  }
+
+  replica_seq_begin(&rc->seq);
+  struct replica_flight *f = replica_flights(block);
+  for (int i = 0; i < fs->flight_count; i++)
+  {
+    __atomic_store_n(&f[i].time, fs->times[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&f[i].available, fs->available[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&f[i].capacity, fs->capacity[i], __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&rc->flights, block, __ATOMIC_RELAXED);
+  __atomic_store_n(&rc->flight_class, c, __ATOMIC_RELAXED);
+  __atomic_store_n(&rc->flight_count, fs->flight_count, __ATOMIC_RELAXED);
+  replica_seq_end(&rc->seq);
+  if (block != old && old != 0)
+    replica_block_free(old, old_class);
+}
+
+// Mirror a seat taken (delta -1) or given back (+1) on flight i.  Seats
+// change under a shared stripe, so the record is added to, not stored.
+void replica_seat(struct flight_schedule *fs, int i, int delta)
+{
+  if (!replica_writing() || fs->destination >= replica.header->city_slots)
+    return;
+  struct replica_city *rc = &replica.cities[fs->destination];
+  __atomic_fetch_add(&replica_flights(rc->flights)[i].available, delta,
+                     __ATOMIC_RELAXED);
+}
+// The writer tells its readers where D has moved the calendar to, and a
+// reader takes that over before it reads a command, so it reads the
+// times of the commands it turns away just as the writer would
+void replica_calendar(void)
+{
+  if (replica.base == NULL)
+    return;
+  if (replica.reader)
+  {
+    calendar.days = replica.header->days;
+    calendar.first_day =
+        __atomic_load_n(&replica.header->first_day, __ATOMIC_RELAXED);
+  }
+  else if (replica_writing())
+  {
+    __atomic_store_n(&replica.header->first_day,
+                     time_index.first / MINUTES_PER_DAY, __ATOMIC_RELAXED);
+  }
+}
+
+// Map the segment a writer made, read only.  Called again when the writer
+// has been replaced, which starts the local view over.
+void replica_attach(const char *name)
+{
+  struct stat st;
+
+  if (replica.base != NULL)
+    munmap(replica.base, replica.header->bytes);
+  replica.name = name;
+  replica.reader = true;
+  int fd = shm_open(name, O_RDONLY, 0);
+  if (fd < 0 || fstat(fd, &st) != 0 ||
+      (size_t)st.st_size < sizeof(struct replica_header))
+    replica_fail("open");
+  replica.base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (replica.base == MAP_FAILED)
+    replica_fail("map");
+  replica.header = (struct replica_header *)replica.base;
+  replica.cities = (struct replica_city *)(replica.header + 1);
+  if (memcmp(replica.header->magic, REPLICA_MAGIC, 8) != 0 ||
+      replica.header->version != REPLICA_VERSION ||
+      replica.header->byte_order != SNAPSHOT_BYTE_ORDER ||
+      replica.header->bytes != (uint64_t)st.st_size)
+    replica_fail("read");
+
+  for (city_id_t id = 0; id < city_table.count; id++)
+    city_entry(id)->replica = 0;
+  replica.known = 0;
+  replica.directory = 1; // odd, so the list is rebuilt
+}
+
+// Make sure the segment is current and every city it has named is known
+// here by name
+static void replica_sync(void)
+{
+  if (__atomic_load_n(&replica.header->retired, __ATOMIC_ACQUIRE))
+    replica_attach(replica.name);
+  if (__atomic_load_n(&replica.header->stale, __ATOMIC_ACQUIRE))
+  {
+    output_flush();
+    printf("ERROR: The replica %s is out of date.\n", replica.name);
+    exit(EXIT_FAILURE);
+  }
+  uint32_t cities = __atomic_load_n(&replica.header->cities, __ATOMIC_ACQUIRE);
+  for (; replica.known < cities; replica.known++)
+  {
+    city_t name;
+    memcpy(name, replica.cities[replica.known].name, sizeof(name) - 1);
+    name[sizeof(name) - 1] = '\0';
+    city_entry(city_intern(name))->replica = replica.known + 1;
+  }
+}
+
+// Copy out the flights of slot id, false when it has no schedule
+static bool replica_read_city(uint32_t id, uint32_t *count)
+{
+  struct replica_city *rc = &replica.cities[id];
+  uint32_t seq;
+  bool scheduled;
+
+  do
+  {
+    seq = replica_seq_read(&rc->seq);
+    scheduled = __atomic_load_n(&rc->scheduled, __ATOMIC_RELAXED);
+    uint64_t flights = __atomic_load_n(&rc->flights, __ATOMIC_RELAXED);
+    uint32_t n = __atomic_load_n(&rc->flight_count, __ATOMIC_RELAXED);
+    *count = 0;
+    // a torn read may point anywhere; seq says so once it is checked
+    if (n > MAX_FLIGHTS_PER_CITY || flights < replica.header->heap ||
+        flights + (uint64_t)n * sizeof(struct replica_flight) >
+            replica.header->bytes)
+      continue;
+    if (n > replica.copy_size)
+    {
+      free(replica.copy);
+      replica.copy = malloc(n * sizeof(struct replica_flight));
+      if (replica.copy == NULL)
+      {
+        output_flush();
+        printf("ERROR: Out of memory reading the replica.\n");
+        exit(EXIT_FAILURE);
+      }
+      replica.copy_size = n;
+    }
+    struct replica_flight *f = replica_flights(flights);
+    for (uint32_t i = 0; i < n; i++)
+    {
+      replica.copy[i].time = __atomic_load_n(&f[i].time, __ATOMIC_RELAXED);
+      replica.copy[i].available =
+          __atomic_load_n(&f[i].available, __ATOMIC_RELAXED);
+      replica.copy[i].capacity =
+          __atomic_load_n(&f[i].capacity, __ATOMIC_RELAXED);
+    }
+    *count = n;
+  } while (replica_seq_retry(&rc->seq, seq));
+  return scheduled;
+}
+
+static int replica_name_compare(const void *a, const void *b)
+{
+  return strcmp(replica.cities[*(const uint32_t *)a].name,
+                replica.cities[*(const uint32_t *)b].name);
+}
+
+// Bring the sorted list of cities with a schedule up to date
+static void replica_list_cities(void)
+{
+  uint32_t directory, cities;
+
+  if (__atomic_load_n(&replica.header->directory, __ATOMIC_ACQUIRE) ==
+      replica.directory)
+    return;
+  do
+  {
+    directory = replica_seq_read(&replica.header->directory);
+    cities = __atomic_load_n(&replica.header->cities, __ATOMIC_ACQUIRE);
+    free(replica.sorted);
+    replica.sorted = malloc((cities + 1) * sizeof(uint32_t));
+    if (replica.sorted == NULL)
+    {
+      output_flush();
+      printf("ERROR: Out of memory reading the replica.\n");
+      exit(EXIT_FAILURE);
+    }
+    replica.sorted_count = 0;
+    for (uint32_t id = 0; id < cities; id++)
+    {
+      if (__atomic_load_n(&replica.cities[id].scheduled, __ATOMIC_RELAXED))
+        replica.sorted[replica.sorted_count++] = id;
+    }
+  } while (replica_seq_retry(&replica.header->directory, directory));
+  qsort(replica.sorted, replica.sorted_count, sizeof(uint32_t),
+        replica_name_compare);
+  replica.directory = directory;
+}
+
+static void replica_print_cities(uint32_t from, uint32_t count,
+                                 const char *prefix)
+{
+  size_t len = strlen(prefix);
+
+  if (len > 0)
+  {
+    // first name not below the prefix
+    uint32_t lo = 0, hi = replica.sorted_count;
+    while (lo < hi)
+    {
+      uint32_t mid = lo + (hi - lo) / 2;
+      if (strcmp(replica.cities[replica.sorted[mid]].name, prefix) < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    from = lo;
+  }
+  for (uint32_t i = from; i < replica.sorted_count && count > 0; i++, count--)
+  {
+    const char *name = replica.cities[replica.sorted[i]].name;
+    if (strncmp(name, prefix, len) != 0)
+      return;
+    output_str(name);
+    output_char('\n');
+  }
+}
+
+static void replica_list_flights(city_id_t city)
+{
+  uint32_t count;
+
+  city_id_t id = city_entry(city)->replica;
+  if (id == 0 || !replica_read_city(id - 1, &count))
+  {
+    msg_city_bad(city_name(city));
+    return;
+  }
+  msg_city_flights(city_name(city));
+  for (uint32_t i = 0; i < count; i++)
+    msg_flight_info(replica.copy[i].time, replica.copy[i].available,
+                    replica.copy[i].capacity);
+  output_char('\n');
+}
+
+// Whether the city has a schedule at the moment, to read a command's
+// arguments exactly as the writer would
+static bool replica_has_schedule(city_id_t city)
+{
+  uint32_t count;
+
+  city_id_t id = city_entry(city)->replica;
+  return id != 0 && replica_read_city(id - 1, &count);
+}
+
+// Read a city as city_read does, once every name the writer has added is
+// known here
+static city_id_t replica_city_read(void)
+{
+  city_t city;
+
+  city_read_name(city);
+  replica_sync();
+  return city_find(city);
+}
+
+// Run one command against the replica.  Changes are refused, after their
+// arguments are read just as command_run would read them.  Returns false
+// for q.
+bool replica_run(char command)
+{
+  city_id_t city;
+  city_t prefix;
+  int x, y;
+
+  replica_calendar();
+  switch (command)
+  {
+  case 'L':
+    replica_sync();
+    replica_list_cities();
+    replica_print_cities(0, UINT32_MAX, "");
+    break;
+  case 'p':
+    city_read_name(prefix);
+    replica_sync();
+    replica_list_cities();
+    replica_print_cities(0, UINT32_MAX, prefix);
+    break;
+  case 'P':
+    if (msg_parse_error(page_read(&x, &y)))
+    {
+      replica_sync();
+      replica_list_cities();
+      replica_print_cities(x, y, "");
+    }
+    break;
+  case 'l':
+    replica_list_flights(replica_city_read());
+    break;
+  case 'a':
+  case 'r':
+  case 's':
+  case 'u':
+  case 'b':
+  case 'f':
+  case 'Q':
+    city = replica_city_read();
+    if (replica_has_schedule(city) && time_read(&x) == PARSE_OK)
+    {
+      if (command == 'a')
+        flight_capacity_read(&y);
+      else if (command == 'b' || command == 'f')
+        seats_read(&y);
+    }
+    msg_replica_read_only();
+    break;
+  case 'B':
+    batch_read(&batch.tuples, &batch.size, &x);
+    msg_replica_read_only();
+    break;
+  case 'c':
+    if (replica_has_schedule(replica_city_read()))
+      ticket_read(&x);
+    msg_replica_read_only();
+    break;
+  case 'A':
+  case 'R':
+  case 'F':
+  case 'X':
+    city_read_name(prefix);
+    msg_replica_read_only();
+    break;
+  case 'n':
+    time_read(&x);
+    msg_replica_read_only();
+    break;
+  case 'w':
+  case 'W':
+    window_read(&x, &y);
+    msg_replica_read_only();
+    break;
+  case 'D':
+    days_read(&x);
+    msg_replica_read_only();
+    break;
+  case 'S':
+  case 'T':
+    msg_replica_read_only();
+    break;
+  case 'h':
+    print_command_help();
+    break;
+  case 'q':
+    return false;
+  default:
+    msg_command_bad();
+  }
+  return true;
+}
+
+/******************************************************************
+ * Server (-u, -p)                                                *
+ * One thread runs an epoll loop over the listening socket and    *
+ * every client.  A client's bytes are fed to the same parser and *
+ * command_run as standard input.  When a command runs past the   *
+ * end of what has arrived, input_fill jumps back to server_run,  *
+ * which drops the partial command and tries it again when more   *
+ * arrives.  Every command reads all of its arguments before it   *
+ * changes or prints anything, so nothing has to be undone.       *
+ *****************************************************************/
+static void server_signal(int sig)
+{
+  (void)sig;
+  server_stop = 1;
+}
+
+// Listen on the Unix socket path, or on port of the loopback address when
+// path is NULL
+void server_listen(const char *path, int port)
+{
+  struct sigaction sa;
+  struct stat st;
+  int fd;
+  bool ok;
+
+  if (path != NULL)
+  {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+      printf("ERROR: Socket path %s is too long.\n", path);
+      exit(EXIT_FAILURE);
+    }
+    strcpy(addr.sun_path, path);
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path); // left behind by an earlier run
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ok = fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    server.path = path;
+  }
+  else
+  {
+    struct sockaddr_in addr;
+    int one = 1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    ok = fd >= 0 &&
+         setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == 0 &&
+         bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+  }
+
+  struct epoll_event ev = {EPOLLIN, {.ptr = NULL}}; // NULL marks the listener
+  server.listen_fd = fd;
+  server.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (!ok || listen(fd, SERVER_BACKLOG) != 0 || server.epoll_fd < 0 ||
+      epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+  {
+    if (path != NULL)
+      printf("ERROR: Cannot listen on %s.\n", path);
+    else
+      printf("ERROR: Cannot listen on port %d.\n", port);
+    exit(EXIT_FAILURE);
+  }
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = server_signal; // no SA_RESTART: wake up epoll_wait
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+}
+
+// Append n bytes of replies to c's queue
+void server_queue(struct server_client *c, const char *s, size_t n)
+{
+  if (c->out_size - c->out_len < n)
+  {
+    size_t size = c->out_size > 0 ? c->out_size : OUTPUT_CHUNK_SIZE;
+    while (size - c->out_len < n)
+      size *= 2;
+    char *out = realloc(c->out, size);
+    if (out == NULL)
+      return; // nowhere to put it, drop it
+    c->out = out;
+    c->out_size = size;
+  }
+  memcpy(c->out + c->out_len, s, n);
+  c->out_len += n;
+}
+
+static void server_accept(void)
+{
+  int fd;
+
+  while ((fd = accept4(server.listen_fd, NULL, NULL,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0)
+  {
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)); // fails harmlessly on a Unix socket
+
+    struct server_client *c = calloc(1, sizeof(*c));
+    struct epoll_event ev = {EPOLLIN, {.ptr = c}};
+    if (c == NULL || epoll_ctl(server.epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    {
+      free(c);
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    c->events = EPOLLIN;
+  }
+}
+
+static void server_close(struct server_client *c)
+{
+  waitlist_forget(c);
+  feed_close(c->feed);
+  close(c->fd); // which also takes it out of the epoll set
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+// Read one block of whatever c has sent; false if the connection failed
+static bool server_read(struct server_client *c)
+{
+  if (c->in_size - c->in_len < SERVER_READ_SIZE)
+  {
+    char *in = realloc(c->in, c->in_len + SERVER_READ_SIZE);
+    if (in == NULL)
+      return false;
+    c->in = in;
+    c->in_size = c->in_len + SERVER_READ_SIZE;
+  }
+
+  ssize_t got = read(c->fd, c->in + c->in_len, c->in_size - c->in_len);
+  if (got > 0)
+    c->in_len += got;
+  else if (got == 0)
+    c->eof = true;
+  else
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+  return true;
+}
+
+// Queue their deltas for the subscribers on the ready list, as far as
+// each has room for them.  One that is behind stays on the list and gets
+// the rest once it has read some of its replies.
+static void server_feed(void)
+{
+  struct server_client *self = output.client;
+
+  pthread_mutex_lock(&feed.lock);
+  struct feed_subscriber *s = feed.ready;
+  feed.ready = NULL;
+  pthread_mutex_unlock(&feed.lock);
+  output_flush(); // self's replies come first
+  while (s != NULL)
+  {
+    struct feed_subscriber *next = s->ready_next;
+    output.client = s->client;
+    msg_feed(s);
+    output_flush();
+    output.client = self;
+    server_watch(s->client);
+    pthread_mutex_lock(&feed.lock);
+    s->ready = s->head != s->tail;
+    if (s->ready)
+    {
+      s->ready_next = feed.ready;
+      feed.ready = s;
+    }
+    pthread_mutex_unlock(&feed.lock);
+    s = next;
+  }
+}
+
+// Run every complete command c has sent and queue the replies.  Once c
+// has shut down its side, a command at the very end runs with whatever
+// it has, just as at the end of standard input.
+static void server_run(struct server_client *c)
+{
+  char command;
+
+  input.buf = c->in;
+  input.len = c->in_len;
+  input.pos = 0;
+  input.eof = c->eof;
+  input.starved = &server.starved;
+  output.client = c;
+  while (!c->quit)
+  {
+    volatile size_t start = input.pos; // kept across the longjmp
+    volatile size_t mark = output_mark();
+    if (setjmp(server.starved) != 0)
+    {
+      input.pos = start;
+      output_truncate(mark);
+      break;
+    }
+    if (!input_command(&command))
+      break;
+    if (!command_run(command))
+      c->quit = true;
+    if (feed.ready != NULL)
+      server_feed(); // deltas the command made, after its reply
+  }
+  output_flush();
+  output.client = NULL;
+  input.starved = NULL;
+
+  memmove(c->in, c->in + input.pos, c->in_len - input.pos);
+  c->in_len -= input.pos;
+  input.buf = NULL;
+  input.len = input.pos = 0;
+
+  // what is left is read again from the start each time more arrives, so
+  // a client that never finishes a command is sent its replies and closed
+  if (c->in_len > SERVER_COMMAND_MAX)
+  {
+    c->in_len = 0;
+    c->quit = true;
+  }
+}
+
+// Send as many queued replies as c will take; false if the connection
+// failed
+static bool server_send(struct server_client *c)
+{
+  while (c->out_sent < c->out_len)
+  {
+    ssize_t put = send(c->fd, c->out + c->out_sent, c->out_len - c->out_sent,
+                       MSG_NOSIGNAL);
+    if (put < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        break;
+      return false;
+    }
+    c->out_sent += put;
+  }
+  if (c->out_sent == c->out_len)
+    c->out_sent = c->out_len = 0;
+  return true;
+}
+
+static void server_event(struct server_client *c, uint32_t events)
+{
+  bool ok = true;
+
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->eof && !c->quit)
+  {
+    ok = server_read(c);
+    if (ok)
+      server_run(c);
+  }
+  if (ok)
+    ok = server_send(c);
+
+  // a client that has shut down its side but is waiting in line for a
+  // seat, or follows a city, stays connected to hear about it
+  bool done = c->quit || (c->eof && c->waiters == 0 &&
+                          (c->feed == NULL || c->feed->links == NULL));
+  if (!ok || (done && c->out_len == c->out_sent))
+  {
+    server_close(c);
+    return;
+  }
+  server_watch(c);
+}
+
+// Have epoll watch c for what it needs now, as after its own commands or
+// once another client's command has queued a waitlist notice or deltas
+// for it
+void server_watch(struct server_client *c)
+{
+  size_t unsent = c->out_len - c->out_sent;
+
+  // stop reading from a client that is not reading its replies
+  uint32_t want = 0;
+  if (!c->eof && !c->quit && unsent < SERVER_OUTPUT_MAX)
+    want |= EPOLLIN;
+  if (unsent > 0)
+    want |= EPOLLOUT;
+  if (want != c->events)
+  {
+    struct epoll_event ev = {want, {.ptr = c}};
+    epoll_ctl(server.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = want;
+  }
+}
+
+// Serve clients until SIGINT or SIGTERM
+void server_loop(void)
+{
+  struct epoll_event events[SERVER_EVENTS];
+
+  while (!server_stop)
+  {
+    // wake up in time to commit journal records nobody is waiting on
+    long due = journal_commit_if_due();
+    int timeout = due > 0 ? (int)((due + 999) / 1000) : -1;
+
+    int n = epoll_wait(server.epoll_fd, events, SERVER_EVENTS, timeout);
+    STATS_POLL();
+    for (int i = 0; i < n; i++)
+    {
+      if (events[i].data.ptr == NULL)
+        server_accept();
+      else
+        server_event(events[i].data.ptr, events[i].events);
+    }
+    if (feed.ready != NULL)
+      server_feed(); // for subscribers that have caught up a little
+  }
+}
+
+void server_shutdown(void)
+{
+  close(server.listen_fd);
+  if (server.path != NULL)
+    unlink(server.path);
+}
+
+/******************************************************************
+ * Pipelined mode (-P)                                            *
+ * The parser (the main thread), an executor and a formatter each *
+ * take commands in turn, connected by two rings: command records *
+ * from the parser to the executor and result records from it to  *
+ * the formatter.  Reading and formatting overlap with changing   *
+ * the schedules, and every stage keeps the commands in order, so *
+ * the output is the same as without -P.                          *
+ * Whether a r s u read a time depends on whether the city has a  *
+ * schedule.  Rather than wait for the executor to catch up, the  *
+ * parser keeps its own answer in the city table, set by every A  *
+ * and cleared by every R it parses.  An A can only fail to give  *
+ * its city a schedule by running out of memory, which ends the   *
+ * program here.                                                  *
+ *****************************************************************/
+void ring_init(struct ring *r, size_t size, size_t records)
+{
+  pthread_condattr_t attr;
+
+  r->slots = malloc(size * records);
+  if (r->slots == NULL)
+  {
+    printf("ERROR: Out of memory allocating the pipeline.\n");
+    exit(EXIT_FAILURE);
+  }
+  r->head = r->tail_seen = r->tail = r->head_seen = 0;
+  r->mask = records - 1;
+  r->size = size;
+  r->yield = sysconf(_SC_NPROCESSORS_ONLN) < 2;
+  r->spins = r->yield ? PIPELINE_YIELDS : PIPELINE_SPINS;
+  r->sleeping = 0;
+  pthread_mutex_init(&r->lock, NULL);
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&r->wake, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// One look at a ring that was full or empty: spin for a while, then sleep
+// until *index moves off value.  Before sleeping the consumer's idle
+// function runs; it returns how many microseconds to sleep at most, or a
+// value of 0 or less to sleep until woken.
+static void ring_idle(struct ring *r, size_t *index, size_t value, int *spins,
+                      long (*idle)(void))
+{
+  if (++*spins < r->spins)
+  {
+    if (r->yield)
+      sched_yield();
+#if defined(__x86_64__) || defined(__i386__)
+    else
+      _mm_pause();
+#endif
+    return;
+  }
+  *spins = 0;
+  long usec = idle != NULL ? idle() : 0;
+
+  pthread_mutex_lock(&r->lock);
+  __atomic_add_fetch(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(index, __ATOMIC_SEQ_CST) == value)
+  {
+    if (usec > 0)
+    {
+      struct timespec until;
+      clock_gettime(CLOCK_MONOTONIC, &until);
+      until.tv_sec += usec / 1000000;
+      until.tv_nsec += usec % 1000000 * 1000;
+      if (until.tv_nsec >= 1000000000)
+      {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&r->wake, &r->lock, &until);
+    }
+    else
+    {
+      pthread_cond_wait(&r->wake, &r->lock);
+    }
+  }
+  __atomic_sub_fetch(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&r->lock);
+}
+
+// Wake the other side if it is asleep.  The index was stored sequentially
+// consistent, so either the sleeper sees it or we see the sleeper.
+static void ring_notify(struct ring *r)
+{
+  if (__atomic_load_n(&r->sleeping, __ATOMIC_SEQ_CST) > 0)
+  {
+    pthread_mutex_lock(&r->lock);
+    pthread_cond_broadcast(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+  }
+}
+
+// Producer: the slot for the next record, waiting while the ring is full
+void *ring_claim(struct ring *r)
+{
+  int spins = 0;
+
+  while (r->head - r->tail_seen > r->mask)
+  {
+    r->tail_seen = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (r->head - r->tail_seen > r->mask)
+      ring_idle(r, &r->tail, r->tail_seen, &spins, NULL);
+  }
+  return r->slots + (r->head & r->mask) * r->size;
+}
+
+// Producer: hand the claimed record to the consumer
+void ring_publish(struct ring *r)
+{
+  __atomic_store_n(&r->head, r->head + 1, __ATOMIC_SEQ_CST);
+  ring_notify(r);
+}
+
+// Consumer: the oldest record, waiting while the ring is empty
+void *ring_next(struct ring *r, long (*idle)(void))
+{
+  int spins = 0;
+
+  while (r->head_seen == r->tail)
+  {
+    r->head_seen = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    if (r->head_seen == r->tail)
+      ring_idle(r, &r->head, r->tail, &spins, idle);
+  }
+  return r->slots + (r->tail & r->mask) * r->size;
+}
+
+// Consumer: give the oldest record's slot back to the producer
+void ring_release(struct ring *r)
+{
+  __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_SEQ_CST);
+  ring_notify(r);
+}
+
+// Read one command into cmd, consuming exactly what command_run would
+static void pipeline_parse(struct command_record *cmd)
+{
+  char command;
+
+  cmd->error = PARSE_OK;
+  cmd->eof = !input_command(&command);
+  if (cmd->eof)
+    return;
+  cmd->command = command;
+  switch (command)
+  {
+  case 'A':
+  case 'R':
+    cmd->city = command == 'A' ? city_read_intern() : city_read();
+    city_entry(cmd->city)->scheduled = command == 'A';
+    break;
+  case 'F':
+    cmd->city = city_read_intern();
+    break;
+  case 'l':
+  case 'X':
+    cmd->city = city_read();
+    break;
+  case 'a':
+  case 'r':
+  case 's':
+  case 'u':
+  case 'b':
+  case 'f':
+  case 'Q':
+  case 'c':
+    cmd->city = city_read();
+    if (!city_entry(cmd->city)->scheduled)
+      cmd->error = PARSE_NO_SCHEDULE;
+    else if (command == 'c')
+      cmd->error = ticket_read(&cmd->args[0]);
+    else if ((cmd->error = time_read(&cmd->args[0])) != PARSE_OK)
+      break;
+    else if (command == 'a')
+      cmd->error = flight_capacity_read(&cmd->args[1]);
+    else if (command == 'b' || command == 'f')
+      cmd->error = seats_read(&cmd->args[1]);
+    break;
+  case 'B':
+  {
+    int size = 0;
+    cmd->batch = NULL; // the record owns the tuples from here on
+    cmd->error = batch_read(&cmd->batch, &size, &cmd->args[0]);
+    break;
+  }
+  case 'n':
+    cmd->error = time_read(&cmd->args[0]);
+    break;
+  case 'w':
+  case 'W':
+    cmd->error = window_read(&cmd->args[0], &cmd->args[1]);
+    break;
+  case 'D':
+    // the times of the commands after it are read in the new days
+    cmd->error = days_read(&cmd->args[0]);
+    if (cmd->error == PARSE_OK)
+      calendar.first_day += cmd->args[0];
+    break;
+  case 'p':
+    city_read_name(cmd->prefix);
+    break;
+  case 'P':
+    cmd->error = page_read(&cmd->args[0], &cmd->args[1]);
+    break;
+  }
+  if (cmd->city == CITY_NONE && strchr("RlXarsubfQc", command) != NULL)
+    strcpy(cmd->prefix, city_name(CITY_NONE)); // for the executor to print
+}
+
+// Hand what the executor has printed since the last call to the formatter
+static void pipeline_capture(struct result_record *res)
+{
+  struct server_client *c = &pipeline.captured;
+
+  output_flush();
+  res->kind = RESULT_TEXT;
+  res->text = c->out;
+  res->len = c->out_len;
+  c->out = NULL;
+  c->out_len = c->out_size = 0;
+}
+
+// A name not in the table is only held here, in city_entry(CITY_NONE), so
+// the reply that names it is printed here rather than by the formatter
+static void pipeline_missing(struct result_record *res)
+{
+  if (res->city == CITY_NONE && res->status == BOOKING_NO_SCHEDULE &&
+      (res->kind == RESULT_STATUS || res->kind == RESULT_FLIGHTS))
+  {
+    result_print(res);
+    pipeline_capture(res);
+  }
+}
+
+// Carry out cmd, describing the reply in res
+static void pipeline_run(const struct command_record *cmd,
+                         struct result_record *res)
+{
+  const int *args = cmd->args;
+  int count;
+
+  res->kind = RESULT_STATUS;
+  res->status = BOOKING_OK;
+  res->city = cmd->city;
+  if (cmd->eof)
+    return;
+  if (cmd->city == CITY_NONE)
+    strcpy(city_missing.name, cmd->prefix);
+  if (cmd->error == PARSE_NO_SCHEDULE)
+  {
+    res->status = BOOKING_NO_SCHEDULE;
+    pipeline_missing(res);
+    return;
+  }
+  if (cmd->error != PARSE_OK)
+  {
+    res->kind = RESULT_PARSE;
+    res->status = cmd->error;
+    return;
+  }
+
+  switch (cmd->command)
+  {
+  case 'A':
+    res->status = booking_add_schedule(cmd->city);
+    break;
+  case 'R':
+    res->status = booking_remove_schedule(cmd->city);
+    break;
+  case 'l':
+    res->kind = RESULT_FLIGHTS;
+    res->status = booking_list_flights(cmd->city, &res->flights, &count);
+    res->count = count;
+    break;
+  case 'a':
+    res->status = booking_add_flight(cmd->city, args[0], args[1]);
+    break;
+  case 'r':
+    res->status = booking_remove_flight(cmd->city, args[0]);
+    break;
+  case 's':
+    res->status = booking_schedule_seat(cmd->city, args[0]);
+    break;
+  case 'u':
+    res->status = booking_unschedule_seat(cmd->city, args[0]);
+    break;
+  case 'b':
+    res->status = booking_book_seats(cmd->city, args[0], args[1]);
+    break;
+  case 'f':
+    res->status = booking_free_seats(cmd->city, args[0], args[1]);
+    break;
+  case 'B':
+    booking_batch(cmd->batch, args[0]);
+    res->kind = RESULT_BATCH;
+    res->batch = cmd->batch;
+    res->count = args[0];
+    break;
+  case 'Q':
+    // waiters here have nobody but the formatter to tell
+    res->status = booking_queue_seat(cmd->city, args[0], NULL, &res->args[0],
+                                     &res->args[1]);
+    if (res->status == BOOKING_WAITLISTED)
+      res->kind = RESULT_TICKET;
+    break;
+  case 'c':
+    res->status = booking_cancel(cmd->city, args[0]);
+    break;
+  case 'F':
+  case 'X':
+    flight_schedule_subscribe(cmd->city, cmd->command == 'F');
+    break;
+  case 'n':
+    res->status = booking_next_departure(args[0], &res->city, &res->args[0],
+                                         &res->args[1], &res->args[2]);
+    if (res->status == BOOKING_OK)
+      res->kind = RESULT_NEXT;
+    break;
+  case 'w':
+    flight_schedule_print_window(args[0], args[1]);
+    pipeline_capture(res);
+    break;
+  case 'W':
+    flight_schedules_read_lock();
+    res->count = time_index_count(args[0], args[1]);
+    flight_schedules_unlock();
+    res->kind = RESULT_COUNT;
+    res->args[0] = args[0];
+    res->args[1] = args[1];
+    break;
+  case 'D':
+    res->kind = RESULT_ROLL;
+    res->status = booking_roll_forward(args[0], &res->count, &res->args[0],
+                                       &res->args[1]);
+    break;
+  case 'L':
+    flight_schedule_listAll();
+    pipeline_capture(res);
+    break;
+  case 'p':
+    flight_schedule_print_prefix(cmd->prefix);
+    pipeline_capture(res);
+    break;
+  case 'P':
+    flight_schedule_print_page(args[0], args[1]);
+    pipeline_capture(res);
+    break;
+  case 'S':
+    if (options.snapshot_path == NULL ||
+        !snapshot_checkpoint(options.snapshot_path))
+      msg_snapshot_failed();
+    pipeline_capture(res);
+    break;
+  case 'q':
+    if (options.snapshot_path != NULL &&
+        !snapshot_checkpoint(options.snapshot_path))
+      msg_snapshot_failed();
+    pipeline_capture(res);
+    break;
+  case 'T':
+    stats_print();
+    pipeline_capture(res);
+    break;
+  case 'h':
+    res->kind = RESULT_HELP;
+    break;
+  default:
+    res->kind = RESULT_BAD;
+  }
+  // the parser only reads on past the city of a r s u b f Q c when it has
+  // a schedule
+  assert(res->status != BOOKING_NO_SCHEDULE ||
+         strchr("arsubfQc", cmd->command) == NULL);
+
+  pipeline_missing(res);
+
+  // waiters the command seated or dropped hear of it after its reply, and
+  // then the session of its changes to the cities it follows.  A batch or
+  // a D keeps its reply, which -N merges, and carries them in text.
+  if (waitlist_notices.count > 0 || feed_waiting(feed.session))
+  {
+    char kind = res->kind;
+    if (kind != RESULT_BATCH && kind != RESULT_ROLL)
+      result_print(res);
+    msg_waitlist_notices();
+    if (feed_waiting(feed.session))
+      msg_feed(feed.session);
+    pipeline_capture(res);
+    if (kind == RESULT_BATCH || kind == RESULT_ROLL)
+      res->kind = kind;
+  }
+}
+
+// True when the formatter would print nothing for res
+static bool pipeline_silent(const struct result_record *res)
+{
+  switch (res->kind)
+  {
+  case RESULT_STATUS:
+    return res->status == BOOKING_OK || res->status == BOOKING_NOTHING;
+  case RESULT_PARSE:
+    return res->status == PARSE_QUIET;
+  case RESULT_TEXT:
+    return res->len == 0;
+  default:
+    return false;
+  }
+}
+
+static void pipeline_send(const struct result_record *res)
+{
+  *(struct result_record *)ring_claim(&pipeline.results) = *res;
+  ring_publish(&pipeline.results);
+}
+
+// Nothing to run: commit the journal as input_fill does before it waits
+static long pipeline_execute_idle(void)
+{
+  return journal_commit_if_due();
+}
+
+static void *pipeline_execute(void *unused)
+{
+  struct command_record cmd;
+  struct result_record res;
+  bool more = true;
+
+  (void)unused;
+  output.client = &pipeline.captured;
+  while (more)
+  {
+    cmd = *(struct command_record *)ring_next(&pipeline.commands,
+                                              pipeline_execute_idle);
+    ring_release(&pipeline.commands);
+
+    uint64_t started = options.timed ? bench_now() : 0;
+    memset(&res, 0, sizeof(res));
+    pipeline_run(&cmd, &res);
+    more = !cmd.eof && cmd.command != 'q';
+    if (more && options.timed)
+    {
+      uint64_t ns = bench_now() - started;
+      if (options.bench)
+        bench_record(cmd.command, ns);
+      STATS_COMMAND(cmd.command, ns);
+    }
+    if (!pipeline_silent(&res))
+      pipeline_send(&res);
+
+    // only an A that ran out of memory fails with BOOKING_NO_FREE, and the
+    // parser has already read on as though it had worked
+    bool failed = res.kind == RESULT_STATUS && res.status == BOOKING_NO_FREE;
+    if (failed || !more)
+    {
+      if (failed)
+        journal_commit();
+      memset(&res, 0, sizeof(res));
+      res.kind = failed ? RESULT_FAIL : RESULT_END;
+      pipeline_send(&res);
+      more = false;
+    }
+  }
+  output_close();
+  free(pipeline.captured.out);
+  free(waitlist_notices.items);
+  return NULL;
+}
+
+// Nothing to print: send what has been formatted
+static long pipeline_format_idle(void)
+{
+  output_flush();
+  return 0;
+}
+
+// Print the reply res describes, freeing what it carries
+void result_print(struct result_record *res)
+{
+  switch (res->kind)
+  {
+  case RESULT_STATUS:
+    msg_booking_status(res->status, res->city);
+    break;
+  case RESULT_PARSE:
+    msg_parse_error(res->status);
+    break;
+  case RESULT_FLIGHTS:
+    if (res->status != BOOKING_OK)
+    {
+      msg_booking_status(res->status, res->city);
+      break;
+    }
+    msg_city_flights(city_name(res->city));
+    for (long i = 0; i < res->count; i++)
+      msg_flight_info(res->flights[3 * i], res->flights[3 * i + 1],
+                      res->flights[3 * i + 2]);
+    output_char('\n');
+    free(res->flights);
+    break;
+  case RESULT_NEXT:
+    msg_next_departure(city_name(res->city));
+    msg_flight_info(res->args[0], res->args[1], res->args[2]);
+    output_char('\n');
+    break;
+  case RESULT_COUNT:
+    msg_window_count(res->args[0], res->args[1], res->count);
+    break;
+  case RESULT_BATCH:
+    msg_batch(res->batch, res->count);
+    output_write(res->text, res->len); // any waitlist notices and deltas
+    free(res->batch);
+    free(res->text);
+    break;
+  case RESULT_TICKET:
+    msg_waitlisted(res->args[0], res->args[1]);
+    break;
+  case RESULT_ROLL:
+    msg_roll_forward(res->count, res->args[0], res->args[1]);
+    output_write(res->text, res->len); // any waitlist notices and deltas
+    free(res->text);
+    break;
+  case RESULT_TEXT:
+    output_write(res->text, res->len);
+    free(res->text);
+    break;
+  case RESULT_HELP:
+    print_command_help();
+    break;
+  case RESULT_BAD:
+    msg_command_bad();
+    break;
+  case RESULT_FAIL:
+    output_flush();
+    printf("ERROR: Out of memory adding a schedule.\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void *pipeline_format(void *unused)
+{
+  (void)unused;
+  while (true)
+  {
+    struct result_record *res = ring_next(&pipeline.results,
+                                          pipeline_format_idle);
+    if (res->kind == RESULT_END)
+    {
+      ring_release(&pipeline.results);
+      output_close();
+      return NULL;
+    }
+    result_print(res);
+    ring_release(&pipeline.results);
+  }
+}
+
+// Parse the commands on this thread while one more runs them and another
+// prints the replies, until q or the end of the input
+void pipeline_loop(void)
+{
+  pthread_t executor, formatter;
+  bool last;
+
+  ring_init(&pipeline.commands, sizeof(struct command_record),
+            PIPELINE_RING_RECORDS);
+  ring_init(&pipeline.results, sizeof(struct result_record),
+            PIPELINE_RING_RECORDS);
+  // the schedules loaded from a snapshot or the journal
+  for (struct flight_schedule *fs = flight_schedules_active; fs != NULL;
+       fs = fs->next)
+    city_entry(fs->destination)->scheduled = true;
+  output_flush(); // the help comes before anything the formatter prints
+  if (pthread_create(&executor, NULL, pipeline_execute, NULL) != 0 ||
+      pthread_create(&formatter, NULL, pipeline_format, NULL) != 0)
+  {
+    printf("ERROR: Cannot start the pipeline threads.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  do
+  {
+    struct command_record *cmd = ring_claim(&pipeline.commands);
+    pipeline_parse(cmd);
+    last = cmd->eof || cmd->command == 'q';
+    ring_publish(&pipeline.commands);
+  } while (!last);
+
+  pthread_join(executor, NULL);
+  pthread_join(formatter, NULL);
+}
+
+/******************************************************************
+ * Sharded mode (-N)                                              *
+ * The router forks one scheduler process per shard, connected by *
+ * a Unix socket pair, and keeps no schedules of its own.  It     *
+ * reads the commands with pipeline_parse, which also keeps the   *
+ * router's own view of which cities have a schedule, and the     *
+ * shards carry them out with pipeline_run.  A city's commands go *
+ * to the shard its name hashes to unless M has moved it; L, p,   *
+ * P, n, w, W, S, T and q go to every shard and the replies are   *
+ * merged.  Requests are gathered and sent in batches without     *
+ * waiting for replies, so the shards run side by side, and the   *
+ * replies are printed in the order the commands were read.       *
+ * Each shard keeps its own snapshot and journal, named after the *
+ * -s and -j files with ".<shard>" added.                         *
+ *****************************************************************/
+static void router_fail(const char *what)
+{
+  output_flush();
+  printf("ERROR: %s.\n", what);
+  exit(EXIT_FAILURE);
+}
+
+static void *router_alloc(size_t bytes)
+{
+  void *p = malloc(bytes > 0 ? bytes : 1);
+  if (p == NULL)
+    router_fail("Out of memory routing a command");
+  return p;
+}
+
+// Queue one reply on the shard's side of the socket
+static void shard_reply(struct server_client *c, struct result_record *res,
+                        const void *payload, uint32_t bytes)
+{
+  struct shard_reply rep;
+
+  memset(&rep, 0, sizeof(rep));
+  rep.res = *res;
+  rep.bytes = bytes;
+  if (res->city != CITY_NONE && res->city < city_table.count)
+    strcpy(rep.name, city_name(res->city));
+  server_queue(c, (const char *)&rep, sizeof(rep));
+  if (bytes > 0)
+    server_queue(c, payload, bytes);
+}
+
+// Carry out one request on a shard.  Returns false for q.
+static bool shard_run(struct server_client *c, struct shard_request *req,
+                      const void *payload)
+{
+  struct command_record *cmd = &req->cmd;
+  struct result_record res;
+  int count;
+
+  memset(&res, 0, sizeof(res));
+  cmd->city = CITY_NONE;
+  if (req->name[0] != '\0' && strchr("AFm", cmd->command) != NULL)
+    cmd->city = city_intern(req->name);
+  else if (req->name[0] != '\0' &&
+           (cmd->city = city_find(req->name)) == CITY_NONE)
+    strcpy(cmd->prefix, req->name); // as pipeline_run expects it
+  if (cmd->command == 'B')
+  {
+    // the tuples of the batch whose cities are here, read without error
+    const struct shard_tuple *tuples = payload;
+    cmd->batch = router_alloc(cmd->args[0] * sizeof(struct batch_tuple));
+    for (int i = 0; i < cmd->args[0]; i++)
+    {
+      struct batch_tuple *t = &cmd->batch[i];
+      memset(t, 0, sizeof(*t));
+      strcpy(t->name, tuples[i].name);
+      t->city = city_find(t->name);
+      t->time = tuples[i].time;
+      t->seats = tuples[i].seats;
+    }
+  }
+  switch (cmd->command)
+  {
+  case 'M': // move out: hand the flights over and drop the schedule
+    res.kind = RESULT_FLIGHTS;
+    res.city = cmd->city;
+    res.status = booking_list_flights(cmd->city, &res.flights, &count);
+    res.count = res.status == BOOKING_OK ? count : 0;
+    if (res.status == BOOKING_OK)
+    {
+      // the subscription goes along, numbered on from where it was
+      uint32_t seq = 0;
+      res.args[0] = feed_unsubscribe(feed.session, cmd->city, &seq);
+      res.args[1] = (int)seq;
+      booking_remove_schedule(cmd->city);
+    }
+    if (waitlist_notices.count > 0)
+    {
+      // its waiters stay behind and are told so after the flights
+      struct result_record notices;
+      msg_waitlist_notices();
+      pipeline_capture(&notices);
+      res.text = notices.text;
+      res.len = notices.len;
+    }
+    break;
+  case 'm': // move in
+    res.kind = RESULT_STATUS;
+    res.city = cmd->city;
+    res.status = booking_add_schedule(cmd->city);
+    if (res.status == BOOKING_OK)
+      res.status = booking_load_flights(cmd->city, payload,
+                                        req->bytes / (3 * sizeof(int)));
+    if (res.status == BOOKING_OK && cmd->args[0])
+      feed_subscribe(&feed.session, NULL, cmd->city, (uint32_t)cmd->args[1]);
+    break;
+  default:
+  {
+#if SCHEDULER_STATS
+    uint64_t started = options.timed ? bench_now() : 0;
+    pipeline_run(cmd, &res);
+    if (options.timed)
+      STATS_COMMAND(cmd->command, bench_now() - started);
+#else
+    pipeline_run(cmd, &res);
+#endif
+  }
+  }
+
+  if (res.kind == RESULT_FLIGHTS && res.status == BOOKING_OK)
+  {
+    // the flights, then the text of any waitlist notices of an M
+    size_t bytes = res.count * 3 * sizeof(int);
+    char *payload = router_alloc(bytes + res.len);
+    memcpy(payload, res.flights, bytes);
+    if (res.len > 0)
+      memcpy(payload + bytes, res.text, res.len);
+    shard_reply(c, &res, payload, bytes + res.len);
+    free(payload);
+    free(res.flights);
+    free(res.text);
+  }
+  else if (res.kind == RESULT_BATCH)
+  {
+    // the tuples, then the text of any waitlist notices
+    size_t bytes = res.count * sizeof(struct batch_tuple);
+    char *payload = router_alloc(bytes + res.len);
+    memcpy(payload, res.batch, bytes);
+    if (res.len > 0)
+      memcpy(payload + bytes, res.text, res.len);
+    shard_reply(c, &res, payload, bytes + res.len);
+    free(payload);
+    free(res.batch);
+    free(res.text);
+  }
+  else if (res.kind == RESULT_TEXT || res.kind == RESULT_ROLL)
+  {
+    shard_reply(c, &res, res.text, res.len);
+    free(res.text);
+  }
+  else
+  {
+    shard_reply(c, &res, NULL, 0);
+  }
+  return cmd->command != 'q';
+}
+
+// A shard's whole life: answer requests until q or until the router goes
+static void shard_serve(int fd)
+{
+  struct server_client c;
+  struct shard_request req;
+  size_t used = 0;
+  bool more = true;
+
+  memset(&c, 0, sizeof(c));
+  c.fd = fd;
+  output.client = &pipeline.captured;
+  while (more)
+  {
+    // every request that has arrived whole
+    while (more && c.in_len - used >= sizeof(req))
+    {
+      memcpy(&req, c.in + used, sizeof(req));
+      size_t need = sizeof(req) + req.bytes;
+      if (c.in_len - used < need)
+        break;
+      void *payload = router_alloc(req.bytes);
+      memcpy(payload, c.in + used + sizeof(req), req.bytes);
+      more = shard_run(&c, &req, payload);
+      free(payload);
+      used += need;
+    }
+    if (used > 0)
+    {
+      memmove(c.in, c.in + used, c.in_len - used);
+      c.in_len -= used;
+      used = 0;
+    }
+
+    // the router may be waiting on these before it sends any more
+    while (c.out_len > 0)
+    {
+      if (!server_send(&c))
+        more = false;
+      if (c.out_len > 0)
+      {
+        struct pollfd pfd = {fd, POLLOUT, 0};
+        poll(&pfd, 1, -1);
+      }
+      if (!more)
+        break;
+    }
+    if (!more)
+      break;
+
+    // wait for more, committing the journal as input_fill does
+    long due = journal_commit_if_due();
+    struct pollfd pfd = {fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, due > 0 ? (int)((due + 999) / 1000) : -1);
+    STATS_POLL(); // SIGUSR1 interrupts the poll
+    if (ready == 0)
+    {
+      journal_commit();
+      continue;
+    }
+    if (ready < 0)
+      continue; // interrupted: fd is blocking, so poll again before reading
+    if (!server_read(&c) || c.eof)
+      break; // the router has gone: stop as at the end of the input
+  }
+  journal_commit();
+  exit(EXIT_SUCCESS);
+}
+
+static char *router_path(const char *path, int k)
+{
+  if (path == NULL)
+    return NULL;
+  char *p = router_alloc(strlen(path) + 16);
+  sprintf(p, "%s.%d", path, k);
+  return p;
+}
+
+// The shard the commands of a city, called name, go to
+static int router_owner(city_id_t city, const char *name)
+{
+  int shard = city_entry(city)->shard;
+  return shard > 0 ? shard - 1 : (int)(city_hash(name) % router.count);
+}
+
+// The name of cmd's city, which is only in the table once it is added
+static const char *router_city(const struct command_record *cmd)
+{
+  return cmd->city == CITY_NONE ? cmd->prefix : city_name(cmd->city);
+}
+
+// Read and write whatever the shards will take.  Returns once something
+// moved if block, at once otherwise.
+static void router_io(bool block)
+{
+  struct pollfd pfd[SHARDS_MAX];
+
+  for (int k = 0; k < router.count; k++)
+  {
+    struct server_client *c = &router.shards[k].conn;
+    pfd[k].fd = c->eof ? -1 : c->fd;
+    pfd[k].events = POLLIN | (c->out_sent < c->out_len ? POLLOUT : 0);
+    pfd[k].revents = 0;
+  }
+  if (poll(pfd, router.count, block ? -1 : 0) <= 0)
+    return;
+  for (int k = 0; k < router.count; k++)
+  {
+    struct router_shard *s = &router.shards[k];
+    if ((pfd[k].revents & POLLOUT) && !server_send(&s->conn))
+      s->conn.eof = true;
+    if (pfd[k].revents & (POLLIN | POLLHUP | POLLERR))
+    {
+      if (s->used > 0 && s->used == s->conn.in_len)
+        s->used = s->conn.in_len = 0;
+      if (!server_read(&s->conn))
+        s->conn.eof = true;
+    }
+  }
+}
+
+static void router_send_all(void)
+{
+  bool pending = true;
+
+  while (pending)
+  {
+    pending = false;
+    for (int k = 0; k < router.count; k++)
+    {
+      struct server_client *c = &router.shards[k].conn;
+      if (!c->eof && c->out_sent < c->out_len && !server_send(c))
+        c->eof = true;
+      pending |= !c->eof && c->out_sent < c->out_len;
+    }
+    if (pending)
+      router_io(true);
+  }
+}
+
+// Queue a request for shard k, sending once a batch has gathered
+static void router_request(int k, const struct command_record *cmd,
+                           const char *name, const void *payload, size_t bytes)
+{
+  struct server_client *c = &router.shards[k].conn;
+  struct shard_request req;
+
+  memset(&req, 0, sizeof(req));
+  req.cmd = *cmd;
+  req.bytes = bytes;
+  if (name != NULL)
+    strcpy(req.name, name);
+  server_queue(c, (const char *)&req, sizeof(req));
+  if (bytes > 0)
+    server_queue(c, payload, bytes);
+  if (c->out_len - c->out_sent >= SHARD_BATCH && !server_send(c))
+    c->eof = true;
+  while (!c->eof && c->out_len - c->out_sent >= SERVER_OUTPUT_MAX)
+    router_io(true); // reading replies meanwhile so the shard can go on
+}
+
+static struct route *router_route(char kind)
+{
+  if (router.head - router.tail == router.size)
+  {
+    size_t size = router.size > 0 ? router.size * 2 : ROUTES_MIN;
+    struct route *routes = router_alloc(size * sizeof(struct route));
+    for (size_t i = router.tail; i < router.head; i++)
+      routes[i & (size - 1)] = router.routes[i & (router.size - 1)];
+    free(router.routes);
+    router.routes = routes;
+    router.size = size;
+  }
+  struct route *r = &router.routes[router.head++ & (router.size - 1)];
+  memset(r, 0, sizeof(*r));
+  r->kind = kind;
+  return r;
+}
+
+// Whether shard k's next reply has arrived whole
+static bool router_ready(int k)
+{
+  struct router_shard *s = &router.shards[k];
+  struct shard_reply rep;
+
+  if (s->conn.in_len - s->used < sizeof(rep))
+    return false;
+  memcpy(&rep, s->conn.in + s->used, sizeof(rep));
+  return s->conn.in_len - s->used >= sizeof(rep) + rep.bytes;
+}
+
+// Take shard k's next reply into res, with the city in the router's ids
+// and its payload in a buffer of its own
+static void router_take(int k, struct result_record *res)
+{
+  struct router_shard *s = &router.shards[k];
+  struct shard_reply rep;
+
+  memcpy(&rep, s->conn.in + s->used, sizeof(rep));
+  *res = rep.res;
+  res->city = rep.name[0] != '\0' ? city_intern(rep.name) : CITY_NONE;
+  res->flights = NULL;
+  res->batch = NULL;
+  res->text = NULL;
+  char *payload = router_alloc(rep.bytes);
+  memcpy(payload, s->conn.in + s->used + sizeof(rep), rep.bytes);
+  if (res->kind == RESULT_FLIGHTS && res->status == BOOKING_OK)
+  {
+    res->flights = (int *)payload;
+    if (res->len > 0)
+    {
+      res->text = router_alloc(res->len);
+      memcpy(res->text, payload + res->count * 3 * sizeof(int), res->len);
+    }
+  }
+  else if (res->kind == RESULT_BATCH)
+  {
+    res->batch = (struct batch_tuple *)payload;
+    if (res->len > 0)
+    {
+      res->text = router_alloc(res->len);
+      memcpy(res->text, payload + res->count * sizeof(struct batch_tuple),
+             res->len);
+    }
+  }
+  else if (res->kind == RESULT_TEXT || res->kind == RESULT_ROLL)
+    res->text = payload;
+  else
+    free(payload);
+  s->used += sizeof(rep) + rep.bytes;
+  if (s->used == s->conn.in_len)
+  {
+    s->used = s->conn.in_len = 0;
+  }
+  else if (s->used >= SERVER_READ_SIZE)
+  {
+    memmove(s->conn.in, s->conn.in + s->used, s->conn.in_len - s->used);
+    s->conn.in_len -= s->used;
+    s->used = 0;
+  }
+}
+
+// Wait for shard k's next reply
+static void router_wait(int k)
 {
-  fs->destination[0] = 0;
-  for (int i = 0; i < MAX_FLIGHTS_PER_CITY; i++)
+  router_send_all();
+  while (!router_ready(k))
   {
-    fs->flights[i].time = TIME_NULL;
-    fs->flights[i].available = 0;
-    fs->flights[i].capacity = 0;
+    if (router.shards[k].conn.eof)
+      router_fail("A shard has stopped");
+    router_io(true);
   }
-  fs->next = NULL;
-  fs->prev = NULL;
 }
 
-/******************************************************************
-* Initializes the flight_schedule array that will hold any flight *
-* schedules created by the user. This is called in main for you.  *
- *****************************************************************/
-
-void flight_schedule_initialize(struct flight_schedule array[], int n)
+// Length of the line of text at p, without its newline
+static size_t router_line(const char *p, const char *end)
 {
-  flight_schedules_active = NULL;
-  flight_schedules_free = NULL;
+  const char *nl = memchr(p, '\n', end - p);
+  return (nl != NULL ? nl : end) - p;
+}
 
-  // takes care of empty array case
-  if (n == 0)
-    return;
+static int router_line_compare(const char *a, size_t alen, const char *b,
+                               size_t blen)
+{
+  int c = memcmp(a, b, alen < blen ? alen : blen);
+  return c != 0 ? c : (alen > blen) - (alen < blen);
+}
 
-  // Loop through the Array connecting them
-  // as a linear doubly linked list
-  array[0].prev = NULL;
-  for (int i = 0; i < n - 1; i++)
-  {
-    flight_schedule_reset(&array[i]);
-    array[i].next = &array[i + 1];
-    array[i + 1].prev = &array[i];
-  }
-  // Takes care of last node.
-  // Its prev pointer will be set in the loop,
-  // we just have to set its next to NULL.
-  array[n - 1].next = NULL;
-  flight_schedules_free = &array[0];
+// Departure time of a line of w's reply: "<city> (<time>, ...)"
+static long router_line_time(const char *line, size_t len)
+{
+  const char *open = line + len;
+  while (open > line && *open != '(')
+    open--;
+  return strtol(open + 1, NULL, 10);
 }
 
-/***********************************************************
- * time_get: read a time from the user
-   Time in this program is a minute number 0-((24*60)-1)=1439
-   -1 is used to indicate the NULL empty time 
-   This function should read in a time value and check its 
-   validity.  If it is not valid eg. not -1 or not 0-1439
-   It should print "Invalid Time" and return false.
-   othewise it should return the value in the integer pointed
-   to by time_ptr.
- ***********************************************************/
-bool time_get(int *time_ptr)
+// Print every shard's lines merged, in name order, or for w in time order
+// after each reply's heading, skipping the first skip and printing at
+// most count
+static void router_merge_lines(struct result_record *res, bool by_time,
+                               long skip, long count)
 {
-  if (scanf("%d", time_ptr) == 1)
+  const char *at[SHARDS_MAX], *end[SHARDS_MAX];
+
+  for (int k = 0; k < router.count; k++)
   {
-    return (TIME_NULL == *time_ptr ||
-            (*time_ptr >= TIME_MIN && *time_ptr <= TIME_MAX));
+    at[k] = res[k].text;
+    end[k] = res[k].text + res[k].len;
+    if (by_time && at[k] < end[k])
+      at[k] += router_line(at[k], end[k]) + 1;
+  }
+  while (count > 0)
+  {
+    int best = -1;
+    const char *line = NULL;
+    size_t best_len = 0;
+    for (int k = 0; k < router.count; k++)
+    {
+      if (at[k] >= end[k])
+        continue;
+      size_t len = router_line(at[k], end[k]);
+      if (best < 0 ||
+          (by_time ? router_line_time(at[k], len) <
+                         router_line_time(line, best_len)
+                   : router_line_compare(at[k], len, line, best_len) < 0))
+      {
+        best = k;
+        line = at[k];
+        best_len = len;
+      }
+    }
+    if (best < 0)
+      break;
+    if (skip > 0)
+    {
+      skip--;
+    }
+    else
+    {
+      output_write(line, best_len);
+      output_char('\n');
+      count--;
+    }
+    at[best] += best_len + 1;
   }
-  msg_time_bad();
-  return false;
 }
 
-/***********************************************************
- * flight_capacity_get: read the capacity of a flight from the user
-   This function should read in a capacity value and check its 
-   validity.  If it is not greater than 0, it should print 
-   "Invalid capacity value" and return false. Othewise it should 
-   return the value in the integer pointed to by cap_ptr.
- ***********************************************************/
-bool flight_capacity_get(int *cap_ptr)
+// Print every shard's T report as one: each family's TYPE line once,
+// followed by all the shards' samples with a shard label added
+static void router_merge_report(struct result_record *res)
 {
-  if (scanf("%d", cap_ptr) == 1)
+  const char *at[SHARDS_MAX], *end[SHARDS_MAX];
+  bool more = true;
+
+  for (int k = 0; k < router.count; k++)
   {
-    return *cap_ptr > 0;
+    at[k] = res[k].text;
+    end[k] = res[k].text + res[k].len;
+  }
+  while (more)
+  {
+    more = false;
+    for (int k = 0; k < router.count; k++)
+    {
+      bool heading = true;
+      while (at[k] < end[k])
+      {
+        size_t len = router_line(at[k], end[k]);
+        const char *line = at[k];
+        if (line[0] == '#')
+        {
+          if (!heading)
+            break; // the next family
+          if (k == 0)
+          {
+            output_write(line, len);
+            output_char('\n');
+          }
+        }
+        else
+        {
+          size_t name = strcspn(line, "{ ");
+          char label[32];
+          output_write(line, name);
+          if (name < len && line[name] == '{')
+          {
+            snprintf(label, sizeof(label), "{shard=\"%d\",", k);
+            name++;
+          }
+          else
+          {
+            snprintf(label, sizeof(label), "{shard=\"%d\"}", k);
+          }
+          output_str(label);
+          output_write(line + name, len - name);
+          output_char('\n');
+        }
+        heading = line[0] == '#';
+        at[k] += len + 1;
+      }
+      more |= at[k] < end[k];
+    }
   }
-  msg_capacity_bad();
-  return false;
 }
 
-void flight_schedule_sort_flights_by_time(struct flight_schedule *fs)
+// Put each shard's outcome of the tuples it was sent back in the batch,
+// which they left in order, and print it, followed by the waitlist
+// notices of every shard in turn
+static void router_merge_batch(struct result_record *batch,
+                               struct result_record *res)
 {
-  qsort(fs->flights, MAX_FLIGHTS_PER_CITY, sizeof(struct flight),
-        flight_compare_time);
+  long next[SHARDS_MAX] = {0};
+
+  for (long i = 0; i < batch->count; i++)
+  {
+    struct batch_tuple *t = &batch->batch[i];
+    if (t->error != PARSE_OK)
+      continue;
+    int k = t->shard;
+    const struct batch_tuple *done = &res[k].batch[next[k]++];
+    t->time = done->time;
+    t->status = done->status;
+  }
+  msg_batch(batch->batch, batch->count);
+  for (int k = 0; k < router.count; k++)
+    output_write(res[k].text, res[k].len);
+  free(batch->batch);
 }
 
-int flight_compare_time(const void *a, const void *b)
+// Print the replies of every shard to a command sent to all of them
+static void router_print_all(struct route *r)
 {
-  const struct flight *af = a;
-  const struct flight *bf = b;
+  struct result_record res[SHARDS_MAX];
+  int best = -1;
+  long count = 0;
 
-  return (af->time - bf->time);
+  for (int k = 0; k < router.count; k++)
+    router_take(k, &res[k]);
+  switch (r->command)
+  {
+  case 'L':
+  case 'p':
+    router_merge_lines(res, false, 0, LONG_MAX);
+    break;
+  case 'P':
+    router_merge_lines(res, false, r->args[0], r->args[1]);
+    break;
+  case 'w':
+    // each shard's reply starts with the same heading
+    msg_window_flights(r->args[0], r->args[1]);
+    router_merge_lines(res, true, 0, LONG_MAX);
+    break;
+  case 'n':
+    // the earliest departure, the lowest shard on a tie
+    for (int k = 0; k < router.count; k++)
+    {
+      if (res[k].kind == RESULT_NEXT &&
+          (best < 0 || res[k].args[0] < res[best].args[0]))
+        best = k;
+    }
+    if (best >= 0)
+      result_print(&res[best]);
+    else
+      msg_flight_no_seats();
+    break;
+  case 'W':
+    for (int k = 0; k < router.count; k++)
+      count += res[k].count;
+    msg_window_count(r->args[0], r->args[1], count);
+    break;
+  case 'D':
+    // every shard rolls its calendar on alike, then its notices follow
+    for (int k = 0; k < router.count; k++)
+      count += res[k].count;
+    msg_roll_forward(count, res[0].args[0], res[0].args[1]);
+    for (int k = 0; k < router.count; k++)
+      output_write(res[k].text, res[k].len);
+    break;
+  case 'S':
+  case 'q':
+    // a failed save prints the same message on every shard that failed
+    for (int k = 0; k < router.count && best < 0; k++)
+    {
+      if (res[k].len > 0)
+      {
+        best = k;
+        output_write(res[k].text, res[k].len);
+      }
+    }
+    break;
+  case 'T':
+    router_merge_report(res);
+    break;
+  case 'B':
+    router_merge_batch(&r->res, res);
+    break;
+  }
+  for (int k = 0; k < router.count; k++)
+  {
+    free(res[k].flights);
+    free(res[k].batch);
+    free(res[k].text);
+  }
 }
 
-struct flight_schedule *flight_schedule_find(city_t city){//active only
-
-  struct flight_schedule *trav = flight_schedules_active; //pointer to traverse array
-
-  while(trav){//sees if the city is the one we're looking for
+// Print the replies that have arrived, in command order, or all of them
+// if wait
+static void router_print(bool wait)
+{
+  while (router.tail < router.head)
+  {
+    struct route *r = &router.routes[router.tail & (router.size - 1)];
+    bool ready = true;
 
-    if(strcmp(city, trav->destination) == 0){//we found the city
-      return trav;
+    if (r->kind == ROUTE_SHARD)
+    {
+      if (wait)
+        router_wait(r->shard);
+      ready = router_ready(r->shard);
+    }
+    else if (r->kind == ROUTE_ALL)
+    {
+      for (int k = 0; k < router.count; k++)
+      {
+        if (wait)
+          router_wait(k);
+        ready = ready && router_ready(k);
+      }
     }
+    if (!ready)
+      return;
 
-    trav = trav->next;
+    if (r->kind == ROUTE_LOCAL)
+    {
+      if (r->res.city == CITY_NONE)
+        strcpy(city_missing.name, r->name); // the name it was read as
+      if (!pipeline_silent(&r->res))
+        result_print(&r->res);
+    }
+    else if (r->kind == ROUTE_SHARD)
+    {
+      struct result_record res;
+      router_take(r->shard, &res);
+      // only an A that ran out of memory fails with BOOKING_NO_FREE, and
+      // the router has already read on as though it had worked
+      bool failed = res.kind == RESULT_STATUS && res.status == BOOKING_NO_FREE;
+      if (!pipeline_silent(&res))
+        result_print(&res); // which frees what it carries
+      else
+        free(res.text);
+      if (failed)
+      {
+        res.kind = RESULT_FAIL;
+        result_print(&res);
+      }
+    }
+    else
+    {
+      router_print_all(r);
+    }
+    router.tail++;
   }
+}
 
-  return trav;
+// input_fill is about to wait: print everything the shards owe first
+static void router_waiting(void)
+{
+  router_print(true);
 }
 
-struct flight_schedule *flight_schedule_allocate(void){
-  struct flight_schedule *fltptr = flight_schedules_free; //pointer to first element of free array
+// M city shard: move the schedule to the shard.  Everything sent to its
+// old shard before is answered first, so the flights it hands over are
+// up to date, and everything after goes to the new one.
+static void router_move(const struct command_record *cmd)
+{
+  struct command_record req;
+  struct result_record res;
+  int from = router_owner(cmd->city, city_name(cmd->city)), to = cmd->args[0];
 
-  if(flight_schedules_free == NULL){//if we've reached the limit for flights
-    return NULL;
+  if (from == to)
+    return;
+  router_print(true);
+  memset(&req, 0, sizeof(req));
+  req.command = 'M';
+  router_request(from, &req, city_name(cmd->city), NULL, 0);
+  router_wait(from);
+  router_take(from, &res);
+  if (res.status != BOOKING_OK)
+  {
+    struct route *r = router_route(ROUTE_LOCAL);
+    r->res.kind = RESULT_STATUS;
+    r->res.status = res.status;
+    r->res.city = cmd->city;
+    free(res.flights);
+    return;
   }
-  if(fltptr->next == NULL){
-    flight_schedules_free = NULL;
-    fltptr->next = flight_schedules_active;
-    flight_schedules_active->prev = fltptr;
-    flight_schedules_active = fltptr;
-  }else if(flight_schedules_active == NULL){//if there's nothing in the active yet
-    flight_schedules_free = flight_schedules_free->next;
-    fltptr->next = NULL; 
-    flight_schedules_free->prev = NULL; //this and above line breaks the pointer off the array
-    flight_schedules_active = fltptr;
-
-  }else{//if there is something in the active
-    flight_schedules_free = flight_schedules_free->next;
-    fltptr->next = NULL; 
-    flight_schedules_free->prev = NULL; //this and above line breaks the pointer off the array
-    flight_schedules_active->prev = fltptr; //makes the first element of the active point to this pointer
-    fltptr->next = flight_schedules_active; // fully attaches it to the list
-    flight_schedules_active = flight_schedules_active->prev; //moves the pointer of the active list back to new beginning}
+  req.command = 'm';
+  req.args[0] = res.args[0]; // whether the session follows the city
+  req.args[1] = res.args[1];
+  router_request(to, &req, city_name(cmd->city), res.flights,
+                 res.count * 3 * sizeof(int));
+  free(res.flights);
+  city_entry(cmd->city)->shard = to + 1;
+  router_route(ROUTE_SHARD)->shard = to;
+  if (res.len > 0)
+  {
+    // the waiters left behind hear of it after the move
+    struct route *r = router_route(ROUTE_LOCAL);
+    r->res.kind = RESULT_TEXT;
+    r->res.text = res.text;
+    r->res.len = res.len;
   }
-  return fltptr;
 }
 
-void flight_schedule_free(struct flight_schedule *fs){
-
-  if(fs->prev == NULL && fs->next == NULL){
-    flight_schedules_active = NULL;
-  
-  }else if(fs->prev == NULL){//this means fs is at the front
-    flight_schedules_active = flight_schedules_active->next;
-    flight_schedules_active->prev = NULL;
-    fs->next = NULL;
-    flight_schedule_reset(fs);
-
-  }else if(fs->next == NULL){//this means fs is at the end
-    fs->prev->next = NULL;
-    fs->prev = NULL;
-    flight_schedule_reset(fs);
+// Split a batch by shard, keeping each shard's tuples in batch order.
+// Every shard gets its part, even an empty one, so the batch is merged
+// from one reply per shard as the commands sent to all of them are.
+static void router_batch(const struct command_record *cmd)
+{
+  struct command_record req = *cmd;
+  struct route *r = router_route(ROUTE_ALL);
+  int count = cmd->args[0];
+  int start[SHARDS_MAX + 1] = {0};
 
-  }else{//fs is somewhere in the middle
-    fs->prev->next = fs->next;
-    fs->next->prev = fs->prev;
-    fs->next = NULL;
-    fs->prev = NULL;
-    flight_schedule_reset(fs);
+  r->command = 'B';
+  r->res.batch = cmd->batch;
+  r->res.count = count;
+  for (int i = 0; i < count; i++)
+  {
+    struct batch_tuple *t = &cmd->batch[i];
+    if (t->error == PARSE_OK)
+    {
+      t->shard = router_owner(t->city, t->name);
+      start[t->shard + 1]++;
+    }
   }
+  for (int k = 0; k < router.count; k++)
+    start[k + 1] += start[k];
 
-  if(flight_schedules_free == NULL){
-    flight_schedules_free = fs;
-    return;
+  struct shard_tuple *tuples = router_alloc(start[router.count] *
+                                            sizeof(struct shard_tuple));
+  int at[SHARDS_MAX];
+  memcpy(at, start, sizeof(at));
+  for (int i = 0; i < count; i++)
+  {
+    const struct batch_tuple *t = &cmd->batch[i];
+    if (t->error != PARSE_OK)
+      continue;
+    struct shard_tuple *w = &tuples[at[(int)t->shard]++];
+    memset(w, 0, sizeof(*w));
+    strcpy(w->name, t->name);
+    w->time = t->time;
+    w->seats = t->seats;
   }
-
-  /*now move fs to beginning of the free list*/
-  flight_schedules_free->prev = fs;
-  fs->next = flight_schedules_free;
-  flight_schedules_free = fs;
+  for (int k = 0; k < router.count; k++)
+  {
+    req.args[0] = start[k + 1] - start[k];
+    router_request(k, &req, NULL, tuples + start[k],
+                   req.args[0] * sizeof(struct shard_tuple));
+  }
+  free(tuples);
 }
 
-void flight_schedule_add(city_t city){ 
+// Send one parsed command where it has to go
+static void router_dispatch(const struct command_record *cmd)
+{
+  struct command_record req = *cmd;
+  struct route *r;
 
-  if(flight_schedule_find(city)){
-    msg_city_exists(city);
+  if (cmd->error != PARSE_OK)
+  {
+    // answered here: the command goes no further than its arguments
+    r = router_route(ROUTE_LOCAL);
+    r->res.kind = cmd->error == PARSE_NO_SCHEDULE ? RESULT_STATUS
+                                                  : RESULT_PARSE;
+    r->res.status = cmd->error == PARSE_NO_SCHEDULE ? BOOKING_NO_SCHEDULE
+                                                    : cmd->error;
+    r->res.city = cmd->city;
+    if (cmd->city == CITY_NONE)
+      strcpy(r->name, cmd->prefix);
     return;
   }
+  switch (cmd->command)
+  {
+  case 'A':
+  case 'R':
+  case 'l':
+  case 'a':
+  case 'r':
+  case 's':
+  case 'u':
+  case 'b':
+  case 'f':
+  case 'Q':
+  case 'c':
+  case 'F':
+  case 'X':
+    r = router_route(ROUTE_SHARD);
+    r->shard = router_owner(cmd->city, router_city(cmd));
+    router_request(r->shard, cmd, router_city(cmd), NULL, 0);
+    break;
+  case 'M':
+    router_move(cmd);
+    break;
+  case 'B':
+    router_batch(cmd);
+    break;
+  case 'P':
+    // every shard's first from + count names hold the page
+    req.args[0] = 0;
+    req.args[1] = cmd->args[0] > INT32_MAX - cmd->args[1]
+                      ? INT32_MAX
+                      : cmd->args[0] + cmd->args[1];
+    // fall through
+  case 'L':
+  case 'p':
+  case 'n':
+  case 'w':
+  case 'W':
+  case 'D':
+  case 'S':
+  case 'T':
+  case 'q':
+    r = router_route(ROUTE_ALL);
+    r->command = cmd->command;
+    r->args[0] = cmd->args[0];
+    r->args[1] = cmd->args[1];
+    for (int k = 0; k < router.count; k++)
+      router_request(k, &req, NULL, NULL, 0);
+    break;
+  case 'h':
+    router_route(ROUTE_LOCAL)->res.kind = RESULT_HELP;
+    break;
+  default:
+    router_route(ROUTE_LOCAL)->res.kind = RESULT_BAD;
+  }
+}
 
-  struct flight_schedule *to_add = flight_schedule_allocate();
-
-  if(to_add == NULL){//if we cannot add any more flights
-    msg_schedule_no_free();
+// Read one command as pipeline_parse does, plus the router's own M
+static void router_parse(struct command_record *cmd)
+{
+  pipeline_parse(cmd);
+  if (cmd->eof || cmd->command != 'M')
     return;
+  cmd->city = city_read();
+  if (cmd->city == CITY_NONE)
+    strcpy(cmd->prefix, city_name(CITY_NONE));
+  if (!city_entry(cmd->city)->scheduled)
+    cmd->error = PARSE_NO_SCHEDULE;
+  else if (!input_int(&cmd->args[0]) || cmd->args[0] < 0 ||
+           cmd->args[0] >= router.count)
+    cmd->error = PARSE_SHARD_BAD;
+}
+
+// Fork count shards, each loading its own snapshot and journal.  Returns
+// in the router only.
+void router_start(int count, const char *snapshot_path,
+                  const char *journal_path)
+{
+  router.count = count;
+  output_flush(); // or the shards would print it again at exit
+  for (int k = 0; k < count; k++)
+  {
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) != 0)
+      router_fail("Cannot connect to a shard");
+    pid_t pid = fork();
+    if (pid < 0)
+      router_fail("Cannot start a shard");
+    if (pid == 0)
+    {
+      for (int j = 0; j < k; j++)
+        close(router.shards[j].conn.fd);
+      close(sv[0]);
+      options.snapshot_path = router_path(snapshot_path, k);
+      if (options.snapshot_path != NULL &&
+          !snapshot_load(options.snapshot_path))
+      {
+        printf("ERROR: Bad snapshot file %s.\n", options.snapshot_path);
+        exit(EXIT_FAILURE);
+      }
+      if (journal_path != NULL)
+      {
+        char *path = router_path(journal_path, k);
+        journal_open(path);
+        free(path);
+      }
+      shard_serve(sv[1]);
+    }
+    close(sv[1]);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    memset(&router.shards[k], 0, sizeof(router.shards[k]));
+    router.shards[k].conn.fd = sv[0];
+    router.shards[k].pid = pid;
   }
+  signal(SIGPIPE, SIG_IGN);
 
-  strcpy(to_add->destination, city);
+  // learn which cities the shards loaded, and where they are
+  struct command_record cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.command = 'L';
+  for (int k = 0; k < count; k++)
+    router_request(k, &cmd, NULL, NULL, 0);
+  for (int k = 0; k < count; k++)
+  {
+    struct result_record res;
+    router_wait(k);
+    router_take(k, &res);
+    for (const char *p = res.text, *end = p + res.len; p < end;)
+    {
+      size_t len = router_line(p, end);
+      city_t name;
+      memcpy(name, p, len);
+      name[len] = '\0';
+      struct city_entry *e = city_entry(city_intern(name));
+      e->scheduled = true;
+      e->shard = k + 1;
+      p += len + 1;
+    }
+    free(res.text);
+  }
 
-  return;
+  // and how far each has rolled its calendar on (D 0 only asks).  One
+  // that stopped before its journal had the last D catches up.
+  int first[SHARDS_MAX], latest = 0;
+  cmd.command = 'D';
+  cmd.args[0] = 0;
+  for (int k = 0; k < count; k++)
+    router_request(k, &cmd, NULL, NULL, 0);
+  for (int k = 0; k < count; k++)
+  {
+    struct result_record res;
+    router_wait(k);
+    router_take(k, &res);
+    free(res.text);
+    first[k] = res.args[0];
+    latest = first[k] > latest ? first[k] : latest;
+  }
+  for (int k = 0; k < count; k++)
+  {
+    if (first[k] == latest)
+      continue;
+    struct result_record res;
+    cmd.args[0] = (latest - first[k]) / MINUTES_PER_DAY;
+    router_request(k, &cmd, NULL, NULL, 0);
+    router_wait(k);
+    router_take(k, &res);
+    free(res.text);
+  }
+  calendar.first_day = latest / MINUTES_PER_DAY;
 }
 
-void flight_schedule_listAll(void){
+// Route commands until q or the end of the input, then wait for the
+// shards to finish
+void router_loop(void)
+{
+  struct command_record cmd;
 
-  struct flight_schedule *trav = flight_schedules_active; //pointer to traverse array
+  input.waiting = router_waiting;
+  do
+  {
+    router_parse(&cmd);
+    if (!cmd.eof)
+      router_dispatch(&cmd);
+    if (++router.routed == SHARD_POLL_COMMANDS)
+    {
+      router.routed = 0;
+      router_io(false);
+      router_print(false);
+    }
+  } while (!cmd.eof && cmd.command != 'q');
+  input.waiting = NULL;
+  router_print(true);
+  output_flush();
 
-  while(trav){//prints then moves to next element
-    printf("%s\n", trav->destination);
-    trav = trav->next;
+  for (int k = 0; k < router.count; k++)
+  {
+    close(router.shards[k].conn.fd);
+    free(router.shards[k].conn.in);
+    free(router.shards[k].conn.out);
+    waitpid(router.shards[k].pid, NULL, 0);
   }
+  free(router.routes);
+}
 
-  return;
+/******************************************************************
+ * Timing report (-B)                                             *
+ * Every command's latency is kept so the report can give exact   *
+ * percentiles.  One line per command type:                       *
+ *   <command> <count> <ops/sec> <p50 ns> <p90 ns> <p99 ns> <max> *
+ * where ops/sec is count over the time spent in that command,    *
+ * followed by an "all" line whose ops/sec is over wall time.     *
+ *****************************************************************/
+uint64_t bench_now(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
 }
 
-void flight_schedule_list(city_t city){
-  struct flight_schedule *city_found = flight_schedule_find(city); // tells whether city exists
+void bench_record(char command, uint64_t ns)
+{
+  struct bench_samples *b = &bench_samples[(unsigned char)command & 127];
 
-  if(city_found == NULL){//if the city does not exist
-    msg_city_bad(city);
-    return;
+  if (b->count == b->size)
+  {
+    size_t size = b->size ? b->size * 2 : 1024;
+    uint32_t *p = realloc(b->ns, size * sizeof(uint32_t));
+    if (p == NULL)
+      return; // drop the sample rather than the run
+    b->ns = p;
+    b->size = size;
   }
+  b->ns[b->count++] = ns > UINT32_MAX ? UINT32_MAX : (uint32_t)ns;
+  b->total_ns += ns;
+}
 
-  msg_city_flights(city);
-  flight_schedule_sort_flights_by_time(city_found);
-  int i;
-  for(i = 0; i < MAX_FLIGHTS_PER_CITY; i++){
-    if(city_found->flights[i].time == TIME_NULL){
-      continue;
-    }
+static int bench_compare(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return (x > y) - (x < y);
+}
 
-    msg_flight_info(city_found->flights[i].time, city_found->flights[i].available, 
-    city_found->flights[i].capacity);
-  }
-  printf("\n");
-  return;
+static void bench_line(FILE *f, const char *name, struct bench_samples *b,
+                       uint64_t elapsed_ns)
+{
+  qsort(b->ns, b->count, sizeof(uint32_t), bench_compare);
+  fprintf(f, "%s %zu %.0f %u %u %u %u\n", name, b->count,
+          elapsed_ns ? b->count * 1e9 / elapsed_ns : 0.0,
+          b->ns[b->count / 2], b->ns[b->count * 90 / 100],
+          b->ns[b->count * 99 / 100], b->ns[b->count - 1]);
 }
 
-void flight_schedule_add_flight(city_t city){
+bool bench_report(const char *path)
+{
+  uint64_t elapsed = bench_now() - ((uint64_t)bench_start.tv_sec * 1000000000u +
+                                    bench_start.tv_nsec);
+  struct bench_samples all = {NULL, 0, 0, 0};
+  FILE *f = fopen(path, "w");
 
-  struct flight_schedule *fltptr = flight_schedule_find(city);
-  if(fltptr == NULL){
-    msg_city_bad(city);
-    return;
+  if (f == NULL)
+    return false;
+  fprintf(f, "# command count ops_per_sec p50_ns p90_ns p99_ns max_ns\n");
+  for (int c = 0; c < 128; c++)
+  {
+    struct bench_samples *b = &bench_samples[c];
+    if (b->count == 0)
+      continue;
+    char name[2] = {(char)c, '\0'};
+    bench_line(f, name, b, b->total_ns);
+    for (size_t i = 0; i < b->count; i++)
+      bench_record(0, b->ns[i]);
   }
-  int x; //variable to store our time
-  int y; //variable to store our capacity
+  all = bench_samples[0];
+  if (all.count > 0)
+    bench_line(f, "all", &all, elapsed);
+  return fclose(f) == 0;
+}
 
-  if(!time_get(&x)){//makes sure time and capacity are valid
-    return;
-  }else if(!flight_capacity_get(&y)){
-    return;
-  }
+/******************************************************************
+ * Statistics                                                     *
+ * Built in unless compiled with -DSCHEDULER_STATS=0, in which    *
+ * case the STATS_* macros expand to nothing.  T prints them and  *
+ * SIGUSR1 writes them to standard error, both in the Prometheus  *
+ * text exposition format:                                        *
+ *   <name>[{label="value",...}] <integer>                        *
+ * Histogram buckets are cumulative and le is inclusive.          *
+ *****************************************************************/
+#if SCHEDULER_STATS
+static const char *const stats_status_names[BOOKING_STATUSES] = {
+    "ok", "nothing", "no_schedule", "exists", "no_free",
+    "max_flights", "bad_time", "no_seats", "all_empty", "too_few",
+    "waitlisted", "no_ticket"};
 
-  int i;
-  for(i = 0; i < MAX_FLIGHTS_PER_CITY; i++){//iterates through flights array 
-    if(fltptr->flights[i].time == TIME_NULL){//looks for a free index
-      fltptr->flights[i].time = x;
-      fltptr->flights[i].capacity = y;
-      fltptr->flights[i].available = y;
-      break;
-    }
-  }
+static void stats_signal(int sig)
+{
+  (void)sig;
+  stats_dump_requested = 1;
+}
 
-  if(i == MAX_FLIGHTS_PER_CITY){//if we couldn't find a free index
-    msg_city_max_flights_reached(city);
-  }
+void stats_init(void)
+{
+  struct sigaction sa;
 
-  return;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = stats_signal; // no SA_RESTART: wake up a blocked read
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
 }
 
-void flight_schedule_remove_flight(city_t city){
+void stats_record(struct stats_histogram *h, uint64_t value)
+{
+  int b = value ? 64 - __builtin_clzll(value) : 0;
+  if (b >= STATS_BUCKETS)
+    b = STATS_BUCKETS - 1;
+  __atomic_fetch_add(&h->buckets[b], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->count, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&h->sum, value, __ATOMIC_RELAXED);
+}
 
-  struct flight_schedule *fltptr = flight_schedule_find(city);
-  if(fltptr == NULL){
-    msg_city_bad(city);
-    return;
-  }
-  int x; //variable to store time input
-  
-  if(!time_get(&x)){
-    return;
-  }
+// Letters and digits are kept apart; everything else is one "other" slot
+void stats_command(char command, uint64_t ns)
+{
+  unsigned char c = command;
+  if (!((c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+        (c >= '0' && c <= '9')))
+    c = 0;
+  stats_record(&stats.command_ns[c], ns);
+}
 
-  int i;
-  for(i = 0; i < MAX_FLIGHTS_PER_CITY; i++){
-    if(fltptr->flights[i].time == x){
-      fltptr->flights[i].time = TIME_NULL;
-      fltptr->flights[i].capacity = 0;
-      fltptr->flights[i].available = 0;
-      break;
-    }
-  }
-  if(i == MAX_FLIGHTS_PER_CITY){
-    msg_flight_bad_time();
-  }
-  return;
+static uint64_t stats_load(const uint64_t *p)
+{
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
 }
 
-void flight_schedule_schedule_seat(city_t city){
+static void stats_histogram_dump(FILE *f, const char *name, const char *labels,
+                                 const struct stats_histogram *h)
+{
+  const char *sep = labels[0] ? "," : "";
+  uint64_t total = 0;
+  int first = -1, last = 0;
 
-  struct flight_schedule *fltptr = flight_schedule_find(city);
-  if(fltptr == NULL){//if the city does not exist
-    msg_city_bad(city);
-    return;
+  // leave out the empty buckets at either end
+  for (int b = 0; b < STATS_BUCKETS; b++)
+  {
+    if (stats_load(&h->buckets[b]) == 0)
+      continue;
+    if (first < 0)
+      first = b;
+    last = b;
   }
-  int x;
-  if(!time_get(&x)){
-    return;
+  for (int b = first < 0 ? 0 : first; b <= last && b < STATS_BUCKETS - 1; b++)
+  {
+    total += stats_load(&h->buckets[b]);
+    fprintf(f, "%s_bucket{%s%sle=\"%llu\"} %llu\n", name, labels, sep,
+            (unsigned long long)((UINT64_C(1) << b) - 1),
+            (unsigned long long)total);
   }
+  fprintf(f, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, sep,
+          (unsigned long long)stats_load(&h->count));
+  fprintf(f, "%s_sum%s%s%s %llu\n", name, labels[0] ? "{" : "", labels,
+          labels[0] ? "}" : "", (unsigned long long)stats_load(&h->sum));
+  fprintf(f, "%s_count%s%s%s %llu\n", name, labels[0] ? "{" : "", labels,
+          labels[0] ? "}" : "", (unsigned long long)stats_load(&h->count));
+}
 
-  int closest_difference = TIME_MAX + 1; //keeps track of closest flightat TIME_MAX+1
-                                         // so that all valid times are counted
-  int difference = 0;
-  int index_closest = -1;
-  int i;
-  for(i = 0; i < MAX_FLIGHTS_PER_CITY; i++){
-    if(fltptr->flights[i].time == TIME_NULL){//if there isn't a flight here
-      continue;
-    }
-    if(fltptr->flights[i].available == 0){//if the flight is already full
-      continue;
-    }
-
-    difference = fltptr->flights[i].time - x;
+void stats_dump(FILE *f)
+{
+  char labels[32];
+  size_t free_count = 0, active_count = 0;
+  struct flight_schedule *fs;
 
-    if(difference < 0){
+  fprintf(f, "# TYPE scheduler_command_latency_ns histogram\n");
+  for (int c = 0; c < 128; c++)
+  {
+    if (stats_load(&stats.command_ns[c].count) == 0)
       continue;
-    }
-    if(difference < closest_difference){
-      closest_difference = difference;
-      index_closest = i;
-    }
+    if (c == 0)
+      snprintf(labels, sizeof(labels), "command=\"other\"");
+    else
+      snprintf(labels, sizeof(labels), "command=\"%c\"", c);
+    stats_histogram_dump(f, "scheduler_command_latency_ns", labels,
+                         &stats.command_ns[c]);
   }
 
-  if(index_closest == -1){
-    msg_flight_no_seats();
-    return;
-  }
-  if(fltptr->flights[index_closest].available == 0){
-    msg_flight_all_seats_empty();
-    return;
-  }
+  fprintf(f, "# TYPE scheduler_find_probes histogram\n");
+  stats_histogram_dump(f, "scheduler_find_probes", "", &stats.find_probes);
 
-  fltptr->flights[index_closest].available -= 1;
+  fprintf(f, "# TYPE scheduler_booking_total counter\n");
+  for (int i = 0; i < BOOKING_STATUSES; i++)
+    fprintf(f, "scheduler_booking_total{status=\"%s\"} %llu\n",
+            stats_status_names[i],
+            (unsigned long long)stats_load(&stats.status[i]));
+  fprintf(f, "# TYPE scheduler_seat_later_flight_total counter\n");
+  fprintf(f, "scheduler_seat_later_flight_total %llu\n",
+          (unsigned long long)stats_load(&stats.seat_later_flight));
+  fprintf(f, "# TYPE scheduler_seat_retries_total counter\n");
+  fprintf(f, "scheduler_seat_retries_total %llu\n",
+          (unsigned long long)stats_load(&stats.seat_retries));
+  fprintf(f, "# TYPE scheduler_waitlist_seated_total counter\n");
+  fprintf(f, "scheduler_waitlist_seated_total %llu\n",
+          (unsigned long long)stats_load(&stats.waitlist_seated));
+  fprintf(f, "# TYPE scheduler_feed_deltas_total counter\n");
+  fprintf(f, "scheduler_feed_deltas_total %llu\n",
+          (unsigned long long)stats_load(&stats.feed_deltas));
+  fprintf(f, "# TYPE scheduler_feed_dropped_total counter\n");
+  fprintf(f, "scheduler_feed_dropped_total %llu\n",
+          (unsigned long long)stats_load(&stats.feed_dropped));
+  fprintf(f, "# TYPE scheduler_flights_retired_total counter\n");
+  fprintf(f, "scheduler_flights_retired_total %llu\n",
+          (unsigned long long)stats_load(&stats.flights_retired));
+
+  // the list lengths are counted rather than kept up to date on every
+  // add and remove, since they are only wanted here
+  flight_schedules_read_lock();
+  for (fs = flight_schedules_active; fs != NULL; fs = fs->next)
+    active_count++;
+  for (fs = flight_schedules_free; fs != NULL; fs = fs->next)
+    free_count++;
+  fprintf(f, "# TYPE scheduler_schedules gauge\n");
+  fprintf(f, "scheduler_schedules{list=\"active\"} %zu\n", active_count);
+  fprintf(f, "scheduler_schedules{list=\"free\"} %zu\n", free_count);
+  fprintf(f, "scheduler_schedules{list=\"unused\"} %zu\n",
+          flight_schedules_pool.bump_left);
+  fprintf(f, "scheduler_schedules{list=\"pool\"} %zu\n",
+          flight_schedules_pool.total);
+  flight_schedules_unlock();
 }
 
-void flight_schedule_unschedule_seat(city_t city){
+void stats_print(void)
+{
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *f = open_memstream(&buf, &len);
 
-  struct flight_schedule *fltptr = flight_schedule_find(city);
-  if(fltptr == NULL){//if the city does not exist
-    msg_city_bad(city);
+  if (f == NULL)
     return;
-  }
-  int x;
-  int i;
-  if(!time_get(&x)){
-    return;
-  }
-  for(i = 0; i < MAX_FLIGHTS_PER_CITY; i++){
-    if(fltptr->flights[i].time == x){
-      if(fltptr->flights[i].capacity == fltptr->flights[i].available){
-        msg_flight_all_seats_empty();
-        return;
-      }
-      fltptr->flights[i].available +=1;
-      break;
-    }
-  }
-  if(i == MAX_FLIGHTS_PER_CITY){
-    msg_flight_bad_time();
-  }
-
-  return;
+  stats_dump(f);
+  if (fclose(f) == 0)
+    output_write(buf, len);
+  free(buf);
 }
 
-void flight_schedule_remove(city_t city){
-
-  struct flight_schedule *to_remove = flight_schedule_find(city);
-  if(to_remove == NULL){//if the city does not exist
-    msg_city_bad(city);
+// Write the statistics to standard error if SIGUSR1 has arrived
+void stats_poll(void)
+{
+  if (!stats_dump_requested)
     return;
-  }
+  stats_dump_requested = 0;
+  stats_dump(stderr);
+  fflush(stderr);
+}
+#else
+void stats_init(void)
+{
+}
 
-  flight_schedule_free(to_remove);
+void stats_print(void)
+{
+  output_str("Statistics are not compiled in.\n");
 }
+#endif
@@ -0,0 +1,352 @@
+/**
+ * Stress test for the seat booking path of the flight scheduler.
+ *  Builds scheduler.c into this program with its main renamed and has many
+ *  threads book and give back seats on one flight at once through the
+ *  booking API, so the compare and swap on the seat count is raced for
+ *  real.  Each thread keeps count of the seats it holds, and a watcher
+ *  thread keeps reading the seat count while they run.  At the end it
+ *  checks that available never left 0 .. capacity, that the seats held
+ *  and the seats available add up to the capacity, and that the open
+ *  bits and counts agree with the seat count.  With -j the changes are
+ *  journaled as well, and ./scheduler replays the journal to check that
+ *  it ends with the same seats.  With -f the watcher also follows the
+ *  flight and checks that its deltas, in the order they are numbered,
+ *  move the seats the way each one says.
+ **/
+
+#define main scheduler_main
+#include "scheduler.c"
+#undef main
+
+// Defaults
+#define DEFAULT_THREADS 16
+#define DEFAULT_OPS 200000 // booking calls per thread
+#define DEFAULT_CAPACITY 8 // small, so the flight keeps filling up
+#define STRESS_TIME 100    // departure time of the flight
+#define STRESS_CITY "Hub"
+
+/******************************************************************************
+ * Structure and Type definitions                                             *
+ ******************************************************************************/
+// One booking thread
+struct stress_thread
+{
+  pthread_t thread;
+  uint64_t rng;   // xorshift64* state
+  long ops;       // booking calls to make
+  long held;      // seats this thread has booked and not given back
+  long booked;    // calls that booked seats
+  long refused;   // s and b calls that found too few seats
+  long failures;  // u and f calls refused for seats this thread holds
+};
+
+/******************************************************************************
+ * Global / External variables                                                *
+ ******************************************************************************/
+city_id_t stress_city;
+int stress_capacity = DEFAULT_CAPACITY;
+int stress_done = 0;       // set when every booking thread has finished
+long stress_out_of_range = 0; // seat counts the watcher saw outside 0..capacity
+long stress_watched = 0;   // seat counts the watcher read
+bool stress_follow = false; // -f: check the deltas as well
+long stress_deltas = 0;    // deltas the watcher took
+long stress_misordered = 0; // deltas that do not follow from the one before
+struct feed_delta stress_last = {0, 0, 0, 0, 0, 0}; // the latest delta taken
+
+/******************************************************************************
+ * Function Prototypes                                                        *
+ ******************************************************************************/
+uint64_t stress_rng(struct stress_thread *t);
+void *stress_book(void *arg);
+void *stress_watch(void *arg);
+void stress_check_deltas(void);
+bool stress_replay(const char *path, int available);
+
+int main(int argc, char *argv[])
+{
+  int threads = DEFAULT_THREADS;
+  long ops = DEFAULT_OPS;
+  const char *journal_path = NULL;
+  int opt;
+
+  // Options:
+  //   -t n     booking threads
+  //   -n n     booking calls per thread
+  //   -c n     capacity of the flight
+  //   -j file  journal the changes to file and check a replay of it
+  //   -f       follow the flight and check its deltas
+  while ((opt = getopt(argc, argv, "t:n:c:j:f")) != -1)
+  {
+    switch (opt)
+    {
+    case 't':
+      threads = atoi(optarg);
+      break;
+    case 'n':
+      ops = atol(optarg);
+      break;
+    case 'c':
+      stress_capacity = atoi(optarg);
+      break;
+    case 'j':
+      journal_path = optarg;
+      break;
+    case 'f':
+      stress_follow = true;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t threads] [-n ops] [-c capacity] "
+                      "[-j file] [-f]\n",
+              argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (threads <= 0 || ops < 0 || stress_capacity <= 0)
+  {
+    fprintf(stderr, "ERROR: Bad stress parameters.\n");
+    exit(EXIT_FAILURE);
+  }
+
+  flight_schedule_initialize(MAX_DEFAULT_SCHEDULES, false);
+  time_index_initialize(1);
+  if (journal_path != NULL)
+  {
+    unlink(journal_path);
+    journal_open(journal_path);
+  }
+  stress_city = city_intern(STRESS_CITY);
+  if (booking_add_schedule(stress_city) != BOOKING_OK ||
+      booking_add_flight(stress_city, STRESS_TIME, stress_capacity) !=
+          BOOKING_OK)
+  {
+    fprintf(stderr, "ERROR: Cannot set up the flight.\n");
+    exit(EXIT_FAILURE);
+  }
+  if (stress_follow)
+    feed_subscribe(&feed.session, NULL, stress_city, 0);
+
+  struct stress_thread *t = calloc(threads, sizeof(struct stress_thread));
+  pthread_t watcher;
+  if (t == NULL)
+  {
+    fprintf(stderr, "ERROR: Out of memory.\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_create(&watcher, NULL, stress_watch, NULL);
+  for (int k = 0; k < threads; k++)
+  {
+    t[k].rng = (k + 1) * 0x9E3779B97F4A7C15ULL;
+    t[k].ops = ops;
+    pthread_create(&t[k].thread, NULL, stress_book, &t[k]);
+  }
+
+  long held = 0, booked = 0, refused = 0, failures = 0;
+  for (int k = 0; k < threads; k++)
+  {
+    pthread_join(t[k].thread, NULL);
+    held += t[k].held;
+    booked += t[k].booked;
+    refused += t[k].refused;
+    failures += t[k].failures;
+  }
+  __atomic_store_n(&stress_done, 1, __ATOMIC_SEQ_CST);
+  pthread_join(watcher, NULL);
+  journal_commit();
+  if (stress_follow)
+    stress_check_deltas(); // the ones left in the ring
+
+  // Everything has stopped, so the hints must be exact now
+  struct flight_schedule *fs = flight_schedule_find(stress_city);
+  int available = fs->available[0];
+  bool open_bit = (fs->open_seats[0] & 1) != 0;
+  int open_count = time_index_bucket(STRESS_TIME)->open_count;
+  long open_flights = time_index_count(STRESS_TIME, STRESS_TIME);
+  bool ok = true;
+
+  printf("threads %d, calls %ld, booked %ld, refused %ld\n", threads,
+         threads * ops, booked, refused);
+  printf("capacity %d, available %d, held %ld\n", stress_capacity, available,
+         held);
+  if (available < 0 || available > stress_capacity)
+  {
+    printf("FAIL: available is outside 0 .. capacity\n");
+    ok = false;
+  }
+  if (held + available != stress_capacity)
+  {
+    printf("FAIL: held + available is not the capacity\n");
+    ok = false;
+  }
+  if (stress_out_of_range > 0)
+  {
+    printf("FAIL: %ld of %ld seat counts read while booking were outside "
+           "0 .. capacity\n",
+           stress_out_of_range, stress_watched);
+    ok = false;
+  }
+  if (stress_follow)
+  {
+    printf("deltas %ld, last %u leaves %d\n", stress_deltas, stress_last.seq,
+           stress_last.available);
+    if (stress_misordered > 0)
+    {
+      printf("FAIL: %ld deltas do not follow from the one numbered before\n",
+             stress_misordered);
+      ok = false;
+    }
+    if (stress_last.seq > 0 && stress_last.available != available)
+    {
+      printf("FAIL: the last delta does not leave the seats available\n");
+      ok = false;
+    }
+  }
+  if (failures > 0)
+  {
+    printf("FAIL: %ld seats held were refused when given back\n", failures);
+    ok = false;
+  }
+  if (open_bit != (available > 0) || open_count != (available > 0) ||
+      open_flights != (available > 0))
+  {
+    printf("FAIL: the open bits and counts disagree with the seat count\n");
+    ok = false;
+  }
+  if (journal_path != NULL && !stress_replay(journal_path, available))
+  {
+    printf("FAIL: replaying the journal gives different seats\n");
+    ok = false;
+  }
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  free(t);
+  return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// xorshift64*, one state per thread
+uint64_t stress_rng(struct stress_thread *t)
+{
+  t->rng ^= t->rng >> 12;
+  t->rng ^= t->rng << 25;
+  t->rng ^= t->rng >> 27;
+  return t->rng * 0x2545F4914F6CDD1DULL;
+}
+
+/****************************************************************
+ * Booking thread: s, u, b and f at random on the one flight.   *
+ * Seats are only given back when this thread holds them, so a  *
+ * refused u or f means seats went missing.                     *
+ ****************************************************************/
+void *stress_book(void *arg)
+{
+  struct stress_thread *t = arg;
+
+  for (long i = 0; i < t->ops; i++)
+  {
+    uint64_t r = stress_rng(t);
+    int seats = r % 8 < 6 ? 1 : 1 + (int)((r >> 8) % 3);
+    bool give = (r >> 16) % 2 == 1 && t->held >= seats;
+    int status;
+
+    if (give)
+    {
+      status = seats == 1 ? booking_unschedule_seat(stress_city, STRESS_TIME)
+                          : booking_free_seats(stress_city, STRESS_TIME, seats);
+      if (status == BOOKING_OK)
+        t->held -= seats;
+      else
+        t->failures++;
+    }
+    else
+    {
+      status = seats == 1 ? booking_schedule_seat(stress_city, STRESS_TIME)
+                          : booking_book_seats(stress_city, STRESS_TIME, seats);
+      if (status == BOOKING_OK)
+      {
+        t->held += seats;
+        t->booked++;
+      }
+      else
+      {
+        t->refused++;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Watcher thread: the seat count must stay in 0 .. capacity throughout
+void *stress_watch(void *arg)
+{
+  struct flight_schedule *fs = flight_schedule_find(stress_city);
+
+  (void)arg;
+  while (!__atomic_load_n(&stress_done, __ATOMIC_SEQ_CST))
+  {
+    int v = __atomic_load_n(&fs->available[0], __ATOMIC_RELAXED);
+    if (v < 0 || v > stress_capacity)
+      stress_out_of_range++;
+    stress_watched++;
+    if (stress_follow)
+      stress_check_deltas();
+  }
+  return NULL;
+}
+
+/****************************************************************
+ * Takes the deltas in the ring.  One numbered right after the  *
+ * one before must have moved 1 to 3 seats from what that one   *
+ * left, down for an s and up for a u.  Deltas lost to a full   *
+ * ring show as a gap in the numbers and are not compared.      *
+ ****************************************************************/
+void stress_check_deltas(void)
+{
+  struct feed_delta deltas[256];
+  int n;
+
+  while ((n = feed_take(feed.session, deltas, 256)) > 0)
+  {
+    for (int k = 0; k < n; k++)
+    {
+      const struct feed_delta *d = &deltas[k];
+      int moved = d->available - stress_last.available;
+      if (d->op == 's')
+        moved = -moved;
+      if (stress_last.seq > 0 && d->seq == stress_last.seq + 1 &&
+          (moved < 1 || moved > 3))
+        stress_misordered++;
+      stress_last = *d;
+      stress_deltas++;
+    }
+  }
+}
+
+/****************************************************************
+ * Replays the journal in ./scheduler and compares its l with   *
+ * the seats left here.  A record out of order would make the   *
+ * replay refuse a u or f, which prints a message of its own.   *
+ ****************************************************************/
+bool stress_replay(const char *path, int available)
+{
+  char command[256], expected[128], got[256];
+  size_t len = 0, n;
+
+  snprintf(command, sizeof(command),
+           "printf 'l %s\\n' | ./scheduler -q -j '%s'", STRESS_CITY, path);
+  snprintf(expected, sizeof(expected),
+           "The flights for %s are: (%d, %d, %d)\n", STRESS_CITY,
+           STRESS_TIME, available, stress_capacity);
+  FILE *p = popen(command, "r");
+  if (p == NULL)
+    return false;
+  while (len < sizeof(got) - 1 &&
+         (n = fread(got + len, 1, sizeof(got) - 1 - len, p)) > 0)
+    len += n;
+  got[len] = '\0';
+  if (pclose(p) != 0)
+    return false;
+  if (strcmp(got, expected) != 0)
+  {
+    printf("replay printed: %s", got);
+    return false;
+  }
+  return true;
+}